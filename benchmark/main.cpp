@@ -0,0 +1,328 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <sys/resource.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "tinycar.hpp"
+
+#define BENCHMARK_SUSTAINABLE_LOSS 0.01 // a rate is sustainable if less than 1% of the frames are lost or incomplete
+#define BENCHMARK_DRAIN_TIME 300 // ms after a step, so frames in flight are counted for the step that sent them
+#define BENCHMARK_RATE_FACTOR 1.5 // between two steps
+#define BENCHMARK_FAILED_STEPS 2 // unsustainable steps in a row after which the benchmark stops
+
+// Counts the heap allocations of the whole process. glibc lets the executable replace malloc and friends, the originals stay
+// available as __libc_*. operator new and the allocator of OpenCV end up here as well.
+static std::atomic<uint64_t> heapAllocations{0};
+#ifdef __GLIBC__
+#define BENCHMARK_COUNTS_ALLOCATIONS
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) __THROW {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) __THROW {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) __THROW {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) __THROW {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) __THROW {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) __THROW {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr || size == 0 ? 0 : ENOMEM;
+}
+}
+#endif
+
+char* getCmdOption(char ** begin, char ** end, const std::string& option) {
+    char** itr = std::find(begin, end, option);
+    if (itr != end && ++itr != end) {
+        return *itr;
+    }
+    return 0;
+}
+
+bool cmdOptionExists(char** begin, char** end, const std::string& option) {
+    return std::find(begin, end, option) != end;
+}
+
+double threadCpuNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+double processCpuNs() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+}
+
+/// @brief Sends the datagrams of a prepared frame over loopback at a fixed frame rate, like the car does in bursts.
+/// The JPEG is encoded once, only the headers change per frame, so the sender stays cheap compared to the receiver.
+class LoopbackSender {
+public:
+    LoopbackSender(const std::vector<uint8_t>& jpeg, int width, int height) {
+        sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+        addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(RTP_PORT);
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+        uint32_t stride = DGRAM_SIZE - sizeof(tcfp_header_t);
+        uint32_t count = (jpeg.size() + stride - 1) / stride;
+        for (uint32_t i = 0; i < count; i++) {
+            size_t offset = (size_t)i * stride;
+            size_t len = std::min((size_t)stride, jpeg.size() - offset);
+            std::vector<uint8_t> datagram(sizeof(tcfp_header_t) + len);
+            tcfp_header_t* header = reinterpret_cast<tcfp_header_t*>(datagram.data());
+            *header = {0};
+            header->fragment_offset = offset;
+            header->marker = i == count - 1;
+            header->fragment_count = count;
+            header->width = width / 8;
+            header->height = height / 8;
+            memcpy(datagram.data() + sizeof(tcfp_header_t), jpeg.data() + offset, len);
+            datagrams.push_back(std::move(datagram));
+        }
+        startTime = std::chrono::steady_clock::now();
+    }
+
+    ~LoopbackSender() {
+        close(sockfd);
+    }
+
+    size_t getFragmentCount() {
+        return datagrams.size();
+    }
+
+    /// @brief Sends frames at rate fps for duration, paced with absolute deadlines
+    /// @return frames sent
+    uint64_t run(double fps, std::chrono::milliseconds duration) {
+        double cpuStart = threadCpuNs();
+        auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / fps));
+        auto start = std::chrono::steady_clock::now();
+        auto end = start + duration;
+        auto deadline = start;
+        uint64_t frames = 0;
+        while (deadline < end) {
+            std::this_thread::sleep_until(deadline);
+            uint32_t timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+            frameNum++;
+            for (auto& datagram : datagrams) {
+                tcfp_header_t* header = reinterpret_cast<tcfp_header_t*>(datagram.data());
+                header->timestamp = timestamp;
+                header->frame_num = frameNum;
+                header->seq_num = seqNum++;
+                sendto(sockfd, datagram.data(), datagram.size(), 0, (struct sockaddr*)&addr, sizeof(addr));
+            }
+            frames++;
+            deadline += period;
+        }
+        cpuNs = threadCpuNs() - cpuStart;
+        return frames;
+    }
+
+    /// @brief CPU time of the last run
+    double getCpuNs() {
+        return cpuNs;
+    }
+private:
+    int sockfd;
+    struct sockaddr_in addr;
+    std::vector<std::vector<uint8_t>> datagrams;
+    std::chrono::steady_clock::time_point startTime;
+    uint16_t frameNum = 0;
+    uint8_t seqNum = 0;
+    double cpuNs = 0.0;
+};
+
+int main(int argc, char** argv) {
+    if (cmdOptionExists(argv, argv + argc, "-h") || cmdOptionExists(argv, argv + argc, "--help")) {
+        std::cout << "Usage: " << argv[0] << " -s <width>x<height> -q <quality> -f <fps> -m <fps> -d <ms> -w <workers> -l -i -u -a" << std::endl;
+        std::cout << "Sends frames over loopback at increasing rates and reports how many the receive path of the runtime sustains. Needs the frame port, stop the runtime first." << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -s <width>x<height> Resolution, multiples of 8 (default 320x240)" << std::endl;
+        std::cout << "  -q <quality>        JPEG quality (default 80)" << std::endl;
+        std::cout << "  -f <fps>            First rate (default 30)" << std::endl;
+        std::cout << "  -m <fps>            Last rate (default 10000)" << std::endl;
+        std::cout << "  -d <ms>             Duration of every rate (default 2000)" << std::endl;
+        std::cout << "  -w <workers>        Decode on <workers> threads (default 0, on the frame thread)" << std::endl;
+        std::cout << "  -l                  With -w, deliver frames as soon as they are decoded" << std::endl;
+        std::cout << "  -i                  Decode frames while their fragments arrive" << std::endl;
+        std::cout << "  -u                  Receive with io_uring" << std::endl;
+        std::cout << "  -a                  Receive on the single network thread of the reactor" << std::endl;
+        std::cout << "  -h                  Show this help" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int width = 320;
+    int height = 240;
+    int quality = 80;
+    double firstRate = 30.0;
+    double lastRate = 10000.0;
+    std::chrono::milliseconds duration(2000);
+    if (char* value = getCmdOption(argv, argv + argc, "-s")) {
+        if (sscanf(value, "%dx%d", &width, &height) != 2) {
+            std::cerr << "Invalid resolution " << value << std::endl;
+            return EXIT_FAILURE;
+        }
+        width = std::max(8, std::min(width - width % 8, 255 * 8));
+        height = std::max(8, std::min(height - height % 8, 255 * 8));
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-q")) {
+        quality = std::atoi(value);
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-f")) {
+        firstRate = std::max(1.0, std::atof(value));
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-m")) {
+        lastRate = std::atof(value);
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-d")) {
+        duration = std::chrono::milliseconds(std::atoi(value));
+    }
+    tinycar_options_t options;
+    if (cmdOptionExists(argv, argv + argc, "-u")) {
+        options.receiveBackend = TCFP_ReceiveBackend::IO_URING;
+    }
+    options.useReactor = cmdOptionExists(argv, argv + argc, "-a");
+
+    // same bars as the test pattern of the emulator. Every frame is the same JPEG, use -q to change its size
+    cv::Mat image(height, width, CV_8UC3);
+    for (int x = 0; x < width; x++) {
+        uint8_t v = (uint8_t)(x * 255 / width);
+        image.col(x).setTo(cv::Scalar(v, 255 - v, (x / 16 % 2) * 255));
+    }
+    std::vector<uint8_t> jpeg;
+    cv::imencode(".jpg", image, jpeg, {cv::IMWRITE_JPEG_QUALITY, quality});
+    LoopbackSender sender(jpeg, width, height);
+    if (sender.getFragmentCount() > MAX_FRAGMENT_COUNT) {
+        std::cerr << "A frame of " << jpeg.size() << " bytes needs more than " << MAX_FRAGMENT_COUNT << " fragments" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    Tinycar car("127.0.0.1", options);
+    if (char* value = getCmdOption(argv, argv + argc, "-w")) {
+        car.setDecodeWorkers(std::atoi(value), cmdOptionExists(argv, argv + argc, "-l"));
+    }
+    car.setStreamingDecode(cmdOptionExists(argv, argv + argc, "-i"));
+    car.start();
+
+    // takes the frames like the GUI, as fast as they come
+    std::atomic<bool> running{true};
+    std::atomic<uint64_t> consumed{0};
+    std::atomic<double> consumerCpuNs{0.0};
+    std::thread consumer([&]() {
+        cv::Mat frame;
+        double cpuStart = threadCpuNs();
+        while (running) {
+            if (car.waitForImage(frame, 100)) {
+                consumed++;
+            }
+            consumerCpuNs = threadCpuNs() - cpuStart;
+        }
+    });
+
+    std::cout << "Frame: " << width << "x" << height << ", " << jpeg.size() << " bytes, " << sender.getFragmentCount() << " fragments, "
+              << car.getDecodeWorkerCount() << " decode workers" << std::endl;
+    printf("%8s %8s | %9s | %9s %7s | %9s %7s | %9s %7s | %9s %9s %9s\n", "target", "sent", "dgram drop", "reasm fps", "drop", "decode fps", "drop",
+           "take fps", "skipped", "rx us/fr", "cpu us/fr", "allocs/fr");
+
+    double sustainable = 0.0;
+    int failed = 0;
+    for (double rate = firstRate; rate <= lastRate && failed < BENCHMARK_FAILED_STEPS; rate *= BENCHMARK_RATE_FACTOR) {
+        tcfp_receive_stats_t before = car.getReceiveStats();
+        uint64_t consumedBefore = consumed;
+        uint64_t skippedBefore = car.getSkippedFrameCount();
+        double consumerCpuBefore = consumerCpuNs;
+        double cpuBefore = processCpuNs();
+        uint64_t allocationsBefore = heapAllocations;
+
+        uint64_t sent = sender.run(rate, duration);
+        std::this_thread::sleep_for(std::chrono::milliseconds(BENCHMARK_DRAIN_TIME));
+
+        tcfp_receive_stats_t after = car.getReceiveStats();
+        double seconds = duration.count() / 1000.0;
+        uint64_t datagramsSent = sent * sender.getFragmentCount();
+        uint64_t datagrams = after.datagrams - before.datagrams;
+        uint64_t complete = after.frames_complete - before.frames_complete;
+        uint64_t incomplete = after.frames_incomplete - before.frames_incomplete;
+        uint64_t taken = consumed - consumedBefore;
+        uint64_t skipped = car.getSkippedFrameCount() - skippedBefore;
+        // every decoded frame is either taken by the consumer or replaced in the mailbox before
+        uint64_t decoded = taken + skipped;
+        double runtimeCpu = processCpuNs() - cpuBefore - sender.getCpuNs() - (consumerCpuNs - consumerCpuBefore);
+
+        double datagramDrop = datagramsSent > 0 ? 1.0 - (double)std::min(datagrams, datagramsSent) / datagramsSent : 0.0;
+        // frames that never completed, incomplete frames count as lost as well
+        double reassemblyDrop = sent > 0 ? 1.0 - (double)std::min(complete, sent) / sent : 0.0;
+        double decodeDrop = complete + incomplete > 0 ? 1.0 - (double)std::min(decoded, complete + incomplete) / (complete + incomplete) : 0.0;
+        double skippedShare = decoded > 0 ? (double)skipped / decoded : 0.0;
+        double receiveUs = complete + incomplete > 0 ? (after.receive_cpu_ns - before.receive_cpu_ns) / 1000.0 / (complete + incomplete) : 0.0;
+        double cpuUs = decoded > 0 ? runtimeCpu / 1000.0 / decoded : 0.0;
+        // everything the process allocated during the step, including the sender and the consumer
+        double allocations = decoded > 0 ? (double)(heapAllocations - allocationsBefore) / decoded : 0.0;
+
+        printf("%8.0f %8.0f | %8.2f%% | %9.0f %6.2f%% | %10.0f %6.2f%% | %9.0f %6.2f%% | %9.1f %9.1f %9.2f\n", rate, sent / seconds, datagramDrop * 100.0,
+               complete / seconds, reassemblyDrop * 100.0, decoded / seconds, decodeDrop * 100.0, taken / seconds, skippedShare * 100.0, receiveUs, cpuUs, allocations);
+        fflush(stdout);
+
+        bool ok = sent > 0 && (double)decoded / sent >= 1.0 - BENCHMARK_SUSTAINABLE_LOSS && reassemblyDrop < BENCHMARK_SUSTAINABLE_LOSS;
+        if (ok) {
+            sustainable = sent / seconds;
+            failed = 0;
+        } else {
+            failed++;
+        }
+    }
+    std::cout << "Max sustainable rate: " << (int)sustainable << " fps (less than " << BENCHMARK_SUSTAINABLE_LOSS * 100.0 << "% of the frames lost)" << std::endl;
+    frame_buffer_pool_stats_t poolStats = FrameBufferPool::getInstance()->getStats();
+    std::cout << "Frame buffers: " << poolStats.buffers << " (" << poolStats.bytes / 1024 << " KiB), " << poolStats.allocations << " allocated, "
+              << poolStats.reuses << " reused" << std::endl;
+    decode_pool_stats_t decodeStats = car.getDecodeStats();
+    if (car.getDecodeWorkerCount() > 0) {
+        std::cout << "Decode workers: " << decodeStats.reordered << " frames reordered, " << decodeStats.dropped_queued << " dropped in the queue, "
+                  << decodeStats.dropped_late << " dropped late" << std::endl;
+    }
+    if (car.isStreamingDecode()) {
+        std::cout << "Streaming decode: " << decodeStats.streamed << " of " << decodeStats.submitted << " frames decoded while they were received" << std::endl;
+    }
+#ifndef BENCHMARK_COUNTS_ALLOCATIONS
+    std::cout << "Heap allocations are only counted with glibc" << std::endl;
+#endif
+
+    running = false;
+    consumer.join();
+    // the listener threads of the car block in receive and are not stopped, so the process ends here
+    std::_Exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,111 @@
+#include <iostream>
+#include <cstdlib>
+#include <csignal>
+#include <algorithm>
+#include <atomic>
+
+#include "tinycar_emulator.hpp"
+
+std::atomic<bool> stopRequested{false};
+
+char* getCmdOption(char ** begin, char ** end, const std::string& option) {
+    char** itr = std::find(begin, end, option);
+    if (itr != end && ++itr != end) {
+        return *itr;
+    }
+    return 0;
+}
+
+bool cmdOptionExists(char** begin, char** end, const std::string& option) {
+    return std::find(begin, end, option) != end;
+}
+
+int main(int argc, char** argv) {
+    if (cmdOptionExists(argv, argv + argc, "-h") || cmdOptionExists(argv, argv + argc, "--help")) {
+        std::cout << "Usage: " << argv[0] << " -t <ip> -l <port> -f <file> -r <fps> -s <width>x<height> -q <quality> -g <bytes> -e <n> -x <percent> -o <percent> -d <ms> -j <ms> -y <percent> -z <seed>" << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -t <ip>             Address of the runtime (default 127.0.0.1)" << std::endl;
+        std::cout << "  -l <port>           Port the emulator receives TCCP on (default " << TCCP_PORT << ", use another one if the runtime runs on the same host)" << std::endl;
+        std::cout << "  -f <file>           Video that is streamed in a loop (default: test pattern)" << std::endl;
+        std::cout << "  -r <fps>            Frame rate (default 30)" << std::endl;
+        std::cout << "  -s <width>x<height> Resolution, multiples of 8 (default 320x240)" << std::endl;
+        std::cout << "  -q <quality>        Initial JPEG quality (default 80)" << std::endl;
+        std::cout << "  -g <bytes>          Payload bytes per fragment (default " << DGRAM_SIZE - sizeof(tcfp_header_t) << ")" << std::endl;
+        std::cout << "  -e <n>              Send a parity datagram per n fragments (default 0 = off)" << std::endl;
+        std::cout << "  -x <percent>        Drop datagrams" << std::endl;
+        std::cout << "  -o <percent>        Reorder datagrams" << std::endl;
+        std::cout << "  -d <ms>             Delay datagrams" << std::endl;
+        std::cout << "  -j <ms>             Add up to <ms> of random delay to datagrams" << std::endl;
+        std::cout << "  -y <percent>        Drop received control messages" << std::endl;
+        std::cout << "  -z <seed>           Seed of the emulated network (default 1)" << std::endl;
+        std::cout << "  -h                  Show this help" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    emulator_options_t options;
+    if (char* value = getCmdOption(argv, argv + argc, "-t")) {
+        options.runtimeHost = std::string(value);
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-l")) {
+        options.controlPort = std::atoi(value);
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-f")) {
+        options.videoPath = std::string(value);
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-r")) {
+        options.fps = std::atof(value);
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-s")) {
+        if (sscanf(value, "%dx%d", &options.width, &options.height) != 2) {
+            std::cerr << "Invalid resolution " << value << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-q")) {
+        options.jpegQuality = std::atoi(value);
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-g")) {
+        options.fragmentSize = std::atoi(value);
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-e")) {
+        options.fecGroupSize = std::atoi(value);
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-x")) {
+        options.loss = std::atof(value) / 100.0;
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-o")) {
+        options.reorder = std::atof(value) / 100.0;
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-d")) {
+        options.delay = std::atoi(value);
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-j")) {
+        options.jitter = std::atoi(value);
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-y")) {
+        options.controlLoss = std::atof(value) / 100.0;
+    }
+    if (char* value = getCmdOption(argv, argv + argc, "-z")) {
+        options.seed = std::atoi(value);
+    }
+
+    TinycarEmulator emulator(options);
+    if (emulator.start() != 0) {
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, [](int) { stopRequested = true; });
+    signal(SIGTERM, [](int) { stopRequested = true; });
+
+    emulator_stats_t last = emulator.getStats();
+    while (!stopRequested) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        emulator_stats_t stats = emulator.getStats();
+        std::cout << "frames " << stats.frames_sent - last.frames_sent << "/s, datagrams " << stats.datagrams_sent - last.datagrams_sent
+                  << "/s, dropped " << stats.datagrams_dropped - last.datagrams_dropped << "/s, NACKs " << stats.nack_messages
+                  << ", retransmitted " << stats.fragments_retransmitted << ", stream control " << stats.stream_control_messages
+                  << ", control applied " << stats.control_applied << ", stale " << stats.control_stale << std::endl;
+        last = stats;
+    }
+    emulator.stop();
+    return 0;
+}
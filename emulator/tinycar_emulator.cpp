@@ -0,0 +1,356 @@
+#include "tinycar_emulator.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <poll.h>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "tcfp_fec.hpp"
+
+TinycarEmulator::TinycarEmulator(const emulator_options_t& options): options(options), rng(options.seed), controlRng(options.seed + 1) {
+    this->options.width = std::max(8, std::min(options.width - options.width % 8, 255 * 8));
+    this->options.height = std::max(8, std::min(options.height - options.height % 8, 255 * 8));
+    this->options.fragmentSize = std::max(64, std::min(options.fragmentSize, (int)(DGRAM_SIZE - sizeof(tcfp_header_t))));
+    this->options.fecGroupSize = std::max(0, std::min(options.fecGroupSize, MAX_FRAGMENT_COUNT));
+    jpegQuality = options.jpegQuality;
+    stats = {0};
+    control = {0};
+}
+
+TinycarEmulator::~TinycarEmulator() {
+    stop();
+}
+
+int TinycarEmulator::start() {
+    if (running) {
+        return 0;
+    }
+    if (!options.videoPath.empty() && !video.open(options.videoPath)) {
+        std::cerr << "\033[1;31m[Tinycar] Emulator Error: could not open video " << options.videoPath << "\033[0m" << std::endl;
+        return -1;
+    }
+    runtimeAddr = {0};
+    runtimeAddr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, options.runtimeHost.c_str(), &runtimeAddr.sin_addr) <= 0) {
+        std::cerr << "\033[1;31m[Tinycar] Emulator Error: " << options.runtimeHost << " is not an IPv4 address" << "\033[0m" << std::endl;
+        return -1;
+    }
+    sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    sockaddr_in servaddr = {0};
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = INADDR_ANY;
+    servaddr.sin_port = htons(options.controlPort);
+    if (bind(sockfd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+        std::cerr << "\033[1;31m[Tinycar] Emulator Error: bind error for port " << options.controlPort << ": " << errno << "\033[0m" << std::endl;
+        close(sockfd);
+        sockfd = -1;
+        return -1;
+    }
+
+    startTime = std::chrono::steady_clock::now();
+    lastRttStart = startTime - std::chrono::milliseconds(EMULATOR_RTT_INTERVAL);
+    running = true;
+    sendThread = std::thread(&TinycarEmulator::send_task, this);
+    controlThread = std::thread(&TinycarEmulator::control_task, this);
+    frameThread = std::thread(&TinycarEmulator::frame_task, this);
+    std::cout << "\033[1;32m[Tinycar] Emulator Info: streaming " << options.width << "x" << options.height << " at " << options.fps
+              << " fps to " << options.runtimeHost << ", control port " << options.controlPort << "\033[0m" << std::endl;
+    return 0;
+}
+
+void TinycarEmulator::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    send_cv.notify_all();
+    frameThread.join();
+    sendThread.join();
+    controlThread.join();
+    close(sockfd);
+    sockfd = -1;
+}
+
+emulator_stats_t TinycarEmulator::getStats() {
+    std::lock_guard<std::mutex> lk(stats_m);
+    return stats;
+}
+
+tccp_control_t TinycarEmulator::getControl() {
+    std::lock_guard<std::mutex> lk(stats_m);
+    return control;
+}
+
+uint32_t TinycarEmulator::timestamp() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void TinycarEmulator::frame_task() {
+    auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / std::max(options.fps, 0.1)));
+    auto next = std::chrono::steady_clock::now();
+    auto fpsStart = next;
+    uint32_t fpsFrames = 0;
+    cv::Mat image;
+    while (running) {
+        nextImage(image);
+        sendFrame(image);
+
+        fpsFrames++;
+        auto now = std::chrono::steady_clock::now();
+        if (now - fpsStart >= std::chrono::seconds(1)) {
+            currentFps = fpsFrames;
+            fpsFrames = 0;
+            fpsStart = now;
+        }
+        next += interval;
+        if (next < now) {
+            // too slow for the frame rate, do not try to catch up with a burst
+            next = now;
+        }
+        std::this_thread::sleep_until(next);
+    }
+}
+
+void TinycarEmulator::nextImage(cv::Mat& image) {
+    int scale = 1 << frameSize;
+    cv::Size size(std::max(8, options.width / scale / 8 * 8), std::max(8, options.height / scale / 8 * 8));
+    cv::Mat source;
+    if (video.isOpened()) {
+        if (!video.read(source)) {
+            video.set(cv::CAP_PROP_POS_FRAMES, 0);
+            video.read(source);
+        }
+    }
+    if (source.empty()) {
+        // moving bars, so every frame differs and the decoder has some work to do
+        source = cv::Mat(size, CV_8UC3);
+        for (int x = 0; x < size.width; x++) {
+            uint8_t v = (uint8_t)((x + frameNum * 4) * 255 / std::max(1, size.width));
+            source.col(x).setTo(cv::Scalar(v, 255 - v, (x / 16 % 2) * 255));
+        }
+        cv::putText(source, std::to_string(frameNum), cv::Point(8, size.height - 8), cv::FONT_HERSHEY_SIMPLEX, 1.0, cv::Scalar(255, 255, 255), 2);
+    }
+    if (source.size() != size) {
+        cv::resize(source, image, size);
+    } else {
+        image = source;
+    }
+}
+
+void TinycarEmulator::sendFrame(const cv::Mat& image) {
+    auto encodeStart = std::chrono::steady_clock::now();
+    sent_frame_t frame;
+    cv::Mat rotated;
+    // the camera is mounted upside down, the runtime rotates the frames back
+    cv::flip(image, rotated, -1);
+    cv::imencode(".jpg", rotated, frame.jpeg, {cv::IMWRITE_JPEG_QUALITY, jpegQuality.load()});
+    encodeTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - encodeStart).count();
+
+    uint32_t stride = options.fragmentSize;
+    uint32_t count = (frame.jpeg.size() + stride - 1) / stride;
+    if (count > MAX_FRAGMENT_COUNT) {
+        std::cerr << "\033[1;33m[Tinycar] Emulator Warning: frame of " << frame.jpeg.size() << " bytes needs more than " << MAX_FRAGMENT_COUNT << " fragments. Dropped." << "\033[0m" << std::endl;
+        return;
+    }
+
+    frame.header = {0};
+    frame.header.timestamp = timestamp();
+    frame.header.frame_num = ++frameNum;
+    frame.header.fragment_count = count;
+    frame.header.width = image.cols / 8;
+    frame.header.height = image.rows / 8;
+    if (encodeStart - lastRttStart >= std::chrono::milliseconds(EMULATOR_RTT_INTERVAL)) {
+        frame.header.rtt_start = 1;
+        lastRttStart = encodeStart;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        sendFragment(frame, i);
+    }
+    if (options.fecGroupSize > 0) {
+        std::vector<uint8_t> parity(sizeof(tcfp_header_t) + sizeof(tcfp_fec_header_t) + stride);
+        for (uint32_t start = 0; start < count; start += options.fecGroupSize) {
+            uint8_t size = std::min((uint32_t)options.fecGroupSize, count - start);
+            size_t n = tcfpFecEncode(frame.header, frame.jpeg.data(), frame.jpeg.size(), stride, start, size, parity.data());
+            tcfp_header_t* h = reinterpret_cast<tcfp_header_t*>(parity.data());
+            h->seq_num = seqNum++;
+            schedule(options.framePort, std::vector<uint8_t>(parity.begin(), parity.begin() + n));
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lk(stats_m);
+        stats.frames_sent++;
+    }
+    std::lock_guard<std::mutex> lk(history_m);
+    history.push_back(std::move(frame));
+    if (history.size() > EMULATOR_FRAME_HISTORY) {
+        history.pop_front();
+    }
+}
+
+void TinycarEmulator::sendFragment(const sent_frame_t& frame, uint32_t index) {
+    uint32_t stride = options.fragmentSize;
+    size_t offset = (size_t)index * stride;
+    size_t len = std::min((size_t)stride, frame.jpeg.size() - offset);
+    std::vector<uint8_t> datagram(sizeof(tcfp_header_t) + len);
+    tcfp_header_t* header = reinterpret_cast<tcfp_header_t*>(datagram.data());
+    *header = frame.header;
+    header->seq_num = seqNum++;
+    header->fragment_offset = offset;
+    header->marker = index == frame.header.fragment_count - 1;
+    memcpy(datagram.data() + sizeof(tcfp_header_t), frame.jpeg.data() + offset, len);
+    schedule(options.framePort, std::move(datagram));
+}
+
+void TinycarEmulator::schedule(uint16_t port, std::vector<uint8_t> data) {
+    std::unique_lock<std::mutex> lk(send_m);
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+    if (options.loss > 0.0 && chance(rng) < options.loss) {
+        lk.unlock();
+        std::lock_guard<std::mutex> slk(stats_m);
+        stats.datagrams_dropped++;
+        return;
+    }
+    uint32_t delay = options.delay;
+    if (options.jitter > 0) {
+        delay += std::uniform_int_distribution<uint32_t>(0, options.jitter)(rng);
+    }
+    if (options.reorder > 0.0 && chance(rng) < options.reorder) {
+        delay += options.reorderDelay;
+    }
+    if (delay == 0 && sendQueue.empty()) {
+        // nothing to emulate, skip the send thread
+        lk.unlock();
+        sockaddr_in addr = runtimeAddr;
+        addr.sin_port = htons(port);
+        sendto(sockfd, data.data(), data.size(), 0, (struct sockaddr*)&addr, sizeof(addr));
+        std::lock_guard<std::mutex> slk(stats_m);
+        stats.datagrams_sent++;
+        return;
+    }
+    sendQueue.push({std::chrono::steady_clock::now() + std::chrono::milliseconds(delay), sendOrder++, port, std::move(data)});
+    lk.unlock();
+    send_cv.notify_one();
+}
+
+void TinycarEmulator::send_task() {
+    std::unique_lock<std::mutex> lk(send_m);
+    while (running) {
+        if (sendQueue.empty()) {
+            send_cv.wait(lk);
+            continue;
+        }
+        auto due = sendQueue.top().due;
+        if (std::chrono::steady_clock::now() < due) {
+            send_cv.wait_until(lk, due);
+            continue;
+        }
+        scheduled_datagram_t datagram = std::move(const_cast<scheduled_datagram_t&>(sendQueue.top()));
+        sendQueue.pop();
+        lk.unlock();
+        sockaddr_in addr = runtimeAddr;
+        addr.sin_port = htons(datagram.port);
+        sendto(sockfd, datagram.data.data(), datagram.data.size(), 0, (struct sockaddr*)&addr, sizeof(addr));
+        {
+            std::lock_guard<std::mutex> slk(stats_m);
+            stats.datagrams_sent++;
+        }
+        lk.lock();
+    }
+}
+
+void TinycarEmulator::control_task() {
+    uint8_t buffer[128];
+    auto lastTelemetry = std::chrono::steady_clock::now();
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    while (running) {
+        // wakes up regularly to send telemetry and to notice stop
+        if (poll(&pfd, 1, 100) > 0) {
+            int n = recv(sockfd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (n > 0) {
+                handleControlMessage(buffer, n);
+            }
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastTelemetry >= std::chrono::milliseconds(EMULATOR_TELEMETRY_INTERVAL)) {
+            sendTelemetry();
+            lastTelemetry = now;
+        }
+    }
+}
+
+void TinycarEmulator::handleControlMessage(const uint8_t* buffer, int n) {
+    if (n < (int)sizeof(tccp_header_t)) {
+        return;
+    }
+    const tccp_header_t* header = reinterpret_cast<const tccp_header_t*>(buffer);
+    // schedule takes stats_m as well, so it is only held for the counters
+    std::unique_lock<std::mutex> slk(stats_m, std::defer_lock);
+    if (header->type == TCCP_TYPE_CONTROL && n >= (int)sizeof(tccp_control_t)) {
+        slk.lock();
+        stats.control_messages++;
+        if (options.controlLoss > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(controlRng) < options.controlLoss) {
+            stats.control_lost++;
+            return;
+        }
+        if (header->subtype == TCCP_CONTROL_SEQUENCED && n >= (int)sizeof(tccp_sequenced_control_t)) {
+            const tccp_sequenced_control_t* message = reinterpret_cast<const tccp_sequenced_control_t*>(buffer);
+            TCCP_SequenceResult result = sequenceFilter.check(*message);
+            if (result == TCCP_SequenceResult::DUPLICATE) {
+                stats.control_duplicates++;
+                return;
+            } else if (result == TCCP_SequenceResult::STALE) {
+                stats.control_stale++;
+                return;
+            }
+        }
+        control = *reinterpret_cast<const tccp_control_t*>(buffer);
+        stats.control_applied++;
+    } else if (header->type == TCCP_TYPE_RTT && n >= (int)sizeof(tccp_rtt_t)) {
+        // answered with the car's clock, the runtime relates it to the frame that started the measurement
+        tccp_rtt_t rtt = {0};
+        rtt.header.type = TCCP_TYPE_RTT;
+        rtt.timestamp = timestamp();
+        schedule(options.runtimePort, std::vector<uint8_t>((uint8_t*)&rtt, (uint8_t*)&rtt + sizeof(rtt)));
+        slk.lock();
+        stats.rtt_messages++;
+    } else if (header->type == TCCP_TYPE_STREAM_CONTROL && header->subtype == TCCP_STREAM_CONTROL_NACK && n >= (int)sizeof(tccp_nack_t)) {
+        const tccp_nack_t* nack = reinterpret_cast<const tccp_nack_t*>(buffer);
+        uint64_t retransmitted = 0;
+        std::unique_lock<std::mutex> lk(history_m);
+        for (auto& frame : history) {
+            if (frame.header.frame_num != nack->frame_num) {
+                continue;
+            }
+            for (uint32_t i = 0; i < 64; i++) {
+                uint32_t index = nack->first_fragment + i;
+                if (((nack->fragment_mask >> i) & 1) && index < frame.header.fragment_count) {
+                    sendFragment(frame, index);
+                    retransmitted++;
+                }
+            }
+        }
+        lk.unlock();
+        slk.lock();
+        stats.nack_messages++;
+        stats.fragments_retransmitted += retransmitted;
+    } else if (header->type == TCCP_TYPE_STREAM_CONTROL && n >= (int)sizeof(tccp_stream_control_t)) {
+        const tccp_stream_control_t* control = reinterpret_cast<const tccp_stream_control_t*>(buffer);
+        slk.lock();
+        stats.stream_control_messages++;
+        if (control->jpeg_quality > 0) {
+            jpegQuality = std::min((int)control->jpeg_quality, 100);
+        }
+        frameSize = std::min((int)control->frame_size, 3);
+    }
+}
+
+void TinycarEmulator::sendTelemetry() {
+    tccp_telemetry_t telemetry = {0};
+    telemetry.header.type = TCCP_TYPE_TELEMETRY;
+    telemetry.battery_voltage = EMULATOR_BATTERY_VOLTAGE;
+    telemetry.current_fps = std::min(currentFps.load(), (uint32_t)UINT8_MAX);
+    telemetry.min_frame_latency = encodeTime;
+    telemetry.wifi_rssi = EMULATOR_WIFI_RSSI;
+    schedule(options.runtimePort, std::vector<uint8_t>((uint8_t*)&telemetry, (uint8_t*)&telemetry + sizeof(telemetry)));
+}
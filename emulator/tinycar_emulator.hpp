@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "tcfp.hpp"
+#include "tccp.hpp"
+
+#define EMULATOR_TELEMETRY_INTERVAL 2000 // ms, like the car
+#define EMULATOR_RTT_INTERVAL 1000 // ms between two frames that start an RTT measurement
+#define EMULATOR_FRAME_HISTORY 8 // frames kept for retransmissions
+#define EMULATOR_BATTERY_VOLTAGE 7400 // mV reported in the telemetry
+#define EMULATOR_WIFI_RSSI -50 // dBm reported in the telemetry
+
+/// @brief Settings of the emulated car and the emulated network
+typedef struct {
+    std::string runtimeHost = "127.0.0.1"; // frames and telemetry are sent there
+    uint16_t framePort = RTP_PORT; // port of the runtime the frames are sent to
+    uint16_t runtimePort = TCCP_PORT; // port of the runtime telemetry is sent to
+    uint16_t controlPort = TCCP_PORT; // port the emulator receives TCCP messages on
+    std::string videoPath; // source of the frames, a generated test pattern if empty. Looped
+    double fps = 30.0;
+    int width = 320; // multiple of 8, at most 2040
+    int height = 240; // multiple of 8, at most 2040
+    int jpegQuality = 80; // changed by stream control messages
+    int fragmentSize = DGRAM_SIZE - sizeof(tcfp_header_t); // payload bytes per datagram
+    int fecGroupSize = 0; // fragments per parity datagram, 0 = no FEC
+    // emulated network, applied to every datagram the emulator sends
+    double loss = 0.0; // probability a datagram is dropped
+    double reorder = 0.0; // probability a datagram is held back by reorderDelay, so later datagrams overtake it
+    uint32_t reorderDelay = 5; // ms
+    uint32_t delay = 0; // ms added to every datagram
+    uint32_t jitter = 0; // ms, uniformly distributed on top of delay
+    double controlLoss = 0.0; // probability a received control message is dropped, emulates loss in the direction of the car
+    uint32_t seed = 1; // of the loss, reorder and jitter decisions
+} emulator_options_t;
+
+typedef struct {
+    uint64_t frames_sent;
+    uint64_t datagrams_sent;
+    uint64_t datagrams_dropped; // by the emulated loss
+    uint64_t fragments_retransmitted;
+    uint64_t control_messages; // received, including redundant copies
+    uint64_t control_lost; // dropped by the emulated control loss
+    uint64_t control_applied;
+    uint64_t control_duplicates; // sequenced copies of the message applied last
+    uint64_t control_stale; // sequenced messages that arrived after a newer one
+    uint64_t rtt_messages;
+    uint64_t stream_control_messages;
+    uint64_t nack_messages;
+} emulator_stats_t;
+
+/// @brief Stand-in for the car: streams a video over TCFP and answers TCCP like the car's firmware.
+///
+/// Frames are JPEG encoded, rotated by 180° like the car's camera, and fragmented per tcfp_header_t. Optionally parity datagrams are
+/// added (see tcfpFecEncode) and lost fragments are sent again on NACKs. Every outgoing datagram passes an emulated network with
+/// loss, delay, jitter and reordering before it is sent. Stream control messages change the JPEG quality and the resolution.
+/// Sequenced control messages are filtered like the car does it (see TCCP_SequenceFilter).
+class TinycarEmulator {
+public:
+    TinycarEmulator(const emulator_options_t& options);
+    ~TinycarEmulator();
+
+    /// @return 0 on success, -1 if the video could not be opened or the sockets could not be bound
+    int start();
+    void stop();
+    emulator_stats_t getStats();
+    /// @brief Control state that was applied last
+    tccp_control_t getControl();
+private:
+    typedef struct {
+        std::chrono::steady_clock::time_point due;
+        uint64_t order; // keeps datagrams with the same due time in order
+        uint16_t port;
+        std::vector<uint8_t> data;
+    } scheduled_datagram_t;
+
+    struct ScheduledLater {
+        bool operator()(const scheduled_datagram_t& a, const scheduled_datagram_t& b) const {
+            return a.due > b.due || (a.due == b.due && a.order > b.order);
+        }
+    };
+
+    typedef struct {
+        tcfp_header_t header; // of the first fragment
+        std::vector<uint8_t> jpeg;
+    } sent_frame_t;
+
+    void frame_task();
+    void send_task();
+    void control_task();
+
+    /// @brief Next frame of the video or the test pattern at the current resolution
+    void nextImage(cv::Mat& image);
+    void sendFrame(const cv::Mat& image);
+    /// @brief Sends fragment index of a frame
+    void sendFragment(const sent_frame_t& frame, uint32_t index);
+    /// @brief Passes a datagram through the emulated network
+    void schedule(uint16_t port, std::vector<uint8_t> data);
+    void handleControlMessage(const uint8_t* buffer, int n);
+    void sendTelemetry();
+    uint32_t timestamp();
+
+    emulator_options_t options;
+    cv::VideoCapture video;
+    int sockfd = -1; // sends everything and receives TCCP
+    struct sockaddr_in runtimeAddr;
+    std::chrono::steady_clock::time_point startTime;
+    std::atomic<bool> running{false};
+    std::thread frameThread;
+    std::thread sendThread;
+    std::thread controlThread;
+
+    // stream settings, changed by stream control messages
+    std::atomic<int> jpegQuality;
+    std::atomic<int> frameSize{0}; // every step halves width and height
+    uint16_t frameNum = 0;
+    std::atomic<uint8_t> seqNum{0}; // the frame and the control thread send fragments
+    std::atomic<uint32_t> encodeTime{0}; // ms of the last frame, reported as the car side part of the frame latency
+    std::chrono::steady_clock::time_point lastRttStart;
+    std::atomic<uint32_t> currentFps{0};
+
+    // frames that can still be retransmitted
+    std::mutex history_m;
+    std::deque<sent_frame_t> history;
+
+    // emulated network
+    std::mutex send_m;
+    std::condition_variable send_cv;
+    std::priority_queue<scheduled_datagram_t, std::vector<scheduled_datagram_t>, ScheduledLater> sendQueue;
+    uint64_t sendOrder = 0;
+    std::mt19937 rng;
+    std::mt19937 controlRng; // control thread only
+
+    TCCP_SequenceFilter sequenceFilter; // control thread only
+    tccp_control_t control; // guarded by stats_m
+
+    std::mutex stats_m;
+    emulator_stats_t stats;
+};
@@ -1,7 +1,10 @@
 #include <iostream>
 #include <cstdlib>
 #include <memory>
+#include <mutex>
 #include <algorithm>
+#include <sstream>
+#include <vector>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 
@@ -11,6 +14,7 @@
 #include "logger.hpp"
 #include "recorder.hpp"
 
+#include "pipeline.hpp"
 #include "provider.hpp"
 #include "backends/provider/file_image_provider.hpp"
 #include "backends/provider/file_video_provider.hpp"
@@ -20,6 +24,8 @@
 #include "backends/nn/nn_coreml.hpp"
 
 #include "viewcontroller/tinycar_viewcontroller.hpp"
+#include "tinycar_fleet.hpp"
+#include "tinycar_replay.hpp"
 
 bool getEnv(const std::string& key) {
     const char* value = std::getenv(key.c_str());
@@ -33,7 +39,9 @@ enum class ProviderType {
 };
 ProviderType providerType;
 
-cv::Scalar channel_color_lookup[] = {
+#define NN_OUTPUT_CHANNELS 7 // one per entry of channel_color_lookup
+
+cv::Scalar channel_color_lookup[NN_OUTPUT_CHANNELS] = {
     cv::Scalar(0x01, 0x01, 0xFF),  // outer
     cv::Scalar(0x01, 0x9F, 0xFF),  // middle
     cv::Scalar(0x01, 0x5F, 0x33),  // guide
@@ -45,11 +53,19 @@ cv::Scalar channel_color_lookup[] = {
 
 typedef struct {
     cv::Size inputSize;
-    float* nnOutputRawBuffer; // pointer to a possibly used buffer
-    std::vector<cv::Mat> outputMats; // vector for output images
-    uint8_t nOutputMats; // number of elements in outputMats array
+    uint8_t nOutputMats; // number of output channels of the model
 } nn_config_t;
 
+/// @brief Everything one frame carries through the pipeline, every stage fills in its part
+typedef struct {
+    uint64_t sequence; // counts the captured frames, gaps are frames a stage dropped
+    cv::Mat image; // as captured
+    cv::Mat input; // preprocessed NN input
+    cv::Mat output; // raw NN output, nOutputMats floats per pixel interleaved
+    std::vector<cv::Mat> channels; // one image per output channel
+    cv::Mat combined; // all channels merged into one color image
+} pipeline_frame_t;
+
 ///////// PROPERTIES
 
 std::shared_ptr<Provider> imageProvider;
@@ -57,9 +73,24 @@ std::shared_ptr<NNRuntime> nnRuntime;
 std::shared_ptr<nn_config_t> nnConfig;
 std::shared_ptr<Recorder> recorder;
 std::shared_ptr<Tinycar> tinycar;
-
+// only used if more than one tinycar is given, the first one is tinycar/imageProvider
+std::unique_ptr<TinycarFleet> fleet;
+std::vector<std::shared_ptr<Provider>> fleetProviders;
+int fleetCpu = -1; // core the network thread of the fleet is pinned to
+// only used if a capture is replayed, its car is tinycar/imageProvider
+std::unique_ptr<TinycarReplay> replay;
+std::string replayPath;
+double replaySpeed = 1.0;
+
+
+// capture, preprocessing, inference and postprocessing run on their own threads, the GUI loop only presents
+Pipeline pipeline;
+StageQueue<pipeline_frame_t>* presentQueue;
+// the video provider is read by the capture stage and controlled from the GUI loop, the tinycar provider is thread safe
+std::mutex provider_m;
 
 bool doLaneDetection = false;
+bool decodeNNRegion = false; // the tinycar decodes only the NN input region, the frames need no more cropping
 
 // view controller
 std::unique_ptr<TinycarViewController> tinycarViewController;
@@ -76,6 +107,16 @@ bool cmdOptionExists(char** begin, char** end, const std::string& option) {
     return std::find(begin, end, option) != end;
 }
 
+/// @brief Splits "host:port" into the host and the TCCP port of the car, e.g. for an emulator on the same host
+std::string parseHost(const std::string& entry, tinycar_options_t& options) {
+    size_t colon = entry.find(':');
+    if (colon == std::string::npos) {
+        return entry;
+    }
+    options.carControlPort = std::atoi(entry.substr(colon + 1).c_str());
+    return entry.substr(0, colon);
+}
+
 int prepareNNRuntime(std::shared_ptr<nn_config_t> config) {
     cv::Size inputSize = nnRuntime->getInputSize();
     if (inputSize.width <= 0 || inputSize.height <= 0) {
@@ -84,15 +125,87 @@ int prepareNNRuntime(std::shared_ptr<nn_config_t> config) {
     }
     Logger::info("Input size: " + std::to_string(inputSize.width) + "x" + std::to_string(inputSize.height));
     config->inputSize = inputSize;
-    config->nOutputMats = 7;
+    // the output buffers belong to the frames, inference of the next frame runs while the last one is postprocessed
+    config->nOutputMats = NN_OUTPUT_CHANNELS;
+    return 0;
+}
 
-    // allocate output buffer
-    config->nnOutputRawBuffer = new float[config->nOutputMats * inputSize.width * inputSize.height];
-    config->outputMats = std::vector<cv::Mat>(config->nOutputMats);
-    for (int i = 0; i < 7; i++) {
-        config->outputMats[i] = cv::Mat(inputSize, CV_8UC1);
+void setupPipeline() {
+    // the GUI takes the newest frame at every vsync, a frame it did not show in time is outdated
+    presentQueue = pipeline.addQueue<pipeline_frame_t>("present", 1, QueuePolicy::LATEST);
+    // a camera frame that waits for preprocessing only adds latency
+    StageQueue<pipeline_frame_t>* captured = doLaneDetection ? pipeline.addQueue<pipeline_frame_t>("captured", 1, QueuePolicy::LATEST) : presentQueue;
+
+    pipeline.addStage<pipeline_frame_t>("capture", nullptr, captured, [sequence = (uint64_t)0](pipeline_frame_t& frame) mutable {
+        std::unique_lock<std::mutex> lk(provider_m, std::defer_lock);
+        if (providerType == ProviderType::VIDEO) {
+            lk.lock();
+        }
+        if (!imageProvider->waitForImage(frame.image, PIPELINE_POP_TIMEOUT)) {
+            return false;
+        }
+        frame.sequence = ++sequence;
+        return true;
+    });
+    if (!doLaneDetection) {
+        return;
+    }
+
+    // backpressure, preprocessing runs at most one frame ahead of the inference
+    StageQueue<pipeline_frame_t>* preprocessed = pipeline.addQueue<pipeline_frame_t>("preprocessed", 1, QueuePolicy::BLOCK);
+    StageQueue<pipeline_frame_t>* inferred = pipeline.addQueue<pipeline_frame_t>("inferred", 1, QueuePolicy::BLOCK);
+
+    pipeline.addStage<pipeline_frame_t>("preprocessing", captured, preprocessed, [](pipeline_frame_t& frame) {
+        // crop image to use only lower half
+        frame.input = decodeNNRegion ? frame.image : frame.image(cv::Rect(0, frame.image.rows / 2, frame.image.cols, frame.image.rows / 2));
+        // resize image to input size
+        if (frame.input.size() != nnConfig->inputSize) {
+            cv::resize(frame.input, frame.input, nnConfig->inputSize);
+        }
+        return true;
+    });
+
+    pipeline.addStage<pipeline_frame_t>("inference", preprocessed, inferred, [](pipeline_frame_t& frame) {
+        frame.output.create(1, nnConfig->nOutputMats * nnConfig->inputSize.area(), CV_32F);
+        // if (nnRuntime->run(frame.output.ptr<float>(), frame.input) < 0) {
+        //     Logger::error("Could not run model");
+        //     return false;
+        // }
+        return true;
+    });
+
+    pipeline.addStage<pipeline_frame_t>("postprocessing", inferred, presentQueue, [](pipeline_frame_t& frame) {
+        // raw output split, for each channel one cv::Mat
+        const float* raw = frame.output.ptr<float>();
+        int pixels = nnConfig->inputSize.area();
+        frame.channels.resize(nnConfig->nOutputMats);
+        for (int c = 0; c < nnConfig->nOutputMats; c++) {
+            frame.channels[c].create(nnConfig->inputSize, CV_8UC1);
+            uint8_t* channel = frame.channels[c].data;
+            for (int y = 0, i = c; y < pixels; y++, i += nnConfig->nOutputMats) {
+                channel[y] = raw[i] * 255;
+            }
+        }
+
+        // output merge
+        frame.combined = cv::Mat(nnConfig->inputSize, CV_8UC3, cv::Scalar(0, 0, 0));  // Initialize to black
+        for (int c = 0; c < nnConfig->nOutputMats; c++) {
+            cv::Mat mask;
+            cv::threshold(frame.channels[c], mask, 150, 255, cv::THRESH_BINARY);
+            frame.combined.setTo(channel_color_lookup[c], mask);  // Set the color of the pixels in the mask
+        }
+        return true;
+    });
+}
+
+/// @brief Time per frame of every stage and frames dropped between them, shown in the profiler
+void profilePipeline() {
+    for (auto& stage : pipeline.getStageStats()) {
+        PROFILE_COUNTER("pipeline:" + stage.name + " (ms)", stage.time);
+    }
+    for (auto& queue : pipeline.getQueueStats()) {
+        PROFILE_COUNTER("pipeline:" + queue.first + " dropped", queue.second.dropped);
     }
-    return 0;
 }
 
 void setupViewController() {
@@ -114,11 +227,24 @@ void parseEnvVariables() {
 int parseProcessArguments(int argc, char** argv) {
     // print help
     if (cmdOptionExists(argv, argv + argc, "-h") || cmdOptionExists(argv, argv + argc, "--help")) {
-        std::cout << "Usage: " << argv[0] << "-t <hostname/ip> -m <model> -f <file>" << std::endl;
+        std::cout << "Usage: " << argv[0] << "-t <hostname/ip> -m <model> -f <file> -j <ms> -n <ms> -b <ms> -p <cpu> -c <file> -r <file> -s <speed> -k <hz> -e <copies> -w <workers> -l -i -d" << std::endl;
         std::cout << "Options:" << std::endl;
         std::cout << "  -f <file>           Path to image or video file (offline testing)" << std::endl;
         std::cout << "  -m <model>          Path to model file" << std::endl;
-        std::cout << "  -t <hostname/ip>    Hostname of tinycar" << std::endl;
+        std::cout << "  -t <hostname/ip>    Hostname of tinycar, several comma separated IPv4 addresses run a fleet over shared sockets. <ip>:<port> if the car (emulator) receives TCCP on another port" << std::endl;
+        std::cout << "  -j <ms>             Latency target of the tinycar playout buffer (0 = off)" << std::endl;
+        std::cout << "  -n <ms>             Request lost fragments again, frames wait at most <ms> for them (needs firmware support, older firmware takes the requests for stream control)" << std::endl;
+        std::cout << "  -b <ms>             Adapt the stream bitrate of the tinycar to keep the frame latency below <ms>" << std::endl;
+        std::cout << "  -p <cpu>            Handle the tinycar network on a single thread pinned to <cpu> (-1 = not pinned)" << std::endl;
+        std::cout << "  -k <hz>             Send control messages at a fixed rate from a realtime thread instead of the GUI loop" << std::endl;
+        std::cout << "  -e <copies>         Send sequenced control messages <copies> times each, the car drops outdated ones (needs firmware support)" << std::endl;
+        std::cout << "  -w <workers>        Decode tinycar frames on <workers> threads, still delivered in order" << std::endl;
+        std::cout << "  -l                  With -w, deliver every frame as soon as it is decoded and drop older ones that are done later" << std::endl;
+        std::cout << "  -i                  Decode tinycar frames while their fragments arrive, only the tail is left when the last one is in" << std::endl;
+        std::cout << "  -d                  Decode only the lower half of the tinycar frames, at the lowest resolution that covers the NN input (needs -m)" << std::endl;
+        std::cout << "  -c <file>           Capture every datagram received from the tinycar to <file>" << std::endl;
+        std::cout << "  -r <file>           Replay a capture instead of connecting to a tinycar" << std::endl;
+        std::cout << "  -s <speed>          Replay speed, 1 = original timing, 0 = as fast as possible (default 1)" << std::endl;
         std::cout << "  -h                  Show this help" << std::endl;
         return EXIT_FAILURE;
     }
@@ -142,15 +268,125 @@ int parseProcessArguments(int argc, char** argv) {
         // set tinycar provider if no file is provided
         Logger::info("Using Tinycar as provider backend");
         char* host = getCmdOption(argv, argv + argc, "-t");
+        tinycar_options_t options;
+        char* reactor_cpu = getCmdOption(argv, argv + argc, "-p");
+        if (reactor_cpu) {
+            Logger::info("Using single threaded network reactor");
+            options.useReactor = true;
+            options.reactorCpu = std::atoi(reactor_cpu);
+        }
+        if (getEnv("IO_URING")) {
+            Logger::info("Using io_uring to receive the frame stream");
+            options.receiveBackend = TCFP_ReceiveBackend::IO_URING;
+        }
+        char* capture_path = getCmdOption(argv, argv + argc, "-c");
+        if (capture_path) {
+            options.capturePath = std::string(capture_path);
+        }
+        char* replay_path = getCmdOption(argv, argv + argc, "-r");
+        std::vector<std::string> hosts;
         if (host) {
-            tinycar = std::make_shared<Tinycar>(std::string(host));
+            std::stringstream ss(host);
+            std::string item;
+            while (std::getline(ss, item, ',')) {
+                hosts.push_back(item);
+            }
+        }
+        if (replay_path) {
+            Logger::info("Replaying capture " + std::string(replay_path));
+            replay = std::make_unique<TinycarReplay>(options);
+            tinycar = replay->getCar();
+            imageProvider = std::make_shared<TinycarProvider>(tinycar);
+            providerType = ProviderType::TINYCAR;
+        } else if (hosts.size() > 1) {
+            Logger::info("Using a fleet of " + std::to_string(hosts.size()) + " tinycars");
+            fleet = std::make_unique<TinycarFleet>();
+            for (auto& h : hosts) {
+                tinycar_options_t carOptions = options;
+                std::string address = parseHost(h, carOptions);
+                auto car = fleet->addCar(address, carOptions);
+                if (car == nullptr) {
+                    return EXIT_FAILURE;
+                }
+                if (tinycar == nullptr) {
+                    tinycar = car;
+                } else {
+                    fleetProviders.push_back(std::make_shared<TinycarProvider>(car));
+                }
+            }
+            // started once every car is configured
+            fleetCpu = options.reactorCpu;
+            imageProvider = std::make_shared<TinycarProvider>(tinycar);
+            providerType = ProviderType::TINYCAR;
+        } else if (host) {
+            std::string address = parseHost(hosts[0], options);
+            tinycar = std::make_shared<Tinycar>(address, options);
             imageProvider = std::make_shared<TinycarProvider>(tinycar);
             providerType = ProviderType::TINYCAR;
         } else {
-            tinycar = std::make_shared<Tinycar>("localhost");
+            tinycar = std::make_shared<Tinycar>("localhost", options);
             imageProvider = std::make_shared<TinycarProvider>(tinycar);
             providerType = ProviderType::TINYCAR;
         }
+        std::vector<std::shared_ptr<Tinycar>> cars = {tinycar};
+        for (size_t i = 1; fleet && i < fleet->getCarCount(); i++) {
+            cars.push_back(fleet->getCar(i));
+        }
+        char* playout_latency = getCmdOption(argv, argv + argc, "-j");
+        if (playout_latency) {
+            for (auto& car : cars) {
+                car->setPlayoutLatency(std::atoi(playout_latency));
+            }
+            Logger::info("Playout buffer latency target: " + std::string(playout_latency) + " ms");
+        }
+        char* latency_target = getCmdOption(argv, argv + argc, "-b");
+        if (latency_target) {
+            for (auto& car : cars) {
+                car->setStreamControl(std::atoi(latency_target));
+            }
+            Logger::info("Stream control latency target: " + std::string(latency_target) + " ms");
+        }
+        char* retransmission_deadline = getCmdOption(argv, argv + argc, "-n");
+        if (retransmission_deadline) {
+            for (auto& car : cars) {
+                car->setRetransmission(true, std::atoi(retransmission_deadline));
+            }
+            Logger::info("Retransmission deadline: " + std::string(retransmission_deadline) + " ms");
+        }
+        char* control_copies = getCmdOption(argv, argv + argc, "-e");
+        if (control_copies) {
+            // clamped before it is narrowed to the uint8_t of setSequencedControl
+            int copies = std::max(1, std::min(std::atoi(control_copies), TCCP_CONTROL_MAX_COPIES));
+            for (auto& car : cars) {
+                car->setSequencedControl(true, copies);
+            }
+            Logger::info("Sequenced control, copies per message: " + std::to_string(copies));
+        }
+        char* decode_workers = getCmdOption(argv, argv + argc, "-w");
+        if (decode_workers) {
+            bool latestWins = cmdOptionExists(argv, argv + argc, "-l");
+            for (auto& car : cars) {
+                car->setDecodeWorkers(std::atoi(decode_workers), latestWins);
+            }
+            Logger::info("Decode workers: " + std::to_string(tinycar->getDecodeWorkerCount()) + (latestWins ? ", latest wins" : ""));
+        }
+        if (cmdOptionExists(argv, argv + argc, "-i")) {
+            for (auto& car : cars) {
+                car->setStreamingDecode(true);
+            }
+            Logger::info("Decoding frames while they are received");
+        }
+        char* control_rate = getCmdOption(argv, argv + argc, "-k");
+        if (control_rate && !replay) {
+            tinycar->startControlLoop(std::atoi(control_rate), true);
+        }
+        if (replay) {
+            replayPath = std::string(replay_path);
+            char* replay_speed = getCmdOption(argv, argv + argc, "-s");
+            if (replay_speed) {
+                replaySpeed = std::atof(replay_speed);
+            }
+        }
     }
 
     // parse model file
@@ -165,6 +401,15 @@ int parseProcessArguments(int argc, char** argv) {
             return EXIT_FAILURE;
         }
         doLaneDetection = true;
+        if (tinycar && cmdOptionExists(argv, argv + argc, "-d")) {
+            jpeg_decode_region_t region;
+            region.y = 0.5f;
+            region.height = 0.5f;
+            region.minSize = nnConfig->inputSize;
+            tinycar->setDecodeRegion(region);
+            decodeNNRegion = true;
+            Logger::info("Decoding only the NN input region of the tinycar frames");
+        }
     }
 
     return 0;
@@ -184,10 +429,26 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
     if (providerType == ProviderType::TINYCAR) {
+        // registers its callbacks, so before the network threads start
         setupViewController();
+        if (fleet) {
+            if (fleet->start(fleetCpu) != 0) {
+                return EXIT_FAILURE;
+            }
+        } else if (replay) {
+            // after the car is configured (-d included), so every run handles the same datagrams the same way
+            if (replay->start(replayPath, replaySpeed) != 0) {
+                return EXIT_FAILURE;
+            }
+        } else {
+            tinycar->start();
+        }
     }
+    setupPipeline();
+    pipeline.start();
     // only used for video provider
     int currentPlaybackSliderPosition = 0;
+    uint64_t lastSequence = 0;
 
     // main loop
     // Loop sections: Tinycar Control, Video Playback Control, NN Execution
@@ -207,6 +468,7 @@ int main(int argc, char** argv) {
         if (providerType == ProviderType::VIDEO) {
             // static cast provider to video provider
             auto videoProvider = std::static_pointer_cast<FileVideoProvider>(imageProvider);
+            std::lock_guard<std::mutex> lk(provider_m);
             int frameCount = videoProvider->getVideoLength();
             ImGui::Begin("Playback Control");
             if (ImGui::Button("Play")) {
@@ -233,6 +495,7 @@ int main(int argc, char** argv) {
         } else {
             ImGui::Text("Not Recording");
             if (ImGui::Button("Start Recording")) {
+                std::lock_guard<std::mutex> lk(provider_m);
                 recorder->startRecord(imageProvider->getFPS());
             }
         }
@@ -242,59 +505,29 @@ int main(int argc, char** argv) {
         }
         ImGui::End();
 
-        // show next frame if available
-        cv::Mat image;
-        if (imageProvider->getImage(image)) {
-            currentPlaybackSliderPosition++;
-            recorder->provideFrame(image);
-            nv::imshow("tinycar_image:input", image);
-
-            // do some preprocessing
+        // show the newest frame that made it through the pipeline
+        pipeline_frame_t frame;
+        if (presentQueue->pop(frame)) {
+            // frames the pipeline dropped were played nevertheless
+            currentPlaybackSliderPosition += frame.sequence - lastSequence;
+            lastSequence = frame.sequence;
+            recorder->provideFrame(frame.image);
+            nv::imshow("tinycar_image:input", frame.image);
             if (doLaneDetection) {
-                cv::Mat input;
-                {
-                    PROFILE_SCOPE("preprocessing");
-                    // crop image to use only lower half
-                    input = image(cv::Rect(0, image.rows / 2, image.cols, image.rows / 2));
-                    // resize image to input size
-                    cv::resize(input, input, nnConfig->inputSize);
-                    nv::imshow("nn:preprocessed", input);
-                }
-
-                {
-                    // PROFILE_SCOPE("inference");
-                    // if (nnRuntime->run(nnConfig->nnOutputRawBuffer, input) < 0) {
-                    //     Logger::error("Could not run model");
-                    //     return EXIT_FAILURE;
-                    // }
-                }
-
-                {
-                    PROFILE_SCOPE("raw output split");
-                    // debug output window, for each channel one cv::Mat
-                    for (int c = 0; c < 7; c++) {
-                        int y = 0;
-                        for (int i = c; i < 7 * nnConfig->inputSize.width * nnConfig->inputSize.height; i = i + 7) {
-                            //outputMats[c].data[y] = outputRawBuffer[i];
-                            nnConfig->outputMats[c].data[y] = nnConfig->nnOutputRawBuffer[i] * 255;
-                            y++;
-                        }
-                        nv::imshow("nn_raw_output:ch" + std::to_string(c), nnConfig->outputMats[c]);
-                    }
+                nv::imshow("nn:preprocessed", frame.input);
+                for (int c = 0; c < nnConfig->nOutputMats; c++) {
+                    nv::imshow("nn_raw_output:ch" + std::to_string(c), frame.channels[c]);
                 }
+                nv::imshow("nn:output", frame.combined);
+            }
+        }
+        profilePipeline();
 
-                {
-                    PROFILE_SCOPE("output merge");
-                    cv::Mat combined(nnConfig->inputSize, CV_8UC3, cv::Scalar(0, 0, 0));  // Initialize to black
-
-                    for (int c = 0; c < 7; c++) {  // Change this to the number of channels you have
-                        cv::Mat mask;  // Threshold your mask here
-                        cv::threshold(nnConfig->outputMats[c], mask, 150, 255, cv::THRESH_BINARY);
-                        combined.setTo(channel_color_lookup[c], mask);  // Set the color of the pixels in the mask
-                    }
-                    
-                    nv::imshow("nn:output", combined);
-                }
+        // the other cars of a fleet are only shown
+        for (size_t i = 0; i < fleetProviders.size(); i++) {
+            cv::Mat carImage;
+            if (fleetProviders[i]->getImage(carImage)) {
+                nv::imshow("tinycar_image:car" + std::to_string(i + 1), carImage);
             }
         }
 
@@ -317,6 +550,7 @@ int main(int argc, char** argv) {
 
         frameEnd(window);
     }
+    pipeline.stop();
 
     // save debug annotation states
     nv::DrawList::getInstance().saveState();
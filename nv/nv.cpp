@@ -313,7 +313,10 @@ void showProfiler() {
     for (auto& [k, v] : m) {
         ImGui::Text("%s", k.c_str());
         ImGui::SameLine(ImGui::GetWindowWidth() - (8 + 3) * 8);
-        ImGui::Text("%8.2f ms", v.current * 1000);
+        if (v.isCounter)
+            ImGui::Text("%8.2f   ", v.current);
+        else
+            ImGui::Text("%8.2f ms", v.current * 1000);
     }
     ImGui::End();
 }
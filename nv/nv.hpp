@@ -92,6 +92,7 @@ class Images {
 
 struct ProfileContainer {
     double current;
+    bool isCounter = false;  // plain value instead of a time
 
     static std::map<std::string, ProfileContainer>& getInstance() {
         static std::map<std::string, ProfileContainer> instance;
@@ -220,5 +221,11 @@ bool renderImageviewers(ImVec2& contentPos, bool reset);
 
 #define PROFILE_SCOPE(...) auto PROFILE_COOKIE = nv::ScopeProfiler(__VA_ARGS__);
 #define PROFILE_SCOPE_RESET(x) nv::ProfileContainer::getInstance()[x].current = 0;
+#define PROFILE_COUNTER(x, value)                                             \
+    {                                                                         \
+        auto& PROFILE_COUNTER_ENTRY = nv::ProfileContainer::getInstance()[x]; \
+        PROFILE_COUNTER_ENTRY.current = value;                                \
+        PROFILE_COUNTER_ENTRY.isCounter = true;                               \
+    }
 
 };  // namespace nv
\ No newline at end of file
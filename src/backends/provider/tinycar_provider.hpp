@@ -17,6 +17,10 @@ public:
         return tinycar->getImage(out);
     }
 
+    int waitForImage(cv::Mat& out, uint32_t timeout) {
+        return tinycar->waitForImage(out, timeout);
+    }
+
     double getFPS() {
         return tinycar->getFPS();
     }
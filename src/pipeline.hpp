@@ -0,0 +1,270 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define PIPELINE_POP_TIMEOUT 100 // ms a stage waits for its input before it checks whether the pipeline was stopped
+#define PIPELINE_IDLE_SLEEP 1 // ms a source stage sleeps if it had nothing to produce
+#define PIPELINE_TIME_SMOOTHING 16 // time per item is averaged over about this many items
+
+enum class QueuePolicy {
+    BLOCK, // a full queue makes the producer wait, the backpressure slows down everything upstream
+    LATEST // the producer never waits, an item the consumer did not take in time is replaced by the newer one
+};
+
+typedef struct {
+    uint64_t pushed;
+    uint64_t dropped; // replaced before the consumer took them, LATEST only
+} stage_queue_stats_t;
+
+class StageQueueBase {
+public:
+    virtual ~StageQueueBase() {}
+    /// @brief Wakes up everyone waiting, push and pop fail from now on
+    virtual void close() = 0;
+    virtual stage_queue_stats_t getStats() = 0;
+};
+
+/// @brief Hands items from one producer thread to one consumer thread without locks.
+///
+/// BLOCK is a ring of capacity items. LATEST is a triple buffer like FrameMailbox: the producer swaps its slot with the shared
+/// middle one, the consumer swaps its slot with the middle one if it holds a new item. A thread that has to wait sleeps on a
+/// condition variable, the other side only touches the mutex if somebody is waiting.
+template <typename T>
+class StageQueue : public StageQueueBase {
+public:
+    StageQueue(size_t capacity, QueuePolicy policy): policy(policy), slots(policy == QueuePolicy::LATEST ? 3 : capacity + 1) {
+        middle = 1;
+    }
+
+    /// @brief Producer thread only
+    /// @return false if the queue was closed
+    bool push(T item) {
+        if (policy == QueuePolicy::LATEST) {
+            slots[back] = std::move(item);
+            uint8_t previous = middle.exchange(back | FRESH);
+            back = previous & INDEX_MASK;
+            if (previous & FRESH) {
+                dropped++;
+            }
+        } else {
+            size_t h = head.load(std::memory_order_relaxed);
+            size_t next = (h + 1) % slots.size();
+            if (next == tail.load()) {
+                // backpressure
+                if (!wait([&]{ return next != tail.load(); }, std::chrono::milliseconds::max())) {
+                    return false;
+                }
+            }
+            slots[h] = std::move(item);
+            head.store(next);
+        }
+        pushed++;
+        wake();
+        return !closed;
+    }
+
+    /// @brief Takes the next item, the newest one for LATEST. Consumer thread only.
+    /// @param timeout 0 to not wait at all
+    /// @return false if there was no item within timeout or the queue was closed
+    bool pop(T& out, std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        if (!available() && (timeout.count() == 0 || !wait([this]{ return available(); }, timeout))) {
+            return false;
+        }
+        if (policy == QueuePolicy::LATEST) {
+            uint8_t previous = middle.exchange(front);
+            front = previous & INDEX_MASK;
+            out = std::move(slots[front]);
+        } else {
+            size_t t = tail.load(std::memory_order_relaxed);
+            out = std::move(slots[t]);
+            tail.store((t + 1) % slots.size());
+            // the producer may wait for space
+            wake();
+        }
+        return true;
+    }
+
+    void close() override {
+        closed = true;
+        std::lock_guard<std::mutex> lk(wait_m);
+        wait_cv.notify_all();
+    }
+
+    stage_queue_stats_t getStats() override {
+        return {pushed.load(), dropped.load()};
+    }
+private:
+    static const uint8_t FRESH = 0x04; // set in middle if it holds an item the consumer has not taken
+    static const uint8_t INDEX_MASK = 0x03;
+
+    bool available() {
+        if (policy == QueuePolicy::LATEST) {
+            return middle.load() & FRESH;
+        }
+        return tail.load(std::memory_order_relaxed) != head.load();
+    }
+
+    /// @return true if ready became true, false on timeout or if the queue was closed
+    template <typename Predicate>
+    bool wait(Predicate ready, std::chrono::milliseconds timeout) {
+        // announced before ready is checked under the mutex, so wake either sees the waiter or the waiter sees the item
+        waiters++;
+        std::unique_lock<std::mutex> lk(wait_m);
+        bool result;
+        if (timeout == std::chrono::milliseconds::max()) {
+            wait_cv.wait(lk, [&]{ return closed || ready(); });
+            result = !closed;
+        } else {
+            result = wait_cv.wait_for(lk, timeout, [&]{ return closed || ready(); }) && !closed;
+        }
+        waiters--;
+        return result;
+    }
+
+    void wake() {
+        if (waiters.load() > 0) {
+            std::lock_guard<std::mutex> lk(wait_m);
+            wait_cv.notify_all();
+        }
+    }
+
+    QueuePolicy policy;
+    std::vector<T> slots;
+    // BLOCK
+    std::atomic<size_t> head{0}; // next slot the producer writes
+    std::atomic<size_t> tail{0}; // next slot the consumer reads
+    // LATEST
+    std::atomic<uint8_t> middle; // index of the shared slot | FRESH
+    uint8_t back = 0; // producer only
+    uint8_t front = 2; // consumer only
+
+    std::atomic<bool> closed{false};
+    std::atomic<uint64_t> pushed{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<int> waiters{0};
+    std::mutex wait_m;
+    std::condition_variable wait_cv;
+};
+
+typedef struct {
+    std::string name;
+    uint64_t items; // processed
+    double time; // ms per item, averaged
+} pipeline_stage_stats_t;
+
+/// @brief Runs every stage of a frame pipeline on its own thread, connected by StageQueues.
+///
+/// A stage takes an item from its input queue, works on it and pushes it to its output queue, so consecutive items are in
+/// different stages at the same time and the throughput is set by the slowest stage instead of the sum of all stages.
+/// How a stage reacts to a slower successor is up to the queue in between (see QueuePolicy).
+class Pipeline {
+public:
+    ~Pipeline() {
+        stop();
+    }
+
+    /// @brief The pipeline owns the queue. Add all queues and stages before start.
+    template <typename T>
+    StageQueue<T>* addQueue(const std::string& name, size_t capacity, QueuePolicy policy) {
+        auto queue = std::make_unique<StageQueue<T>>(capacity, policy);
+        StageQueue<T>* result = queue.get();
+        queues.push_back({name, std::move(queue)});
+        return result;
+    }
+
+    /// @param in nullptr for the source stage, work gets an empty item then
+    /// @param out nullptr for the last stage
+    /// @param work returns false to drop the item (or if a source had nothing to produce)
+    template <typename T>
+    void addStage(const std::string& name, StageQueue<T>* in, StageQueue<T>* out, std::function<bool(T& item)> work) {
+        auto stage = std::make_unique<stage_t>();
+        stage->name = name;
+        stage->run = [this, stage = stage.get(), in, out, work]() {
+            while (running) {
+                T item;
+                if (in && !in->pop(item, std::chrono::milliseconds(PIPELINE_POP_TIMEOUT))) {
+                    continue;
+                }
+                auto start = std::chrono::steady_clock::now();
+                bool done = work(item);
+                double time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                if (!done) {
+                    if (!in) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(PIPELINE_IDLE_SLEEP));
+                    }
+                    continue;
+                }
+                stage->items++;
+                double average = stage->time;
+                stage->time = average + (time - average) / PIPELINE_TIME_SMOOTHING;
+                if (out && !out->push(std::move(item))) {
+                    return;
+                }
+            }
+        };
+        stages.push_back(std::move(stage));
+    }
+
+    void start() {
+        running = true;
+        for (auto& stage : stages) {
+            stage->thread = std::thread(stage->run);
+        }
+    }
+
+    /// @brief Closes all queues and waits for the stages to finish their current item
+    void stop() {
+        if (!running.exchange(false)) {
+            return;
+        }
+        for (auto& queue : queues) {
+            queue.queue->close();
+        }
+        for (auto& stage : stages) {
+            stage->thread.join();
+        }
+    }
+
+    std::vector<pipeline_stage_stats_t> getStageStats() {
+        std::vector<pipeline_stage_stats_t> stats;
+        for (auto& stage : stages) {
+            stats.push_back({stage->name, stage->items.load(), stage->time.load()});
+        }
+        return stats;
+    }
+
+    /// @brief Items every queue dropped, by name
+    std::vector<std::pair<std::string, stage_queue_stats_t>> getQueueStats() {
+        std::vector<std::pair<std::string, stage_queue_stats_t>> stats;
+        for (auto& queue : queues) {
+            stats.push_back({queue.name, queue.queue->getStats()});
+        }
+        return stats;
+    }
+private:
+    typedef struct {
+        std::string name;
+        std::function<void()> run;
+        std::thread thread;
+        std::atomic<uint64_t> items{0};
+        std::atomic<double> time{0.0};
+    } stage_t;
+
+    typedef struct {
+        std::string name;
+        std::unique_ptr<StageQueueBase> queue;
+    } queue_t;
+
+    std::atomic<bool> running{false};
+    std::vector<std::unique_ptr<stage_t>> stages;
+    std::vector<queue_t> queues;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdint.h>
 #include <opencv2/core.hpp>
 
 class Provider {
@@ -7,5 +8,10 @@ public:
     virtual ~Provider() {}
 
     virtual int getImage(cv::Mat&) = 0;
+    /// @brief Like getImage, but sleeps until an image is available or timeout ms passed.
+    /// Providers that produce images on demand return right away.
+    virtual int waitForImage(cv::Mat& out, uint32_t timeout) {
+        return getImage(out);
+    }
     virtual double getFPS() = 0;
 };
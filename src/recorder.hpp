@@ -37,7 +37,8 @@ public:
     }
 
     void provideFrame(const cv::Mat& frame) {
-        lastFrame = frame.clone();
+        // frames are not written to once they are provided, sharing the buffer is enough
+        lastFrame = frame;
         if (isRecording) {
             videoWriter.write(frame);
         }
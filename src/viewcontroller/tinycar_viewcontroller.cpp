@@ -2,6 +2,7 @@
 
 TinycarViewController::TinycarViewController(std::shared_ptr<Tinycar> tinycar): tinycar(tinycar) {
     gamepadAvailable = false;
+    lastReceiveStats = {0};
     tinycar->registerTelemetryCallback(std::bind(&TinycarViewController::tinycarTelemetryCallback, this, std::placeholders::_1));
 }
 
@@ -20,6 +21,11 @@ void TinycarViewController::show() {
     } else {
         ImGui::Text("Gamepad not connected");
     }
+    if (tinycar->isControlLoopRunning()) {
+        control_loop_stats_t controlStats = tinycar->getControlLoopStats();
+        ImGui::Text("Control loop: %u Hz, %llu cycles, %llu missed", tinycar->getControlLoopRate(), (unsigned long long)controlStats.cycles, (unsigned long long)controlStats.missed);
+        ImGui::Text("Wake up lateness: %.0f us (max %.0f us)", controlStats.lateness, controlStats.max_lateness);
+    }
 
     ImGui::Text("Blinker");
     ImGui::SameLine();
@@ -63,7 +69,120 @@ void TinycarViewController::show() {
     ImGui::Text("Interarrival Jitter: %.2f ms", lastTelemetry.interarrival_jitter);
     ImGui::Text("Packet Loss: %d%%", lastTelemetry.packet_loss_percentage);
     ImGui::Text("Packets per Frame: %d", lastTelemetry.packets_per_frame);
+    tcfp_receive_stats_t streamStats = tinycar->getReceiveStats();
+    ImGui::Text("Recovered Fragments: %llu", (unsigned long long)streamStats.fragments_recovered);
+    ImGui::Text("NACKs: %llu, retransmitted: %llu", (unsigned long long)streamStats.nacks_sent, (unsigned long long)streamStats.fragments_retransmitted);
+    ImGui::Text("Concealed Frames: %llu", (unsigned long long)tinycar->getConcealedFrameCount());
+    ImGui::Text("Skipped Frames: %llu", (unsigned long long)tinycar->getSkippedFrameCount());
     ImGui::Text("Frame Latency: %d ms", lastTelemetry.frame_latency);
+    clock_sync_stats_t clockSyncStats = tinycar->getClockSyncStats();
+    if (clockSyncStats.synchronized) {
+        ImGui::Text("Network Latency: %u ms (clock offset error < %.1f ms)", tinycar->getFrameLatency(), clockSyncStats.rtt / 2.0);
+    } else {
+        ImGui::Text("Network Latency: waiting for clock sync");
+    }
+
+    if (tinycar->isStreamControlEnabled()) {
+        ImGui::SeparatorText("Stream Control");
+        stream_control_stats_t streamControlStats = tinycar->getStreamControlStats();
+        ImGui::Text("Level: %d (JPEG quality: %d, frame size: 1/%d)", streamControlStats.level, streamControlStats.jpeg_quality, 1 << streamControlStats.frame_size);
+        ImGui::Text("Loss: %d%%, queuing delay: %.1f ms", streamControlStats.packet_loss, streamControlStats.queuing_delay);
+        ImGui::Text("Decreases: %llu, increases: %llu", (unsigned long long)streamControlStats.decreases, (unsigned long long)streamControlStats.increases);
+    }
+
+    if (tinycar->isPlayoutEnabled()) {
+        ImGui::SeparatorText("Playout Buffer");
+        playout_stats_t playoutStats = tinycar->getPlayoutStats();
+        ImGui::Text("Delay: %.1f ms (Jitter: %.1f ms)", playoutStats.delay, playoutStats.jitter);
+        ImGui::Text("Released: %llu", (unsigned long long)playoutStats.released);
+        ImGui::Text("Dropped late: %llu, skipped: %llu, overflow: %llu", (unsigned long long)playoutStats.dropped_late,
+                    (unsigned long long)playoutStats.dropped_skipped, (unsigned long long)playoutStats.dropped_overflow);
+    }
+
+    int decodeWorkers = tinycar->getDecodeWorkerCount();
+    if (decodeWorkers > 0 || tinycar->isStreamingDecode()) {
+        ImGui::SeparatorText("Decode");
+        decode_pool_stats_t decodeStats = tinycar->getDecodeStats();
+        ImGui::Text("Workers: %d, delivered: %llu, failed: %llu", decodeWorkers, (unsigned long long)decodeStats.delivered, (unsigned long long)decodeStats.failed);
+        ImGui::Text("Decoded while received: %llu", (unsigned long long)decodeStats.streamed);
+        ImGui::Text("Reordered: %llu", (unsigned long long)decodeStats.reordered);
+        ImGui::Text("Dropped queued: %llu, late: %llu", (unsigned long long)decodeStats.dropped_queued, (unsigned long long)decodeStats.dropped_late);
+    }
+    ImGui::End();
+
+    showStatistics();
+
+    // average batch size of the frame stream receive path since last frame
+    tcfp_receive_stats_t receiveStats = tinycar->getReceiveStats();
+    uint64_t syscalls = receiveStats.syscalls - lastReceiveStats.syscalls;
+    if (syscalls > 0) {
+        PROFILE_COUNTER("tcfp datagrams/syscall", (double)(receiveStats.datagrams - lastReceiveStats.datagrams) / syscalls);
+    }
+    uint64_t frames = (receiveStats.frames_complete + receiveStats.frames_incomplete) - (lastReceiveStats.frames_complete + lastReceiveStats.frames_incomplete);
+    if (frames > 0 && lastReceiveStats.receive_cpu_ns > 0) {
+        PROFILE_COUNTER("tcfp receive cpu/frame (us)", (receiveStats.receive_cpu_ns - lastReceiveStats.receive_cpu_ns) / 1000.0 / frames);
+    }
+    lastReceiveStats = receiveStats;
+}
+
+void TinycarViewController::showStatistics() {
+    static const struct {
+        TinycarMetric metric;
+        const char* name;
+        const char* unit;
+    } metrics[] = {
+        {TinycarMetric::NETWORK_LATENCY, "Network Latency", "ms"},
+        {TinycarMetric::FRAME_LATENCY, "Frame Latency", "ms"},
+        {TinycarMetric::JITTER, "Jitter", "ms"},
+        {TinycarMetric::PACKET_LOSS, "Packet Loss", "%"},
+        {TinycarMetric::FRAGMENTS_PER_FRAME, "Fragments per Frame", ""},
+        {TinycarMetric::CAR_FPS, "FPS", ""},
+        {TinycarMetric::BATTERY_VOLTAGE, "Battery Voltage", "V"},
+        {TinycarMetric::WIFI_RSSI, "WiFi RSSI", "dBm"},
+    };
+
+    const size_t count = sizeof(metrics) / sizeof(metrics[0]);
+    time_series_stats_t stats[count];
+    for (size_t i = 0; i < count; i++) {
+        stats[i] = tinycar->getMetric(metrics[i].metric).getStats();
+    }
+
+    ImGui::Begin("Tinycar Statistics");
+    if (ImGui::BeginTable("##statistics", 6, ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit)) {
+        ImGui::TableSetupColumn("Metric");
+        ImGui::TableSetupColumn("Last");
+        ImGui::TableSetupColumn("p50");
+        ImGui::TableSetupColumn("p95");
+        ImGui::TableSetupColumn("p99");
+        ImGui::TableSetupColumn("Max");
+        ImGui::TableHeadersRow();
+        for (size_t i = 0; i < count; i++) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%s", metrics[i].name);
+            if (stats[i].count == 0) {
+                ImGui::TableNextColumn();
+                ImGui::TextDisabled("no samples");
+                continue;
+            }
+            for (float value : {stats[i].last, stats[i].p50, stats[i].p95, stats[i].p99, stats[i].max}) {
+                ImGui::TableNextColumn();
+                ImGui::Text("%.1f %s", value, metrics[i].unit);
+            }
+        }
+        ImGui::EndTable();
+    }
+
+    // the plots share the window width, the overlay keeps the tail of the distribution visible next to the curve
+    for (size_t i = 0; i < count; i++) {
+        tinycar->getMetric(metrics[i].metric).getValues(plotValues);
+        if (plotValues.empty()) {
+            continue;
+        }
+        char overlay[64];
+        snprintf(overlay, sizeof(overlay), "p50 %.1f  p99 %.1f %s", stats[i].p50, stats[i].p99, metrics[i].unit);
+        ImGui::PlotLines(metrics[i].name, plotValues.data(), (int)plotValues.size(), 0, overlay, FLT_MAX, FLT_MAX, ImVec2(0, 50));
+    }
     ImGui::End();
 }
 
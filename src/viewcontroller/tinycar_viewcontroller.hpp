@@ -19,6 +19,8 @@ public:
     void sendControlMessage();
 private:
     void showAxis(const char* name, float* value, float min, float max);
+    /// @brief Window with the percentiles and plots of the metrics of the tinycar
+    void showStatistics();
     void tinycarTelemetryCallback(TinycarTelemetry telemetry);
 
     // Input values
@@ -30,6 +32,8 @@ private:
     bool gamepadAvailable;
     std::shared_ptr<Tinycar> tinycar;
     TinycarTelemetry lastTelemetry;
+    tcfp_receive_stats_t lastReceiveStats;
+    std::vector<float> plotValues;
 
 
 };
@@ -0,0 +1,103 @@
+#include "clock_sync.hpp"
+
+#include <cmath>
+
+ClockSync::ClockSync() {
+    reset();
+}
+
+void ClockSync::reset() {
+    std::lock_guard<std::mutex> lk(m);
+    probes.clear();
+    probe_pending = false;
+    probe_time = 0.0;
+    consecutive_rejects = 0;
+    timestamp_started = false;
+    last_timestamp = 0;
+    last_unwrapped_timestamp = 0;
+    stats = {0};
+}
+
+double ClockSync::toMs(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration<double, std::milli>(time.time_since_epoch()).count();
+}
+
+int64_t ClockSync::unwrapTimestamp(uint32_t timestamp) {
+    if (!timestamp_started) {
+        last_unwrapped_timestamp = timestamp;
+        timestamp_started = true;
+    } else {
+        last_unwrapped_timestamp += (int32_t)(timestamp - last_timestamp);
+    }
+    last_timestamp = timestamp;
+    return last_unwrapped_timestamp;
+}
+
+void ClockSync::probeSent(std::chrono::steady_clock::time_point time) {
+    std::lock_guard<std::mutex> lk(m);
+    probe_pending = true;
+    probe_time = toMs(time);
+}
+
+bool ClockSync::replyReceived(uint32_t timestamp, std::chrono::steady_clock::time_point time) {
+    std::lock_guard<std::mutex> lk(m);
+    if (!probe_pending) {
+        stats.rejected++;
+        return false;
+    }
+    probe_pending = false;
+    double now = toMs(time);
+    probe_t probe;
+    probe.host_time = now;
+    probe.rtt = now - probe_time;
+    probe.offset = unwrapTimestamp(timestamp) - (probe_time + now) / 2.0;
+
+    while (!probes.empty() && now - probes.front().host_time > CLOCK_SYNC_MAX_AGE) {
+        probes.pop_front();
+    }
+    // Both the estimate and the probe are exact to half their RTT. If the ranges do not overlap, the reply most likely
+    // belongs to an older probe whose answer was delayed, which would look like a very short RTT.
+    if (stats.synchronized && !probes.empty() && std::abs(probe.offset - stats.offset) > (probe.rtt + stats.rtt) / 2.0 + 1.0) {
+        stats.rejected++;
+        if (++consecutive_rejects < CLOCK_SYNC_MAX_REJECTS) {
+            return false;
+        }
+        // the clock of the car jumped
+        probes.clear();
+    }
+    consecutive_rejects = 0;
+    probes.push_back(probe);
+    if (probes.size() > CLOCK_SYNC_WINDOW) {
+        probes.pop_front();
+    }
+    stats.probes++;
+    updateEstimate();
+    return true;
+}
+
+void ClockSync::updateEstimate() {
+    const probe_t* best = &probes.front();
+    for (const auto& probe : probes) {
+        if (probe.rtt < best->rtt) {
+            best = &probe;
+        }
+    }
+    stats.offset = best->offset;
+    stats.rtt = best->rtt;
+    stats.synchronized = true;
+}
+
+bool ClockSync::latency(uint32_t timestamp, std::chrono::steady_clock::time_point time, double& latency) {
+    std::lock_guard<std::mutex> lk(m);
+    if (!stats.synchronized) {
+        return false;
+    }
+    double sent = unwrapTimestamp(timestamp) - stats.offset;
+    latency = toMs(time) - sent;
+    return true;
+}
+
+clock_sync_stats_t ClockSync::getStats() {
+    std::lock_guard<std::mutex> lk(m);
+    return stats;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+#define CLOCK_SYNC_WINDOW 16 // RTT probes the offset is estimated from
+#define CLOCK_SYNC_MAX_AGE 60000 // ms, older probes are dropped so the estimate follows clock drift
+#define CLOCK_SYNC_MAX_REJECTS 4 // consecutive rejected replies after which the estimate starts over, e.g. after the car rebooted
+
+typedef struct {
+    bool synchronized; // at least one probe was answered
+    double offset; // ms, car clock - host clock
+    double rtt; // ms, smallest RTT in the window. The offset is exact to rtt / 2
+    uint64_t probes; // answered probes
+    uint64_t rejected; // replies that did not fit the last probe
+} clock_sync_stats_t;
+
+/// @brief Estimates the offset between the clock of the car and the host from RTT probes, so sender timestamps can be mapped to host time.
+///
+/// A probe is sent at host time t1 and the car answers with its own time T. If both directions take the same time, T was taken at
+/// (t1 + t2) / 2 on the host, where t2 is the arrival of the answer. The asymmetry is unknown but at most rtt / 2, so the probe
+/// with the smallest RTT within the window gives the best estimate (NTP's clock filter). Probes expire after CLOCK_SYNC_MAX_AGE.
+class ClockSync {
+public:
+    ClockSync();
+
+    /// @brief Notes the host time a probe was sent. Only the last probe is matched with a reply.
+    void probeSent(std::chrono::steady_clock::time_point time);
+    /// @brief Adds the answer to the last probe
+    /// @param timestamp car time in ms the probe was received
+    /// @return false if the reply was rejected
+    bool replyReceived(uint32_t timestamp, std::chrono::steady_clock::time_point time);
+
+    /// @brief Time between a sender timestamp and a host time, e.g. capture to arrival of a frame
+    /// @param latency in ms, may be slightly negative within the error of the estimate
+    /// @return false if the clocks are not synchronized yet
+    bool latency(uint32_t timestamp, std::chrono::steady_clock::time_point time, double& latency);
+
+    clock_sync_stats_t getStats();
+    void reset();
+private:
+    typedef struct {
+        double host_time; // ms, arrival of the reply
+        double offset;
+        double rtt;
+    } probe_t;
+
+    /// @brief Extends a car timestamp to 64 bit, so the offset survives the wrap around of the 32 bit ms counter
+    int64_t unwrapTimestamp(uint32_t timestamp);
+    /// @brief Picks the probe with the smallest RTT
+    void updateEstimate();
+    static double toMs(std::chrono::steady_clock::time_point time);
+
+    std::mutex m;
+    std::deque<probe_t> probes;
+    bool probe_pending;
+    double probe_time;
+    int consecutive_rejects;
+
+    bool timestamp_started;
+    uint32_t last_timestamp;
+    int64_t last_unwrapped_timestamp;
+
+    clock_sync_stats_t stats;
+};
@@ -0,0 +1,109 @@
+#include "control_loop.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <pthread.h>
+#include <time.h>
+
+ControlLoop::ControlLoop() {}
+
+ControlLoop::~ControlLoop() {
+    stop();
+}
+
+int ControlLoop::start(uint32_t rate, std::function<void()> tick, bool realtime) {
+    if (running || rate == 0) {
+        return -1;
+    }
+    this->rate = rate;
+    this->tick = tick;
+    this->realtime = realtime;
+    period = std::chrono::nanoseconds(1000000000ull / rate);
+    cycles = 0;
+    missed = 0;
+    lateness = 0.0;
+    maxLateness = 0.0;
+    running = true;
+    loopThread = std::thread(&ControlLoop::loop_task, this);
+    std::cout << "\033[1;32m[Tinycar] Control Info: control loop running at " << rate << " Hz" << "\033[0m" << std::endl;
+    return 0;
+}
+
+void ControlLoop::stop() {
+    running = false;
+    if (loopThread.joinable()) {
+        loopThread.join();
+    }
+}
+
+bool ControlLoop::isRunning() {
+    return running;
+}
+
+uint32_t ControlLoop::getRate() {
+    return rate;
+}
+
+control_loop_stats_t ControlLoop::getStats() {
+    control_loop_stats_t stats;
+    stats.cycles = cycles.load(std::memory_order_relaxed);
+    stats.missed = missed.load(std::memory_order_relaxed);
+    stats.lateness = lateness.load(std::memory_order_relaxed);
+    stats.max_lateness = maxLateness.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void ControlLoop::setRealtimePriority() {
+#ifdef __linux__
+    struct sched_param param;
+    param.sched_priority = CONTROL_LOOP_REALTIME_PRIORITY;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0) {
+        std::cerr << "\033[1;33m[Tinycar] Control Warning: could not use realtime scheduling (" << err << "), running with normal priority" << "\033[0m" << std::endl;
+    }
+#else
+    std::cerr << "\033[1;33m[Tinycar] Control Warning: realtime scheduling is not supported on this platform" << "\033[0m" << std::endl;
+#endif
+}
+
+void ControlLoop::sleepUntil(std::chrono::steady_clock::time_point deadline) {
+#ifdef __linux__
+    // steady_clock is CLOCK_MONOTONIC on Linux
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+#else
+    std::this_thread::sleep_until(deadline);
+#endif
+}
+
+void ControlLoop::loop_task() {
+    if (realtime) {
+        setRealtimePriority();
+    }
+    auto deadline = std::chrono::steady_clock::now() + period;
+    while (running) {
+        sleepUntil(deadline);
+        auto now = std::chrono::steady_clock::now();
+        double late = std::chrono::duration<double, std::micro>(now - deadline).count();
+        lateness.store(lateness.load(std::memory_order_relaxed) + (late - lateness.load(std::memory_order_relaxed)) / 16.0, std::memory_order_relaxed);
+        if (late > maxLateness.load(std::memory_order_relaxed)) {
+            maxLateness.store(late, std::memory_order_relaxed);
+        }
+
+        tick();
+        cycles.fetch_add(1, std::memory_order_relaxed);
+
+        deadline += period;
+        now = std::chrono::steady_clock::now();
+        if (deadline <= now) {
+            // overran, continue with the next deadline in the future
+            uint64_t behind = (now - deadline) / period + 1;
+            missed.fetch_add(behind, std::memory_order_relaxed);
+            deadline += period * behind;
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+#define CONTROL_LOOP_DEFAULT_RATE 50 // Hz
+#define CONTROL_LOOP_REALTIME_PRIORITY 50 // SCHED_FIFO priority if realtime scheduling is requested
+
+typedef struct {
+    uint64_t cycles;
+    uint64_t missed; // deadlines that passed while the previous cycle was still running, these cycles are skipped
+    double lateness; // us, wake up after the deadline, moving average
+    double max_lateness; // us
+} control_loop_stats_t;
+
+/// @brief Thread that calls a function at a fixed rate, independent of the GUI frame rate.
+///
+/// Deadlines are absolute (clock_nanosleep with TIMER_ABSTIME on Linux), so the rate does not drift with the duration of the
+/// cycles. If a cycle overruns, the deadlines it missed are skipped instead of being caught up in a burst.
+class ControlLoop {
+public:
+    ControlLoop();
+    ~ControlLoop();
+
+    /// @param rate cycles per second
+    /// @param tick called once per cycle on the loop thread
+    /// @param realtime tries to run the thread with SCHED_FIFO (Linux, needs CAP_SYS_NICE). Falls back to normal scheduling.
+    /// @return 0 on success, -1 if the loop is already running or the rate is 0
+    int start(uint32_t rate, std::function<void()> tick, bool realtime = false);
+    void stop();
+    bool isRunning();
+    uint32_t getRate();
+    control_loop_stats_t getStats();
+private:
+    void loop_task();
+    void sleepUntil(std::chrono::steady_clock::time_point deadline);
+    void setRealtimePriority();
+
+    std::thread loopThread;
+    std::function<void()> tick;
+    std::chrono::nanoseconds period;
+    uint32_t rate = 0;
+    bool realtime = false;
+    std::atomic<bool> running{false};
+
+    std::atomic<uint64_t> cycles{0};
+    std::atomic<uint64_t> missed{0};
+    std::atomic<double> lateness{0.0};
+    std::atomic<double> maxLateness{0.0};
+};
@@ -0,0 +1,380 @@
+#include "decode_pool.hpp"
+
+#include <algorithm>
+
+static_assert(DECODE_POOL_MAX_WORKERS * 2 <= MAX_FRAMES_DECODING, "decode workers hold more frame slots than the TCFP_Client has for them");
+
+DecodePool::DecodePool() {
+    stats = {0};
+    for (auto& p : pending) {
+        p.state = PendingState::FREE;
+        p.conceal = false;
+    }
+}
+
+DecodePool::~DecodePool() {
+    stop();
+}
+
+void DecodePool::start(int workers, bool latestWins) {
+    stop();
+    workers = std::max(0, std::min(workers, DECODE_POOL_MAX_WORKERS));
+    std::lock_guard<std::mutex> lk(m);
+    this->latestWins = latestWins;
+    for (int i = 0; i < workers; i++) {
+        auto worker = std::make_unique<worker_t>();
+        worker->decoder.setAllocator(allocator);
+        worker->regionVersion = 0;
+        worker->thread = std::thread(&DecodePool::work, this, worker.get());
+        this->workers.push_back(std::move(worker));
+    }
+}
+
+void DecodePool::stop() {
+    std::unique_lock<std::mutex> lk(m);
+    if (workers.empty()) {
+        return;
+    }
+    stopping = true;
+    cv.notify_all();
+    lk.unlock();
+    for (auto& worker : workers) {
+        worker->thread.join();
+    }
+    lk.lock();
+    workers.clear();
+    for (auto& p : pending) {
+        if (p.state == PendingState::QUEUED) {
+            stats.dropped_queued++;
+        }
+        p.frame.reset();
+        p.decoded.image.release();
+        p.state = PendingState::FREE;
+    }
+    tailTicket = deliveryTicket = headTicket;
+    queuedCount = 0;
+    stopping = false;
+}
+
+int DecodePool::getWorkerCount() {
+    std::lock_guard<std::mutex> lk(m);
+    return workers.size();
+}
+
+bool DecodePool::isLatestWins() {
+    std::lock_guard<std::mutex> lk(m);
+    return latestWins;
+}
+
+void DecodePool::registerDeliveryCallback(std::function<void(decoded_frame_t& frame)> callback) {
+    std::lock_guard<std::mutex> lk(m);
+    deliveryCallback = callback;
+}
+
+void DecodePool::setRegion(const jpeg_decode_region_t& region) {
+    std::lock_guard<std::mutex> lk(region_m);
+    this->region = region;
+    regionVersion++;
+}
+
+void DecodePool::setAllocator(cv::MatAllocator* allocator) {
+    {
+        std::lock_guard<std::mutex> lk(m);
+        this->allocator = allocator;
+    }
+    // one after the other, submitInline takes m while it holds inline_m
+    {
+        std::lock_guard<std::mutex> ilk(inline_m);
+        inlineDecoder.setAllocator(allocator);
+    }
+    std::lock_guard<std::mutex> slk(stream_m);
+    streamDecoder.setAllocator(allocator);
+}
+
+void DecodePool::setStreaming(bool enabled) {
+    streaming = enabled;
+    if (!enabled) {
+        std::lock_guard<std::mutex> lk(stream_m);
+        streamDecoder.abortStream();
+        streamStarted = false;
+        streamedImage.release();
+    }
+}
+
+bool DecodePool::isStreaming() {
+    return streaming;
+}
+
+void DecodePool::progress(const tcfp_frame_slot_t* frame) {
+    if (!streaming) {
+        return;
+    }
+    std::lock_guard<std::mutex> lk(stream_m);
+    if (!streamStarted || frame->frame_num != streamFrameNum) {
+        // only the newest frame, an older one is not worth it anymore
+        if (streamStarted && tcfpFrameNumBefore(frame->frame_num, streamFrameNum)) {
+            return;
+        }
+        if (!tcfpFragmentReceived(frame, 0)) {
+            return;
+        }
+        applyRegion(streamDecoder, streamRegionVersion);
+        streamDecoder.beginStream(frame->data);
+        streamStarted = true;
+        streamFrameNum = frame->frame_num;
+        streamFragments = 0;
+    }
+    if (!streamDecoder.isStreaming()) {
+        // done or failed
+        return;
+    }
+    uint32_t fragments = tcfpFirstMissingFragment(frame, streamFragments);
+    if (fragments == streamFragments) {
+        return;
+    }
+    streamFragments = fragments;
+    // only the last fragment is shorter than the stride, and it has the marker that makes len exact
+    bool complete = fragments == frame->fragment_count;
+    size_t available = complete ? frame->len : (size_t)fragments * frame->fragment_stride;
+    cv::Mat image;
+    if (streamDecoder.continueStream(available, complete, image) == 1) {
+        streamedImage = image;
+        streamedFrameNum = frame->frame_num;
+    }
+}
+
+void DecodePool::submit(TCFP_Frame frame, bool conceal) {
+    cv::Mat streamed = takeStreamed(frame->frame_num);
+    std::unique_lock<std::mutex> lk(m);
+    stats.submitted++;
+    if (!streamed.empty()) {
+        stats.streamed++;
+    }
+    if (workers.empty()) {
+        // without m, getStats must not wait for the decode or the consumer
+        lk.unlock();
+        submitInline(std::move(frame), conceal, streamed);
+        return;
+    }
+
+    if (streamed.empty() && queuedCount >= (int)workers.size()) {
+        // all workers are busy, the oldest queued frame would only add latency
+        for (uint64_t ticket = tailTicket; ticket < headTicket; ticket++) {
+            pending_t& p = pending[ticket % DECODE_POOL_PENDING];
+            if (p.state == PendingState::QUEUED) {
+                p.frame.reset();
+                p.state = PendingState::FREE;
+                queuedCount--;
+                stats.dropped_queued++;
+                break;
+            }
+        }
+        if (!latestWins) {
+            deliverInOrder();
+        }
+        advanceTail();
+    }
+    if (headTicket - tailTicket == DECODE_POOL_PENDING) {
+        // decoded frames are all waiting for one that takes far too long, in order mode only.
+        // Its entry cannot be reused while a worker decodes into it, so the new frame is dropped.
+        stats.dropped_queued++;
+        return;
+    }
+    pending_t& p = pending[headTicket % DECODE_POOL_PENDING];
+    if (!streamed.empty()) {
+        // decoded already, straight to the delivery
+        describe(frame.get(), p.decoded);
+        p.decoded.image = streamed;
+        p.state = PendingState::DECODING;
+        complete(headTicket++, true);
+        advanceTail();
+        return;
+    }
+    p.state = PendingState::QUEUED;
+    p.frame = std::move(frame);
+    p.conceal = conceal;
+    headTicket++;
+    queuedCount++;
+    cv.notify_one();
+}
+
+void DecodePool::submitInline(TCFP_Frame frame, bool conceal, const cv::Mat& streamed) {
+    // frames come from one thread at a time, the lock only keeps setAllocator out
+    std::lock_guard<std::mutex> ilk(inline_m);
+    bool ok;
+    if (!streamed.empty()) {
+        describe(frame.get(), inlineFrame);
+        inlineFrame.image = streamed;
+        ok = true;
+    } else {
+        ok = decode(inlineDecoder, inlineRegionVersion, frame.get(), conceal, inlineFrame);
+    }
+    frame.reset();
+    {
+        std::lock_guard<std::mutex> lk(m);
+        if (!ok) {
+            stats.failed++;
+            return;
+        }
+        stats.delivered++;
+    }
+    // set before frames are submitted, so it is not replaced while it is called
+    if (deliveryCallback) {
+        deliveryCallback(inlineFrame);
+    }
+    inlineFrame.image.release();
+}
+
+decode_pool_stats_t DecodePool::getStats() {
+    std::lock_guard<std::mutex> lk(m);
+    return stats;
+}
+
+void DecodePool::work(worker_t* worker) {
+    std::unique_lock<std::mutex> lk(m);
+    while (true) {
+        cv.wait(lk, [this]{ return stopping || queuedCount > 0; });
+        if (stopping) {
+            return;
+        }
+        // oldest queued frame first, so frames are done roughly in order
+        uint64_t ticket = tailTicket;
+        while (pending[ticket % DECODE_POOL_PENDING].state != PendingState::QUEUED) {
+            ticket++;
+        }
+        pending_t& p = pending[ticket % DECODE_POOL_PENDING];
+        p.state = PendingState::DECODING;
+        queuedCount--;
+        TCFP_Frame frame = std::move(p.frame);
+        bool conceal = p.conceal;
+        lk.unlock();
+
+        // the entry is not touched by anyone else while it is decoding
+        bool ok = decode(worker->decoder, worker->regionVersion, frame.get(), conceal, p.decoded);
+        // back to the reassembly as early as possible
+        frame.reset();
+
+        lk.lock();
+        complete(ticket, ok);
+        advanceTail();
+    }
+}
+
+void DecodePool::complete(uint64_t ticket, bool ok) {
+    pending_t& p = pending[ticket % DECODE_POOL_PENDING];
+    if (!ok) {
+        stats.failed++;
+        p.state = PendingState::FREE;
+        if (!latestWins) {
+            // newer frames may wait for this one
+            deliverInOrder();
+        }
+    } else if (ticket < deliveryTicket) {
+        // a newer frame was delivered already
+        stats.dropped_late++;
+        p.decoded.image.release();
+        p.state = PendingState::FREE;
+    } else if (latestWins) {
+        // older frames that did not even start are outdated now
+        for (uint64_t older = deliveryTicket; older < ticket; older++) {
+            pending_t& o = pending[older % DECODE_POOL_PENDING];
+            if (o.state == PendingState::QUEUED) {
+                o.frame.reset();
+                o.state = PendingState::FREE;
+                queuedCount--;
+                stats.dropped_late++;
+            }
+        }
+        deliver(p.decoded);
+        deliveryTicket = ticket + 1;
+        p.state = PendingState::FREE;
+    } else {
+        if (ticket != deliveryTicket) {
+            stats.reordered++;
+        }
+        p.state = PendingState::DONE;
+        deliverInOrder();
+    }
+}
+
+void DecodePool::applyRegion(JpegDecoder& decoder, uint32_t& decoderRegionVersion) {
+    std::lock_guard<std::mutex> lk(region_m);
+    if (decoderRegionVersion != regionVersion) {
+        decoder.setRegion(region);
+        decoderRegionVersion = regionVersion;
+    }
+}
+
+cv::Mat DecodePool::takeStreamed(uint16_t frame_num) {
+    cv::Mat image;
+    if (!streaming) {
+        return image;
+    }
+    std::lock_guard<std::mutex> lk(stream_m);
+    if (!streamedImage.empty() && streamedFrameNum == frame_num) {
+        image = streamedImage;
+        streamedImage.release();
+    } else if (!streamedImage.empty() && tcfpFrameNumBefore(streamedFrameNum, frame_num)) {
+        // that frame was dropped before it was submitted
+        streamedImage.release();
+    }
+    return image;
+}
+
+void DecodePool::describe(const tcfp_frame_slot_t* frame, decoded_frame_t& out) {
+    const tcfp_sender_report_t& senderReport = frame->senderReport;
+    out.frame_num = senderReport.frame_num;
+    out.timestamp = senderReport.timestamp;
+    out.arrival = senderReport.last_arrival;
+    out.concealed = false;
+    // a buffer that is still referenced must not be decoded into
+    out.image.release();
+}
+
+bool DecodePool::decode(JpegDecoder& decoder, uint32_t& decoderRegionVersion, const tcfp_frame_slot_t* frame, bool conceal, decoded_frame_t& out) {
+    applyRegion(decoder, decoderRegionVersion);
+    describe(frame, out);
+    const tcfp_sender_report_t& senderReport = frame->senderReport;
+
+    // only the region that is needed and already rotated
+    if (senderReport.fragments_included == senderReport.fragement_count && frame->len > 0) {
+        return decoder.decode(frame->data, frame->len, out.image) == 0 && !out.image.empty();
+    }
+    if (conceal && decoder.decodePartial(frame, out.image) == 0 && decoder.getValidRowCount() > 0 && !out.image.empty()) {
+        out.concealed = true;
+        out.validRows.assign(decoder.getValidRows().begin(), decoder.getValidRows().end());
+        return true;
+    }
+    printf("Did not receive all fragments to decode image\n");
+    return false;
+}
+
+void DecodePool::deliverInOrder() {
+    while (deliveryTicket < headTicket) {
+        pending_t& p = pending[deliveryTicket % DECODE_POOL_PENDING];
+        if (p.state == PendingState::DONE) {
+            deliver(p.decoded);
+            p.state = PendingState::FREE;
+        } else if (p.state != PendingState::FREE) {
+            // still queued or decoding, everything newer waits for it
+            break;
+        }
+        // free entries failed or were dropped
+        deliveryTicket++;
+    }
+}
+
+void DecodePool::deliver(decoded_frame_t& frame) {
+    stats.delivered++;
+    if (deliveryCallback) {
+        deliveryCallback(frame);
+    }
+    // the buffer goes back to the FrameBufferPool once the consumer is done with it
+    frame.image.release();
+}
+
+void DecodePool::advanceTail() {
+    while (tailTicket < headTicket && pending[tailTicket % DECODE_POOL_PENDING].state == PendingState::FREE) {
+        tailTicket++;
+    }
+}
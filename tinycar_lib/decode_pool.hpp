@@ -0,0 +1,162 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "tcfp.hpp"
+#include "jpeg_decoder.hpp"
+
+#define DECODE_POOL_MAX_WORKERS (MAX_FRAMES_DECODING / 2) // every worker holds one frame slot while decoding and one in the queue
+#define DECODE_POOL_PENDING 16 // frames between submission and delivery
+
+/// @brief Frame as it is handed to the delivery callback
+typedef struct {
+    cv::Mat image;
+    uint16_t frame_num;
+    uint32_t timestamp; // of the sender
+    std::chrono::steady_clock::time_point arrival; // of the last fragment
+    bool concealed; // decoded from an incomplete frame, rows that are not valid still have to be concealed
+    std::vector<uint8_t> validRows; // only if concealed, see JpegDecoder::getValidRows
+} decoded_frame_t;
+
+typedef struct {
+    uint64_t submitted;
+    uint64_t delivered;
+    uint64_t failed; // could not be decoded
+    uint64_t dropped_queued; // replaced by a newer frame before a worker took it, or not queued because DECODE_POOL_PENDING frames wait for an older one
+    uint64_t dropped_late; // decoded after a newer frame was delivered, latest wins only
+    uint64_t reordered; // decoded before an older frame and held back for it
+    uint64_t streamed; // decoded while they were received, see setStreaming
+} decode_pool_stats_t;
+
+/// @brief Decodes frames on a pool of worker threads, so a slow decode does not hold up the frame thread.
+///
+/// Every worker has its own JpegDecoder. A frame keeps its reassembly slot until it is decoded, so the slot goes back to the
+/// TCFP_Client as early as possible. Frames are delivered in the order they were submitted, which is frame_num order: a frame
+/// that is done before an older one waits for it. With latest wins a frame is delivered as soon as it is decoded instead and
+/// older frames that are still decoding are dropped, less latency for the price of a frame now and then.
+/// At most one frame per worker waits in the queue, the oldest is dropped for a new one. In order, a frame that takes so long
+/// that DECODE_POOL_PENDING frames wait for it holds up the new frames instead, they are dropped until it is done.
+///
+/// Without workers, frames are decoded and delivered on the thread that submits them, outside of the lock getStats takes.
+///
+/// With streaming, the newest frame is decoded on the receiving thread while its fragments arrive, as far as they were received
+/// in order. When the last fragment arrives, only the tail of the frame is left to decode and the frame is delivered without
+/// going through the workers. Frames with a gap, that are overtaken by a newer frame or that fail are decoded as usual.
+class DecodePool {
+public:
+    DecodePool();
+    ~DecodePool();
+
+    /// @brief Starts the workers, stops the running ones first
+    /// @param workers 0 to decode on the submitting thread, at most DECODE_POOL_MAX_WORKERS
+    /// @param latestWins deliver frames as soon as they are decoded and drop older ones that are done later
+    void start(int workers, bool latestWins = false);
+    /// @brief Waits for the frames that are being decoded, queued frames are dropped
+    void stop();
+    int getWorkerCount();
+    bool isLatestWins();
+
+    /// @brief Called with every decoded frame, in order and never on two threads at the same time. Set before frames are submitted.
+    void registerDeliveryCallback(std::function<void(decoded_frame_t& frame)> callback);
+    /// @brief Region of the following frames (see JpegDecoder::setRegion)
+    void setRegion(const jpeg_decode_region_t& region);
+    /// @brief Allocator of the decoded images (see JpegDecoder::setAllocator). Set before the workers are started.
+    void setAllocator(cv::MatAllocator* allocator);
+
+    /// @brief Decode frames while they are received (see TCFP_Client::registerFrameProgressCallback)
+    void setStreaming(bool enabled);
+    bool isStreaming();
+    /// @brief Feeds the fragments of a frame in flight that arrived in order to the stream decoder. Receiving thread.
+    void progress(const tcfp_frame_slot_t* frame);
+
+    /// @brief Frames must be submitted from one thread at a time, newer frames after older ones
+    /// @param conceal decode an incomplete frame as far as possible instead of dropping it
+    void submit(TCFP_Frame frame, bool conceal);
+
+    decode_pool_stats_t getStats();
+private:
+    enum class PendingState {
+        FREE,
+        QUEUED,
+        DECODING,
+        DONE
+    };
+
+    typedef struct {
+        PendingState state;
+        TCFP_Frame frame; // until a worker takes it
+        bool conceal;
+        decoded_frame_t decoded;
+    } pending_t;
+
+    typedef struct {
+        JpegDecoder decoder;
+        uint32_t regionVersion; // of the region the decoder has
+        std::thread thread;
+    } worker_t;
+
+    void work(worker_t* worker);
+    /// @brief Delivers, holds back or drops the frame of a ticket that is done. Holds m.
+    /// @param ok false if the frame could not be decoded
+    void complete(uint64_t ticket, bool ok);
+    /// @brief Hands the decoder the region if it changed
+    void applyRegion(JpegDecoder& decoder, uint32_t& decoderRegionVersion);
+    /// @brief Takes the frame out of the stream decoder if it is done
+    /// @return empty if the frame was not streamed
+    cv::Mat takeStreamed(uint16_t frame_num);
+    /// @brief Everything but the image
+    void describe(const tcfp_frame_slot_t* frame, decoded_frame_t& out);
+    /// @return true if the frame was decoded into out
+    bool decode(JpegDecoder& decoder, uint32_t& decoderRegionVersion, const tcfp_frame_slot_t* frame, bool conceal, decoded_frame_t& out);
+    /// @brief Delivers the frames that are done and have no older frame left in front of them. Holds m.
+    void deliverInOrder();
+    void deliver(decoded_frame_t& frame);
+    /// @brief Decodes and delivers on the submitting thread, without workers. Does not hold m.
+    void submitInline(TCFP_Frame frame, bool conceal, const cv::Mat& streamed);
+    /// @brief Frees the pending entries at the tail. Holds m.
+    void advanceTail();
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<std::unique_ptr<worker_t>> workers;
+    bool latestWins = false;
+    bool stopping = false;
+    pending_t pending[DECODE_POOL_PENDING]; // indexed by ticket % DECODE_POOL_PENDING
+    uint64_t headTicket = 0; // ticket of the next submitted frame
+    uint64_t tailTicket = 0; // oldest entry that is not free
+    uint64_t deliveryTicket = 0; // older frames are not delivered anymore
+    int queuedCount = 0;
+    decode_pool_stats_t stats;
+    std::function<void(decoded_frame_t& frame)> deliveryCallback;
+
+    // decoder for the submitting thread, without workers
+    std::mutex inline_m;
+    JpegDecoder inlineDecoder;
+    uint32_t inlineRegionVersion = 0;
+    decoded_frame_t inlineFrame;
+
+    // decodes while frames are received
+    std::atomic<bool> streaming{false};
+    std::mutex stream_m;
+    JpegDecoder streamDecoder;
+    uint32_t streamRegionVersion = 0;
+    bool streamStarted = false; // the stream decoder got streamFrameNum, done or not
+    uint16_t streamFrameNum = 0;
+    uint32_t streamFragments = 0; // fragments at the start of the frame that were fed to the decoder
+    cv::Mat streamedImage; // done, waits for submit
+    uint16_t streamedFrameNum = 0;
+
+    std::mutex region_m;
+    jpeg_decode_region_t region;
+    uint32_t regionVersion = 0;
+    cv::MatAllocator* allocator = nullptr;
+};
@@ -0,0 +1,104 @@
+#include "frame_buffer_pool.hpp"
+
+#include <new>
+
+FrameBufferPool* FrameBufferPool::getInstance() {
+    // never destroyed, frames in static or global Mats may be released after the end of main
+    static FrameBufferPool* instance = new FrameBufferPool();
+    return instance;
+}
+
+FrameBufferPool::FrameBufferPool() {
+    freeBuffers.reserve(FRAME_BUFFER_POOL_MAX_FREE);
+    freeHeaders.reserve(FRAME_BUFFER_POOL_MAX_FREE);
+    stats = {0};
+}
+
+cv::UMatData* FrameBufferPool::allocate(int dims, const int* sizes, int type, void* data, size_t* step, cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const {
+    if (data != nullptr) {
+        // wraps memory of the caller, nothing to pool
+        return cv::Mat::getDefaultAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+    }
+    // continuous layout, like the default allocator
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = dims - 1; i >= 0; i--) {
+        if (step) {
+            step[i] = total;
+        }
+        total *= sizes[i];
+    }
+
+    uint8_t* buffer = nullptr;
+    void* header = nullptr;
+    {
+        std::lock_guard<std::mutex> lk(m);
+        for (size_t i = 0; i < freeBuffers.size(); i++) {
+            if (freeBuffers[i].size == total) {
+                buffer = freeBuffers[i].data;
+                freeBuffers.erase(freeBuffers.begin() + i);
+                stats.reuses++;
+                break;
+            }
+        }
+        if (!buffer) {
+            stats.allocations++;
+            stats.buffers++;
+            stats.bytes += total;
+        }
+        if (!freeHeaders.empty()) {
+            header = freeHeaders.back();
+            freeHeaders.pop_back();
+        }
+    }
+    if (!buffer) {
+        buffer = (uint8_t*)cv::fastMalloc(total);
+    }
+    if (!header) {
+        header = ::operator new(sizeof(cv::UMatData));
+    }
+    cv::UMatData* u = new (header) cv::UMatData(this);
+    u->data = u->origdata = buffer;
+    u->size = total;
+    return u;
+}
+
+bool FrameBufferPool::allocate(cv::UMatData* data, cv::AccessFlag accessflags, cv::UMatUsageFlags usageFlags) const {
+    // host memory only, always allocated already
+    return data != nullptr;
+}
+
+void FrameBufferPool::deallocate(cv::UMatData* u) const {
+    if (!u) {
+        return;
+    }
+    CV_Assert(u->urefcount == 0 && u->refcount == 0);
+    buffer_t buffer = {u->origdata, u->size};
+    u->~UMatData();
+
+    buffer_t evicted = {nullptr, 0};
+    void* header = u;
+    {
+        std::lock_guard<std::mutex> lk(m);
+        if (freeBuffers.size() == FRAME_BUFFER_POOL_MAX_FREE) {
+            // e.g. buffers of the previous resolution
+            evicted = freeBuffers.front();
+            freeBuffers.erase(freeBuffers.begin());
+            stats.buffers--;
+            stats.bytes -= evicted.size;
+        }
+        freeBuffers.push_back(buffer);
+        if (freeHeaders.size() < FRAME_BUFFER_POOL_MAX_FREE) {
+            freeHeaders.push_back(header);
+            header = nullptr;
+        }
+    }
+    if (evicted.data) {
+        cv::fastFree(evicted.data);
+    }
+    ::operator delete(header);
+}
+
+frame_buffer_pool_stats_t FrameBufferPool::getStats() {
+    std::lock_guard<std::mutex> lk(m);
+    return stats;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#define FRAME_BUFFER_POOL_MAX_FREE 16 // free buffers kept for reuse, older ones go back to the heap
+
+typedef struct {
+    uint64_t allocations; // buffers that had to be taken from the heap
+    uint64_t reuses; // buffers that were handed out again
+    size_t buffers; // buffers owned by the pool, in use or free
+    size_t bytes; // size of these buffers
+} frame_buffer_pool_stats_t;
+
+/// @brief Recycles the pixel buffers of decoded frames.
+///
+/// Used as allocator of cv::Mat, so a frame stays an ordinary cv::Mat: copies share the buffer through the refcount of the Mat,
+/// and once the last copy is gone, the buffer goes back to the pool instead of the heap. As soon as the pool owns as many buffers
+/// as frames are alive at the same time (decoder, mailbox or playout buffer, consumer, view), no frame allocates anymore.
+/// The refcount header of the Mat (UMatData) is recycled as well. Only buffers of the same size are reused.
+///
+/// Frames can outlive the car that decoded them, so there is one pool for the process that is never destroyed.
+class FrameBufferPool : public cv::MatAllocator {
+public:
+    static FrameBufferPool* getInstance();
+
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override;
+    bool allocate(cv::UMatData* data, cv::AccessFlag accessflags, cv::UMatUsageFlags usageFlags) const override;
+    void deallocate(cv::UMatData* data) const override;
+
+    frame_buffer_pool_stats_t getStats();
+private:
+    FrameBufferPool();
+
+    typedef struct {
+        uint8_t* data;
+        size_t size;
+    } buffer_t;
+
+    // the allocator interface is const
+    mutable std::mutex m;
+    mutable std::vector<buffer_t> freeBuffers; // oldest first, capacity reserved for FRAME_BUFFER_POOL_MAX_FREE
+    mutable std::vector<void*> freeHeaders; // storage for UMatData, capacity reserved for FRAME_BUFFER_POOL_MAX_FREE
+    mutable frame_buffer_pool_stats_t stats;
+};
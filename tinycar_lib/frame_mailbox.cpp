@@ -0,0 +1,70 @@
+#include "frame_mailbox.hpp"
+
+FrameMailbox::FrameMailbox(): middle(1), back(2), front(0) {
+    for (auto& slot : slots) {
+        slot.sequence = 0;
+        slot.frame_num = 0;
+        slot.timestamp = 0;
+    }
+}
+
+void FrameMailbox::publish(const cv::Mat& image, uint16_t frame_num, uint32_t timestamp) {
+    mailbox_frame_t& slot = slots[back];
+    slot.image = image;
+    slot.sequence = published.load(std::memory_order_relaxed) + 1;
+    slot.frame_num = frame_num;
+    slot.timestamp = timestamp;
+    // publishes the slot to the consumer. Sequentially consistent, so it is ordered against the waiters check below (see waitTake)
+    uint8_t previous = middle.exchange(back | FRESH);
+    back = previous & INDEX_MASK;
+    if (previous & FRESH) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    published.fetch_add(1, std::memory_order_relaxed);
+
+    if (waiters.load() > 0) {
+        // the consumer is between its last check and the wait, or already waiting. Taking the lock makes sure it is waiting.
+        { std::lock_guard<std::mutex> lk(wait_m); }
+        wait_cv.notify_one();
+    }
+}
+
+bool FrameMailbox::tryTake(mailbox_frame_t& out) {
+    if (!(middle.load() & FRESH)) {
+        return false;
+    }
+    uint8_t previous = middle.exchange(front);
+    front = previous & INDEX_MASK;
+    // moved out, so the image is not referenced by the mailbox once the consumer is done with it
+    out = std::move(slots[front]);
+    slots[front].image = cv::Mat();
+    return true;
+}
+
+bool FrameMailbox::waitTake(mailbox_frame_t& out, std::chrono::milliseconds timeout) {
+    if (tryTake(out)) {
+        return true;
+    }
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::unique_lock<std::mutex> lk(wait_m);
+    // registered before checking again, so a frame published after the check sees the waiter
+    waiters.fetch_add(1);
+    bool taken = tryTake(out);
+    while (!taken) {
+        if (wait_cv.wait_until(lk, deadline) == std::cv_status::timeout) {
+            taken = tryTake(out);
+            break;
+        }
+        taken = tryTake(out);
+    }
+    waiters.fetch_sub(1);
+    return taken;
+}
+
+uint64_t FrameMailbox::getPublishedCount() {
+    return published.load(std::memory_order_relaxed);
+}
+
+uint64_t FrameMailbox::getDroppedCount() {
+    return dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <opencv2/core.hpp>
+
+typedef struct {
+    cv::Mat image;
+    uint64_t sequence; // counts published frames from 1, a gap means the consumer missed frames
+    uint16_t frame_num; // TCFP frame number
+    uint32_t timestamp; // sender timestamp in ms
+} mailbox_frame_t;
+
+/// @brief Hands the latest decoded frame from one producer thread to one consumer thread.
+///
+/// Triple buffer: the producer fills its own slot and swaps it with the shared middle slot in a single atomic exchange,
+/// the consumer swaps its slot with the middle one if it holds a new frame. Neither side ever blocks the other, a frame the
+/// consumer did not take in time is replaced by the next one and counted as dropped. A consumer can also sleep until the next
+/// frame arrives; only then the producer touches a mutex to wake it up.
+class FrameMailbox {
+public:
+    FrameMailbox();
+
+    /// @brief Publishes a frame, replacing a frame that was not taken yet. Producer thread only.
+    void publish(const cv::Mat& image, uint16_t frame_num, uint32_t timestamp);
+
+    /// @brief Takes the latest frame if there is a new one. Consumer thread only.
+    /// @return false if no frame was published since the last take
+    bool tryTake(mailbox_frame_t& out);
+    /// @brief Like tryTake, but sleeps until a frame is published or the timeout passed. Consumer thread only.
+    bool waitTake(mailbox_frame_t& out, std::chrono::milliseconds timeout);
+
+    uint64_t getPublishedCount();
+    /// @brief Frames that were replaced before the consumer took them
+    uint64_t getDroppedCount();
+private:
+    static const uint8_t FRESH = 0x04; // set in middle if it holds a frame the consumer has not seen
+    static const uint8_t INDEX_MASK = 0x03;
+
+    mailbox_frame_t slots[3];
+    std::atomic<uint8_t> middle; // index of the shared slot | FRESH
+    uint8_t back; // slot the producer writes, producer only
+    uint8_t front; // slot the consumer read last, consumer only
+
+    std::atomic<uint64_t> published{0};
+    std::atomic<uint64_t> dropped{0};
+
+    // only used while the consumer is waiting
+    std::atomic<int> waiters{0};
+    std::mutex wait_m;
+    std::condition_variable wait_cv;
+};
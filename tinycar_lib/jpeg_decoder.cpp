@@ -0,0 +1,575 @@
+#include "jpeg_decoder.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <opencv2/imgproc.hpp>
+
+#define MAX_RESTART_INTERVALS 4096
+#define ARENA_ALIGNMENT 64 // libjpeg-turbo needs 32 byte aligned rows for its SIMD code
+
+static const JOCTET FAKE_EOI[2] = {0xFF, JPEG_EOI};
+
+JpegDecoder::JpegDecoder() {
+    cinfo.err = jpeg_std_error(&error.pub);
+    error.pub.error_exit = &JpegDecoder::errorExit;
+    error.pub.emit_message = &JpegDecoder::emitMessage;
+    jpeg_create_decompress(&cinfo);
+    cinfo.client_data = this;
+    libjpegMemory = *cinfo.mem;
+    cinfo.mem->alloc_small = &JpegDecoder::allocSmall;
+    cinfo.mem->alloc_large = &JpegDecoder::allocLarge;
+    cinfo.mem->alloc_sarray = &JpegDecoder::allocSampleArray;
+    cinfo.mem->alloc_barray = &JpegDecoder::allocBlockArray;
+    cinfo.mem->free_pool = &JpegDecoder::freePool;
+
+    source = {};
+    source.pub.init_source = &JpegDecoder::initSource;
+    source.pub.fill_input_buffer = &JpegDecoder::fillInputBuffer;
+    source.pub.skip_input_data = &JpegDecoder::skipInputData;
+    source.pub.resync_to_restart = jpeg_resync_to_restart;
+    source.pub.term_source = &JpegDecoder::termSource;
+    cinfo.src = &source.pub;
+
+    // header + all fragments + a marker for each restart interval
+    scratch.resize(FRAME_SLOT_SIZE + 2 * MAX_RESTART_INTERVALS + 2);
+    missingIntervals.reserve(MAX_RESTART_INTERVALS);
+}
+
+JpegDecoder::~JpegDecoder() {
+    jpeg_destroy_decompress(&cinfo);
+}
+
+void JpegDecoder::initSource(j_decompress_ptr cinfo) {
+}
+
+boolean JpegDecoder::fillInputBuffer(j_decompress_ptr cinfo) {
+    source_mgr_t* src = reinterpret_cast<source_mgr_t*>(cinfo->src);
+    if (src->suspend) {
+        // more data is on the way, libjpeg backs up and returns to the caller
+        return FALSE;
+    }
+    // Out of data. Everything output so far was decoded from real data, the rest will be garbage.
+    if (!src->eof) {
+        src->eof = true;
+        src->rows_at_eof = cinfo->output_scanline;
+    }
+    src->pub.next_input_byte = FAKE_EOI;
+    src->pub.bytes_in_buffer = 2;
+    return TRUE;
+}
+
+void JpegDecoder::skipInputData(j_decompress_ptr cinfo, long num_bytes) {
+    source_mgr_t* src = reinterpret_cast<source_mgr_t*>(cinfo->src);
+    if (src->suspend && num_bytes > (long)src->pub.bytes_in_buffer) {
+        // the stream is contiguous, the position is valid before the data arrived (see continueStream)
+        src->pub.next_input_byte += num_bytes;
+        src->pub.bytes_in_buffer = 0;
+        return;
+    }
+    while (num_bytes > (long)src->pub.bytes_in_buffer) {
+        num_bytes -= src->pub.bytes_in_buffer;
+        fillInputBuffer(cinfo);
+    }
+    src->pub.next_input_byte += num_bytes;
+    src->pub.bytes_in_buffer -= num_bytes;
+}
+
+void JpegDecoder::termSource(j_decompress_ptr cinfo) {
+}
+
+void JpegDecoder::errorExit(j_common_ptr cinfo) {
+    error_mgr_t* err = reinterpret_cast<error_mgr_t*>(cinfo->err);
+    longjmp(err->setjmp_buffer, 1);
+}
+
+void JpegDecoder::emitMessage(j_common_ptr cinfo, int msg_level) {
+    // corrupt data warnings are expected for incomplete frames
+}
+
+void* JpegDecoder::arenaAlloc(size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    arenaNeeded += size;
+    // the arena itself is only aligned like any heap block
+    uintptr_t base = (uintptr_t)arena.data();
+    size_t offset = ((base + arenaUsed + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1)) - base;
+    if (arena.empty() || offset + size > arena.size()) {
+        return nullptr;
+    }
+    arenaUsed = offset + size;
+    return arena.data() + offset;
+}
+
+void* JpegDecoder::allocSmall(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
+    JpegDecoder* decoder = reinterpret_cast<JpegDecoder*>(cinfo->client_data);
+    void* object = pool_id == JPOOL_IMAGE ? decoder->arenaAlloc(sizeofobject) : nullptr;
+    return object ? object : decoder->libjpegMemory.alloc_small(cinfo, pool_id, sizeofobject);
+}
+
+void* JpegDecoder::allocLarge(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
+    JpegDecoder* decoder = reinterpret_cast<JpegDecoder*>(cinfo->client_data);
+    void* object = pool_id == JPOOL_IMAGE ? decoder->arenaAlloc(sizeofobject) : nullptr;
+    return object ? object : decoder->libjpegMemory.alloc_large(cinfo, pool_id, sizeofobject);
+}
+
+JSAMPARRAY JpegDecoder::allocSampleArray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow, JDIMENSION numrows) {
+    JpegDecoder* decoder = reinterpret_cast<JpegDecoder*>(cinfo->client_data);
+    if (pool_id == JPOOL_IMAGE) {
+        size_t rowSize = (samplesperrow * sizeof(JSAMPLE) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+        JSAMPARRAY rows = (JSAMPARRAY)decoder->arenaAlloc(numrows * sizeof(JSAMPROW));
+        uint8_t* samples = (uint8_t*)decoder->arenaAlloc(numrows * rowSize);
+        if (rows && samples) {
+            for (JDIMENSION i = 0; i < numrows; i++) {
+                rows[i] = (JSAMPROW)(samples + i * rowSize);
+            }
+            return rows;
+        }
+    }
+    return decoder->libjpegMemory.alloc_sarray(cinfo, pool_id, samplesperrow, numrows);
+}
+
+JBLOCKARRAY JpegDecoder::allocBlockArray(j_common_ptr cinfo, int pool_id, JDIMENSION blocksperrow, JDIMENSION numrows) {
+    JpegDecoder* decoder = reinterpret_cast<JpegDecoder*>(cinfo->client_data);
+    if (pool_id == JPOOL_IMAGE) {
+        size_t rowSize = (blocksperrow * sizeof(JBLOCK) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+        JBLOCKARRAY rows = (JBLOCKARRAY)decoder->arenaAlloc(numrows * sizeof(JBLOCKROW));
+        uint8_t* blocks = (uint8_t*)decoder->arenaAlloc(numrows * rowSize);
+        if (rows && blocks) {
+            for (JDIMENSION i = 0; i < numrows; i++) {
+                rows[i] = (JBLOCKROW)(blocks + i * rowSize);
+            }
+            return rows;
+        }
+    }
+    return decoder->libjpegMemory.alloc_barray(cinfo, pool_id, blocksperrow, numrows);
+}
+
+void JpegDecoder::freePool(j_common_ptr cinfo, int pool_id) {
+    JpegDecoder* decoder = reinterpret_cast<JpegDecoder*>(cinfo->client_data);
+    decoder->libjpegMemory.free_pool(cinfo, pool_id);
+    if (pool_id == JPOOL_IMAGE) {
+        // nothing of the image is in use anymore, grow the arena so the next image of this size fits (plus alignment slack)
+        size_t needed = decoder->arenaNeeded + ARENA_ALIGNMENT;
+        if (needed > decoder->arena.size()) {
+            decoder->arena.resize(needed);
+        }
+        decoder->arenaUsed = 0;
+        decoder->arenaNeeded = 0;
+    }
+}
+
+void JpegDecoder::setRegion(const jpeg_decode_region_t& region) {
+    this->region = region;
+}
+
+jpeg_decode_region_t JpegDecoder::getRegion() {
+    return region;
+}
+
+void JpegDecoder::setAllocator(cv::MatAllocator* allocator) {
+    this->allocator = allocator;
+}
+
+const std::vector<uint8_t>& JpegDecoder::getValidRows() {
+    return validRows;
+}
+
+int JpegDecoder::getValidRowCount() {
+    return validRowCount;
+}
+
+int JpegDecoder::readHeader(const uint8_t* data, size_t len, size_t& headerLen) {
+    source.pub.next_input_byte = data;
+    source.pub.bytes_in_buffer = len;
+    source.eof = false;
+    source.suspend = false;
+    if (setjmp(error.setjmp_buffer)) {
+        jpeg_abort_decompress(&cinfo);
+        return -1;
+    }
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK || source.eof) {
+        jpeg_abort_decompress(&cinfo);
+        return -1;
+    }
+    // the header reader stops right after the SOS marker segment
+    headerLen = source.pub.next_input_byte - data;
+    int restartInterval = cinfo.restart_interval;
+    jpeg_abort_decompress(&cinfo);
+    return restartInterval;
+}
+
+int JpegDecoder::scaleDenominator(JDIMENSION width, JDIMENSION height) {
+    if (region.minSize.width <= 0 && region.minSize.height <= 0) {
+        return 1;
+    }
+    double regionWidth = width * region.width;
+    double regionHeight = height * region.height;
+    for (int denominator = 8; denominator > 1; denominator /= 2) {
+        if (regionWidth / denominator >= region.minSize.width && regionHeight / denominator >= region.minSize.height) {
+            return denominator;
+        }
+    }
+    return 1;
+}
+
+void JpegDecoder::invalidateRows(int first, int last) {
+    first = std::max(first, regionTop);
+    last = std::min(last, regionTop + (int)validRows.size());
+    for (int r = first; r < last; r++) {
+        int row = r - regionTop;
+        validRows[region.rotate ? validRows.size() - 1 - row : row] = 0;
+    }
+}
+
+int JpegDecoder::decodeStream(const uint8_t* data, size_t len, cv::Mat& out) {
+    source.pub.next_input_byte = data;
+    source.pub.bytes_in_buffer = len;
+    source.eof = false;
+    source.suspend = false;
+    source.rows_at_eof = 0;
+    if (setjmp(error.setjmp_buffer)) {
+        jpeg_abort_decompress(&cinfo);
+        return -1;
+    }
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK || source.eof) {
+        jpeg_abort_decompress(&cinfo);
+        return -1;
+    }
+    setOutputFormat();
+    jpeg_start_decompress(&cinfo);
+    if (cinfo.output_components != 3) {
+        jpeg_abort_decompress(&cinfo);
+        return -1;
+    }
+    startRegion(out, true);
+    readRegion(out);
+    finishRegion(out);
+    return 0;
+}
+
+void JpegDecoder::setOutputFormat() {
+#ifdef JCS_EXTENSIONS
+    cinfo.out_color_space = JCS_EXT_BGR;
+#else
+    cinfo.out_color_space = JCS_RGB;
+#endif
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scaleDenominator(cinfo.image_width, cinfo.image_height);
+}
+
+void JpegDecoder::startRegion(cv::Mat& out, bool skip) {
+#if JPEG_LIB_VERSION >= 70
+    mcuRowHeight = cinfo.max_v_samp_factor * cinfo.min_DCT_v_scaled_size;
+#else
+    mcuRowHeight = cinfo.max_v_samp_factor * cinfo.min_DCT_scaled_size;
+#endif
+    mcusPerRow = cinfo.MCUs_per_row;
+    mcuRows = cinfo.MCU_rows_in_scan;
+
+    // region in the scaled frame as it is shown, then where it lies in the decoded frame
+    int frameWidth = cinfo.output_width;
+    int frameHeight = cinfo.output_height;
+    int x = std::clamp((int)std::lround(region.x * frameWidth), 0, frameWidth - 1);
+    int y = std::clamp((int)std::lround(region.y * frameHeight), 0, frameHeight - 1);
+    int width = std::clamp((int)std::lround(region.width * frameWidth), 1, frameWidth - x);
+    int height = std::clamp((int)std::lround(region.height * frameHeight), 1, frameHeight - y);
+    int left = region.rotate ? frameWidth - x - width : x;
+    regionTop = region.rotate ? frameHeight - y - height : y;
+
+    JDIMENSION cropX = 0;
+    JDIMENSION cropWidth = frameWidth;
+#ifdef JPEG_HAVE_CROP
+    if (width < frameWidth) {
+        // One more column on each side, the chroma upsampling treats the border of the crop like the border of the image.
+        // libjpeg moves the left border further to an iMCU boundary.
+        cropX = std::max(0, left - 1);
+        cropWidth = std::min(frameWidth, left + width + 1) - cropX;
+        jpeg_crop_scanline(&cinfo, &cropX, &cropWidth);
+    }
+    // jpeg_skip_scanlines cannot suspend, the rows are read and dropped instead
+    if (skip && regionTop > 0) {
+        jpeg_skip_scanlines(&cinfo, regionTop);
+    }
+#endif
+    regionOffset = left - cropX;
+    regionDirect = !region.rotate && regionOffset == 0 && (int)cropWidth == width;
+    rowBuffer.resize(cropWidth * 3);
+
+    out.allocator = allocator;
+    out.create(height, width, CV_8UC3);
+}
+
+bool JpegDecoder::readRegion(cv::Mat& out) {
+    int width = out.cols;
+    int height = out.rows;
+    // rows below the region are never decoded
+    while ((int)cinfo.output_scanline < regionTop + height) {
+        int row = (int)cinfo.output_scanline - regionTop; // negative for rows that were not skipped
+        JSAMPROW dst = row >= 0 && regionDirect ? out.ptr(row) : rowBuffer.data();
+        if (jpeg_read_scanlines(&cinfo, &dst, 1) == 0) {
+            // the source suspended, the row is read again once there is more data
+            return false;
+        }
+        if (row < 0 || regionDirect) {
+            continue;
+        }
+        const uint8_t* in = rowBuffer.data() + regionOffset * 3;
+        if (region.rotate) {
+            uint8_t* o = out.ptr(height - 1 - row);
+            in += (width - 1) * 3;
+            for (int i = 0; i < width; i++, o += 3, in -= 3) {
+                o[0] = in[0];
+                o[1] = in[1];
+                o[2] = in[2];
+            }
+        } else {
+            memcpy(out.ptr(row), in, width * 3);
+        }
+    }
+    return true;
+}
+
+void JpegDecoder::finishRegion(cv::Mat& out) {
+#ifndef JCS_EXTENSIONS
+    cv::cvtColor(out, out, cv::COLOR_RGB2BGR);
+#endif
+    validRows.assign(out.rows, 1);
+    if (source.eof) {
+        // the row group that was decoded when the data ran out is partly garbage
+        invalidateRows(std::max(0, (int)source.rows_at_eof - mcuRowHeight), cinfo.output_height);
+    }
+    jpeg_abort_decompress(&cinfo);
+}
+
+void JpegDecoder::beginStream(const uint8_t* data) {
+    abortStream();
+    streamData = data;
+    source.pub.next_input_byte = data;
+    source.pub.bytes_in_buffer = 0;
+    source.eof = false;
+    source.suspend = true;
+    source.rows_at_eof = 0;
+    streamState = StreamState::HEADER;
+}
+
+int JpegDecoder::continueStream(size_t available, bool complete, cv::Mat& out) {
+    if (streamState == StreamState::IDLE) {
+        return -1;
+    }
+    // the data stays where it is, so libjpeg simply continues where it suspended
+    const uint8_t* end = streamData + available;
+    source.pub.bytes_in_buffer = source.pub.next_input_byte < end ? end - source.pub.next_input_byte : 0;
+    source.suspend = !complete;
+    if (setjmp(error.setjmp_buffer)) {
+        abortStream();
+        return -1;
+    }
+    if (streamState == StreamState::HEADER) {
+        int result = jpeg_read_header(&cinfo, TRUE);
+        if (result == JPEG_SUSPENDED) {
+            return 0;
+        }
+        if (result != JPEG_HEADER_OK || source.eof) {
+            abortStream();
+            return -1;
+        }
+        setOutputFormat();
+        streamState = StreamState::START;
+    }
+    if (streamState == StreamState::START) {
+        // progressive frames are buffered completely in here, only baseline frames output rows early
+        if (!jpeg_start_decompress(&cinfo)) {
+            return 0;
+        }
+        if (cinfo.output_components != 3) {
+            abortStream();
+            return -1;
+        }
+        startRegion(streamImage, false);
+        streamState = StreamState::ROWS;
+    }
+    if (!readRegion(streamImage)) {
+        return 0;
+    }
+    finishRegion(streamImage);
+    out = streamImage;
+    streamImage.release();
+    streamState = StreamState::IDLE;
+    return 1;
+}
+
+void JpegDecoder::abortStream() {
+    if (streamState != StreamState::IDLE) {
+        jpeg_abort_decompress(&cinfo);
+        streamState = StreamState::IDLE;
+    }
+    streamImage.release();
+}
+
+bool JpegDecoder::isStreaming() {
+    return streamState != StreamState::IDLE;
+}
+
+bool JpegDecoder::rangeReceived(const tcfp_frame_slot_t* frame, size_t begin, size_t end) {
+    if (end <= begin) {
+        return true;
+    }
+    if (end > frame->len || frame->fragment_stride == 0) {
+        return false;
+    }
+    for (size_t i = begin / frame->fragment_stride; i <= (end - 1) / frame->fragment_stride; i++) {
+        if (!tcfpFragmentReceived(frame, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t JpegDecoder::rebuildRestartStream(const tcfp_frame_slot_t* frame, size_t headerLen) {
+    const uint8_t* data = frame->data;
+    uint8_t* dst = scratch.data();
+    memcpy(dst, data, headerLen);
+    size_t dstLen = headerLen;
+    missingIntervals.clear();
+
+    size_t segmentStart = headerLen; // start of the entropy coded data of the current interval
+    size_t lastSegmentLen = 0; // for estimating how many intervals got lost in a gap
+    size_t pos = headerLen;
+    bool eoi = false;
+    while (pos + 1 < frame->len && !eoi) {
+        // skip fragments that were lost
+        if (!rangeReceived(frame, pos, pos + 2)) {
+            pos++;
+            continue;
+        }
+        if (data[pos] != 0xFF || data[pos + 1] < JPEG_RST0 || (data[pos + 1] > JPEG_RST0 + 7 && data[pos + 1] != JPEG_EOI)) {
+            pos++;
+            continue;
+        }
+
+        // found the marker at the end of an interval
+        eoi = data[pos + 1] == JPEG_EOI;
+        size_t index = missingIntervals.size(); // interval this marker should end
+        bool intact = rangeReceived(frame, segmentStart, pos);
+        if (!intact && !eoi) {
+            // Restart markers only count modulo 8, so guess the number of lost intervals from the gap size
+            size_t number = data[pos + 1] - JPEG_RST0;
+            size_t estimate = lastSegmentLen > 0 ? (pos - segmentStart) / lastSegmentLen : 0;
+            size_t guess = index + ((number - index) & 7);
+            while (guess + 8 <= index + estimate) {
+                guess += 8;
+            }
+            index = guess;
+        } else if (intact && !eoi && (index & 7) != (size_t)(data[pos + 1] - JPEG_RST0)) {
+            // marker does not match, data is corrupt
+            intact = false;
+        }
+        if (index >= MAX_RESTART_INTERVALS) {
+            return 0;
+        }
+        while (missingIntervals.size() < index) {
+            // lost completely, an empty interval is decoded as flat gray
+            dst[dstLen++] = 0xFF;
+            dst[dstLen++] = JPEG_RST0 + (missingIntervals.size() & 7);
+            missingIntervals.push_back(1);
+        }
+        if (intact) {
+            memcpy(dst + dstLen, data + segmentStart, pos - segmentStart);
+            dstLen += pos - segmentStart;
+            lastSegmentLen = pos - segmentStart;
+        }
+        missingIntervals.push_back(intact ? 0 : 1);
+        if (!eoi) {
+            dst[dstLen++] = 0xFF;
+            dst[dstLen++] = JPEG_RST0 + (index & 7);
+        }
+        pos += 2;
+        segmentStart = pos;
+    }
+    if (eoi) {
+        dst[dstLen++] = 0xFF;
+        dst[dstLen++] = JPEG_EOI;
+    } else {
+        // Keep the data after the last marker up to the first gap. The stream ends without EOI,
+        // so the decoder runs out of data and the rows after it are marked invalid.
+        size_t end = segmentStart;
+        while (end < frame->len && rangeReceived(frame, end, end + 1)) {
+            end++;
+        }
+        memcpy(dst + dstLen, data + segmentStart, end - segmentStart);
+        dstLen += end - segmentStart;
+    }
+    return dstLen;
+}
+
+int JpegDecoder::decode(const uint8_t* data, size_t len, cv::Mat& out) {
+    validRowCount = 0;
+    if (decodeStream(data, len, out) < 0) {
+        return -1;
+    }
+    validRowCount = std::count(validRows.begin(), validRows.end(), 1);
+    return 0;
+}
+
+int JpegDecoder::decodePartial(const tcfp_frame_slot_t* frame, cv::Mat& out) {
+    validRowCount = 0;
+    if (frame->fragment_stride == 0 && frame->fragment_count > 1) {
+        return -1;
+    }
+    // everything before the first missing fragment
+    size_t prefixLen = frame->len;
+    for (uint32_t i = 0; i < frame->fragment_count; i++) {
+        if (!tcfpFragmentReceived(frame, i)) {
+            prefixLen = std::min((size_t)frame->len, (size_t)i * frame->fragment_stride);
+            break;
+        }
+    }
+
+    size_t headerLen;
+    int restartInterval = readHeader(frame->data, prefixLen, headerLen);
+    if (restartInterval < 0) {
+        return -1;
+    }
+
+    if (restartInterval == 0) {
+        if (decodeStream(frame->data, prefixLen, out) < 0) {
+            return -1;
+        }
+    } else {
+        size_t len = rebuildRestartStream(frame, headerLen);
+        if (len == 0 || decodeStream(scratch.data(), len, out) < 0) {
+            // fall back to the prefix
+            if (decodeStream(frame->data, prefixLen, out) < 0) {
+                return -1;
+            }
+        } else {
+            // if the interval before EOI got lost, any number of intervals could be lost with it
+            size_t intervalCount = ((size_t)mcusPerRow * mcuRows + restartInterval - 1) / restartInterval;
+            if (!missingIntervals.empty() && missingIntervals.back()) {
+                missingIntervals.resize(std::max(intervalCount, missingIntervals.size()), 1);
+            }
+            // invalidate all rows touched by a lost interval
+            for (size_t i = 0; i < missingIntervals.size() && mcusPerRow > 0; i++) {
+                if (!missingIntervals[i]) {
+                    continue;
+                }
+                // chroma upsampling blends one row across the border of an MCU row
+                int firstRow = std::max(0, (int)((i * restartInterval) / mcusPerRow * mcuRowHeight) - 1);
+                int lastRow = ((i + 1) * restartInterval - 1) / mcusPerRow * mcuRowHeight + mcuRowHeight + 1;
+                invalidateRows(firstRow, lastRow);
+            }
+        }
+    }
+    validRowCount = std::count(validRows.begin(), validRows.end(), 1);
+    return 0;
+}
+
+void JpegDecoder::conceal(cv::Mat& image, const cv::Mat& reference, const std::vector<uint8_t>& validRows) {
+    if (reference.empty() || reference.size() != image.size() || reference.type() != image.type()) {
+        return;
+    }
+    for (int r = 0; r < image.rows && r < (int)validRows.size(); r++) {
+        if (!validRows[r]) {
+            memcpy(image.ptr(r), reference.ptr(r), image.cols * image.elemSize());
+        }
+    }
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstdio>
+#include <csetjmp>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <jpeglib.h>
+
+#include "tcfp.hpp"
+
+// libjpeg-turbo can skip rows and decode a range of columns only since 1.5, but only announces
+// its version from 2.0 on, older releases decode every row in full and crop afterwards
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER >= 2000000
+#define JPEG_HAVE_CROP
+#endif
+
+/// @brief Part of the frame that is decoded. Coordinates are fractions of the frame as it is shown, i.e. after the rotation.
+typedef struct {
+    float x = 0.0f;
+    float y = 0.0f;
+    float width = 1.0f;
+    float height = 1.0f;
+    cv::Size minSize = cv::Size(0, 0); // the IDCT scales down by 1/2, 1/4 or 1/8 as long as the region stays at least this large, 0x0 = full resolution
+    bool rotate = true; // rotate by 180°, the camera of the tinycar is mounted upside down
+} jpeg_decode_region_t;
+
+/// @brief JPEG decoder on top of libjpeg for the frames of the tinycar.
+///
+/// Only the region of the frame that is needed is decoded (see jpeg_decode_region_t): rows above it are skipped, rows below it
+/// are never touched, columns outside of it are cut off before the IDCT and the IDCT itself outputs the region at reduced
+/// resolution. Rotation happens while the rows are written, so there is no extra pass over the image.
+///
+/// Frames that are missing fragments can be decoded as well. Without restart markers everything up to the first missing fragment
+/// is decoded. If the car emits restart markers, the intervals that were received completely are decoded as well and lost
+/// intervals are replaced by empty ones. Rows that could not be decoded are reported, so they can be concealed with the previous frame.
+///
+/// A frame can also be decoded while it is received (beginStream, continueStream). libjpeg suspends where the received data ends
+/// and picks up there once more has arrived.
+class JpegDecoder {
+public:
+    JpegDecoder();
+    ~JpegDecoder();
+
+    /// @brief Region of the following frames, the default is the full frame rotated by 180°
+    void setRegion(const jpeg_decode_region_t& region);
+    jpeg_decode_region_t getRegion();
+    /// @brief Allocator of the decoded images (see FrameBufferPool), nullptr for the default allocator of OpenCV
+    void setAllocator(cv::MatAllocator* allocator);
+
+    /// @brief Decodes a complete frame into a BGR image
+    /// @param out decoded region, always newly allocated
+    /// @return 0 on success, -1 if the data is no JPEG
+    int decode(const uint8_t* data, size_t len, cv::Mat& out);
+
+    /// @brief Decodes an incomplete frame into a BGR image
+    /// @param frame reassembled frame with its fragment bitmap
+    /// @param out decoded region, always newly allocated
+    /// @return 0 on success, -1 if not even the JPEG header was received
+    int decodePartial(const tcfp_frame_slot_t* frame, cv::Mat& out);
+
+    /// @brief Starts decoding a frame while it is still being received. Aborts a stream that was not finished.
+    /// @param data start of the frame, must stay valid and in place until the stream is finished or aborted
+    void beginStream(const uint8_t* data);
+    /// @brief Decodes as far as the data received so far goes. libjpeg suspends where the data ends and resumes there with the next call.
+    /// @param available bytes at the start of the frame that were received, never less than in the call before
+    /// @param complete the frame is complete, available is its length
+    /// @param out decoded region once the frame is done, always newly allocated
+    /// @return 1 if the frame is done, 0 if it waits for more data, -1 on error (the stream is aborted)
+    int continueStream(size_t available, bool complete, cv::Mat& out);
+    void abortStream();
+    bool isStreaming();
+
+    /// @brief Validity of each image row of the last decoded frame. 0 if the row could not be decoded.
+    const std::vector<uint8_t>& getValidRows();
+
+    /// @brief Number of rows that could be decoded in the last frame
+    int getValidRowCount();
+
+    /// @brief Replaces rows that could not be decoded with the rows of the reference image, a previous frame of the same region
+    /// @param validRows of the decode that produced image (see getValidRows)
+    static void conceal(cv::Mat& image, const cv::Mat& reference, const std::vector<uint8_t>& validRows);
+private:
+    typedef struct {
+        struct jpeg_source_mgr pub;
+        bool eof; // source ran out of data, a fake EOI was inserted
+        bool suspend; // streaming, libjpeg suspends instead of running out of data
+        JDIMENSION rows_at_eof; // rows already output when the source ran out of data
+    } source_mgr_t;
+
+    typedef struct {
+        struct jpeg_error_mgr pub;
+        jmp_buf setjmp_buffer;
+    } error_mgr_t;
+
+    static void initSource(j_decompress_ptr cinfo);
+    static boolean fillInputBuffer(j_decompress_ptr cinfo);
+    static void skipInputData(j_decompress_ptr cinfo, long num_bytes);
+    static void termSource(j_decompress_ptr cinfo);
+    static void errorExit(j_common_ptr cinfo);
+    static void emitMessage(j_common_ptr cinfo, int msg_level);
+
+    // libjpeg allocates the working memory of every image anew and frees it afterwards. Memory of the image pool is taken from
+    // the arena instead, everything else is handed to the original methods of libjpeg.
+    static void* allocSmall(j_common_ptr cinfo, int pool_id, size_t sizeofobject);
+    static void* allocLarge(j_common_ptr cinfo, int pool_id, size_t sizeofobject);
+    static JSAMPARRAY allocSampleArray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow, JDIMENSION numrows);
+    static JBLOCKARRAY allocBlockArray(j_common_ptr cinfo, int pool_id, JDIMENSION blocksperrow, JDIMENSION numrows);
+    static void freePool(j_common_ptr cinfo, int pool_id);
+    /// @return nullptr if the arena is exhausted, it grows to the size needed when the image is done
+    void* arenaAlloc(size_t size);
+
+    /// @brief Reads only the header
+    /// @param headerLen set to the offset of the entropy coded data
+    /// @return restart interval in MCUs, -1 on error
+    int readHeader(const uint8_t* data, size_t len, size_t& headerLen);
+    /// @brief Decodes the region of the stream. All rows are marked valid up to the point the data ran out.
+    int decodeStream(const uint8_t* data, size_t len, cv::Mat& out);
+    /// @brief Color space and IDCT scaling, after the header was read
+    void setOutputFormat();
+    /// @brief Finds the region in the decoded frame, crops the rows to it and allocates out. After jpeg_start_decompress.
+    /// @param skip skip the rows above the region, they are read and dropped otherwise (suspending source)
+    void startRegion(cv::Mat& out, bool skip);
+    /// @brief Reads the rows of the region into out
+    /// @return false if the source suspended
+    bool readRegion(cv::Mat& out);
+    /// @brief Marks the rows that were decoded from real data and ends the frame
+    void finishRegion(cv::Mat& out);
+    /// @brief Largest IDCT scale denominator that keeps the region at least minSize
+    int scaleDenominator(JDIMENSION width, JDIMENSION height);
+    /// @brief Marks rows [first, last) of the scaled frame invalid, as far as they are part of the region
+    void invalidateRows(int first, int last);
+    /// @brief Rebuilds the stream with only complete restart intervals. Missing intervals are left empty and marked in missingIntervals.
+    /// @return length of the rebuilt stream in scratch, 0 on error
+    size_t rebuildRestartStream(const tcfp_frame_slot_t* frame, size_t headerLen);
+    bool rangeReceived(const tcfp_frame_slot_t* frame, size_t begin, size_t end);
+
+    struct jpeg_decompress_struct cinfo;
+    source_mgr_t source;
+    error_mgr_t error;
+    struct jpeg_memory_mgr libjpegMemory; // original methods of the memory manager
+    std::vector<uint8_t> arena;
+    size_t arenaUsed = 0;
+    size_t arenaNeeded = 0; // by the current image, including what did not fit
+
+    jpeg_decode_region_t region;
+    cv::MatAllocator* allocator = nullptr;
+
+    // geometry of last decoded frame
+    int mcuRowHeight = 0;
+    int mcusPerRow = 0;
+    int mcuRows = 0;
+    int regionTop = 0; // first row of the region in the scaled, not yet rotated frame
+    int regionOffset = 0; // first pixel of the region in a decoded row
+    bool regionDirect = false; // rows are decoded right into the image
+
+    // frame that is decoded while it is received
+    enum class StreamState {
+        IDLE,
+        HEADER,
+        START,
+        ROWS
+    };
+    StreamState streamState = StreamState::IDLE;
+    const uint8_t* streamData = nullptr;
+    cv::Mat streamImage;
+
+    std::vector<uint8_t> validRows;
+    int validRowCount = 0;
+    std::vector<uint8_t> scratch; // rebuilt stream, allocated once
+    std::vector<uint8_t> rowBuffer; // decoded row, if it cannot be written to the image directly
+    std::vector<uint8_t> missingIntervals; // 1 for each restart interval that was lost
+};
@@ -0,0 +1,186 @@
+#include "net_reactor.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+NetReactor::NetReactor() {
+#ifdef __linux__
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeupReadFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    wakeupWriteFd = wakeupReadFd;
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u32 = UINT32_MAX; // wakeup
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeupReadFd, &ev);
+#else
+    epollFd = -1;
+    int pipefds[2];
+    if (pipe(pipefds) < 0) {
+        std::cerr << "\033[1;31m[Tinycar] Reactor Error: pipe error " << errno << "\033[0m" << std::endl;
+        pipefds[0] = pipefds[1] = -1;
+    }
+    wakeupReadFd = pipefds[0];
+    wakeupWriteFd = pipefds[1];
+    fcntl(wakeupReadFd, F_SETFL, fcntl(wakeupReadFd, F_GETFL) | O_NONBLOCK);
+    fcntl(wakeupWriteFd, F_SETFL, fcntl(wakeupWriteFd, F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+NetReactor::~NetReactor() {
+    stop();
+    if (epollFd >= 0) {
+        close(epollFd);
+    }
+    close(wakeupReadFd);
+    if (wakeupWriteFd != wakeupReadFd) {
+        close(wakeupWriteFd);
+    }
+}
+
+int NetReactor::addSocket(int fd, std::function<void()> onReadable) {
+#ifdef __linux__
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u32 = fds.size();
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        std::cerr << "\033[1;31m[Tinycar] Reactor Error: epoll_ctl error " << errno << "\033[0m" << std::endl;
+        return -1;
+    }
+#endif
+    fds.push_back(fd);
+    handlers.push_back(onReadable);
+    return 0;
+}
+
+void NetReactor::addTimer(uint32_t interval, std::function<void()> callback) {
+    reactor_timer_t timer;
+    timer.interval = std::chrono::milliseconds(interval);
+    timer.next = std::chrono::steady_clock::now() + timer.interval;
+    timer.callback = callback;
+    timers.push_back(timer);
+}
+
+void NetReactor::start(int cpu) {
+    if (running.exchange(true)) {
+        return;
+    }
+    thread = std::thread(&NetReactor::run, this);
+    if (cpu >= 0) {
+#ifdef __linux__
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        if (pthread_setaffinity_np(thread.native_handle(), sizeof(cpuset), &cpuset) != 0) {
+            std::cerr << "\033[1;33m[Tinycar] Reactor Warning: could not pin thread to cpu " << cpu << "\033[0m" << std::endl;
+        }
+#else
+        std::cerr << "\033[1;33m[Tinycar] Reactor Warning: thread pinning is not supported on this platform" << "\033[0m" << std::endl;
+#endif
+    }
+}
+
+void NetReactor::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    wakeup();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void NetReactor::wakeup() {
+    uint64_t one = 1;
+    // a full pipe / counter means a wakeup is already pending
+    ssize_t written = write(wakeupWriteFd, &one, wakeupWriteFd == wakeupReadFd ? sizeof(one) : 1);
+    (void)written;
+}
+
+int NetReactor::runTimers() {
+    if (timers.empty()) {
+        return -1;
+    }
+    auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+    for (size_t i = 0; i < timers.size(); i++) {
+        if (timers[i].next <= now) {
+            timers[i].next += timers[i].interval;
+            if (timers[i].next <= now) {
+                // we fell behind, do not fire repeatedly to catch up
+                timers[i].next = now + timers[i].interval;
+            }
+            timers[i].callback();
+        }
+        next = std::min(next, timers[i].next);
+    }
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()).count();
+    // round up, waking up early would spin until the timer is due
+    return std::max(0, (int)wait + 1);
+}
+
+void NetReactor::run() {
+#ifdef __linux__
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+#else
+    std::vector<struct pollfd> pollfds;
+#endif
+
+    while (running) {
+        int timeout = runTimers();
+#ifdef __linux__
+        int n = epoll_wait(epollFd, events, REACTOR_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "\033[1;31m[Tinycar] Reactor Error: epoll_wait error " << errno << "\033[0m" << std::endl;
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            uint32_t index = events[i].data.u32;
+            if (index == UINT32_MAX) {
+                uint64_t value;
+                ssize_t r = read(wakeupReadFd, &value, sizeof(value));
+                (void)r;
+            } else {
+                handlers[index]();
+            }
+        }
+#else
+        // fds may have been added by a handler, so the set is rebuilt every round
+        pollfds.resize(fds.size() + 1);
+        for (size_t i = 0; i < fds.size(); i++) {
+            pollfds[i] = {fds[i], POLLIN, 0};
+        }
+        pollfds[fds.size()] = {wakeupReadFd, POLLIN, 0};
+        int n = poll(pollfds.data(), pollfds.size(), timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "\033[1;31m[Tinycar] Reactor Error: poll error " << errno << "\033[0m" << std::endl;
+            return;
+        }
+        for (size_t i = 0; i + 1 < pollfds.size() && n > 0; i++) {
+            if (pollfds[i].revents & (POLLIN | POLLERR)) {
+                handlers[i]();
+                n--;
+            }
+        }
+        if (pollfds.back().revents & POLLIN) {
+            uint8_t drain[64];
+            while (read(wakeupReadFd, drain, sizeof(drain)) > 0) {}
+        }
+#endif
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <deque>
+
+#define REACTOR_MAX_EVENTS 8 // ready sockets handled per wakeup
+
+/// @brief Single threaded event loop for the network sockets of a Tinycar.
+///
+/// Sockets and periodic timers are all handled on one thread, which can be pinned to a core.
+/// Uses epoll on Linux and poll everywhere else. A wakeup fd (eventfd or pipe) interrupts the wait for stop().
+/// Sockets and timers are added before start() or from the reactor thread itself (e.g. inside a socket handler).
+class NetReactor {
+public:
+    NetReactor();
+    ~NetReactor();
+
+    /// @brief Calls onReadable on the reactor thread whenever the socket has data. The socket should be non blocking.
+    /// @return 0 on success, -1 on error
+    int addSocket(int fd, std::function<void()> onReadable);
+    /// @brief Calls callback every interval ms on the reactor thread
+    void addTimer(uint32_t interval, std::function<void()> callback);
+
+    /// @brief Starts the reactor thread
+    /// @param cpu core the thread is pinned to, -1 to not pin it. Pinning is only supported on Linux.
+    void start(int cpu = -1);
+    void stop();
+private:
+    typedef struct {
+        std::chrono::steady_clock::duration interval;
+        std::chrono::steady_clock::time_point next;
+        std::function<void()> callback;
+    } reactor_timer_t;
+
+    void run();
+    void wakeup();
+    /// @brief Runs all timers that are due
+    /// @return ms until the next timer is due, -1 if there are no timers
+    int runTimers();
+
+    int epollFd; // epoll instance, -1 if poll is used
+    int wakeupReadFd;
+    int wakeupWriteFd; // same as wakeupReadFd for eventfd
+    std::vector<int> fds;
+    std::deque<std::function<void()>> handlers; // handlers[i] belongs to fds[i], deque keeps them in place while one is running
+    std::vector<reactor_timer_t> timers;
+
+    std::atomic<bool> running{false};
+    std::thread thread;
+};
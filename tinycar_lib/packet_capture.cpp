@@ -0,0 +1,106 @@
+#include "packet_capture.hpp"
+
+#include <cstdlib>
+#include <iostream>
+
+PacketCapture::PacketCapture() {}
+
+PacketCapture::~PacketCapture() {
+    close();
+}
+
+int PacketCapture::open(const std::string& path) {
+    std::lock_guard<std::mutex> lk(m);
+    if (file != nullptr) {
+        return -1;
+    }
+    file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        std::cerr << "\033[1;31m[Tinycar] Capture Error: could not create " << path << "\033[0m" << std::endl;
+        return -1;
+    }
+    // the receive threads should not wait for the disk on every datagram
+    writeBuffer = (char*)malloc(CAPTURE_WRITE_BUFFER);
+    setvbuf(file, writeBuffer, _IOFBF, CAPTURE_WRITE_BUFFER);
+    capture_file_header_t header = {0};
+    header.magic = CAPTURE_MAGIC;
+    header.version = CAPTURE_VERSION;
+    fwrite(&header, sizeof(header), 1, file);
+    start = std::chrono::steady_clock::now();
+    records = 0;
+    std::cout << "\033[1;32m[Tinycar] Capture Info: capturing to " << path << "\033[0m" << std::endl;
+    return 0;
+}
+
+void PacketCapture::close() {
+    std::lock_guard<std::mutex> lk(m);
+    if (file == nullptr) {
+        return;
+    }
+    fclose(file);
+    file = nullptr;
+    free(writeBuffer);
+    writeBuffer = nullptr;
+}
+
+bool PacketCapture::isOpen() {
+    std::lock_guard<std::mutex> lk(m);
+    return file != nullptr;
+}
+
+void PacketCapture::write(uint8_t stream, const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival) {
+    std::lock_guard<std::mutex> lk(m);
+    if (file == nullptr || n > UINT16_MAX) {
+        return;
+    }
+    capture_record_t record = {0};
+    // a kernel timestamp can predate the capture if the datagram was queued before it was opened
+    record.timestamp = arrival > start ? std::chrono::duration_cast<std::chrono::nanoseconds>(arrival - start).count() : 0;
+    record.length = n;
+    record.stream = stream;
+    fwrite(&record, sizeof(record), 1, file);
+    fwrite(buffer, 1, n, file);
+    records++;
+}
+
+uint64_t PacketCapture::getRecordCount() {
+    std::lock_guard<std::mutex> lk(m);
+    return records;
+}
+
+PacketCaptureReader::PacketCaptureReader() {}
+
+PacketCaptureReader::~PacketCaptureReader() {
+    close();
+}
+
+int PacketCaptureReader::open(const std::string& path) {
+    close();
+    file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        std::cerr << "\033[1;31m[Tinycar] Capture Error: could not open " << path << "\033[0m" << std::endl;
+        return -1;
+    }
+    capture_file_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION) {
+        std::cerr << "\033[1;31m[Tinycar] Capture Error: " << path << " is not a capture of version " << CAPTURE_VERSION << "\033[0m" << std::endl;
+        close();
+        return -1;
+    }
+    return 0;
+}
+
+void PacketCaptureReader::close() {
+    if (file != nullptr) {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+bool PacketCaptureReader::next(capture_record_t& record, uint8_t* buffer) {
+    if (file == nullptr || fread(&record, sizeof(record), 1, file) != 1) {
+        return false;
+    }
+    // a capture that was not closed properly ends with a partial record
+    return fread(buffer, 1, record.length, file) == record.length;
+}
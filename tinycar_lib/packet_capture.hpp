@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <mutex>
+#include <chrono>
+
+// File layout: capture_file_header_t, followed by records. Each record is a capture_record_t followed by length bytes of the datagram.
+// All fields are little endian (host order on every platform the runtime runs on).
+#define CAPTURE_MAGIC 0x50414354 // "TCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_WRITE_BUFFER (1 << 20) // bytes buffered before they are written to the file
+
+#define CAPTURE_STREAM_TCFP 0x00
+#define CAPTURE_STREAM_TCCP 0x01
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+} capture_file_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t timestamp; // ns from opening the capture to the arrival of the datagram
+    uint16_t length; // of the datagram following the record
+    uint8_t stream; // CAPTURE_STREAM_TCFP or CAPTURE_STREAM_TCCP
+    uint8_t reserved;
+} capture_record_t;
+
+/// @brief Writes every received datagram of both protocols with its arrival time to a file, so network problems can be replayed (see TinycarReplay).
+/// Safe to use from the TCFP and TCCP threads at the same time.
+class PacketCapture {
+public:
+    PacketCapture();
+    ~PacketCapture();
+
+    /// @return 0 on success, -1 if the file could not be created
+    int open(const std::string& path);
+    void close();
+    bool isOpen();
+
+    /// @brief Appends a datagram
+    /// @param arrival when the datagram arrived, the kernel receive timestamp if there is one.
+    /// Defaults to the current time, take it before any wait so it is not shifted by the other thread.
+    void write(uint8_t stream, const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now());
+    uint64_t getRecordCount();
+private:
+    std::mutex m;
+    FILE* file = nullptr;
+    char* writeBuffer = nullptr;
+    std::chrono::steady_clock::time_point start;
+    uint64_t records = 0;
+};
+
+/// @brief Reads a file written by PacketCapture record by record
+class PacketCaptureReader {
+public:
+    PacketCaptureReader();
+    ~PacketCaptureReader();
+
+    /// @return 0 on success, -1 if the file could not be opened or is no capture
+    int open(const std::string& path);
+    void close();
+    /// @brief Reads the next record
+    /// @param buffer receives the datagram, has to hold UINT16_MAX bytes
+    /// @return false at the end of the file or if the record is truncated
+    bool next(capture_record_t& record, uint8_t* buffer);
+private:
+    FILE* file = nullptr;
+};
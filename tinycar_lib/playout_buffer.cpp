@@ -0,0 +1,197 @@
+#include "playout_buffer.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+PlayoutBuffer::PlayoutBuffer() {
+    reset();
+}
+
+void PlayoutBuffer::setLatencyTarget(uint32_t ms) {
+    std::lock_guard<std::mutex> lk(m);
+    latencyTarget = ms;
+}
+
+void PlayoutBuffer::setAdaptive(bool adaptive) {
+    std::lock_guard<std::mutex> lk(m);
+    this->adaptive = adaptive;
+}
+
+void PlayoutBuffer::setLatePolicy(PlayoutLatePolicy policy) {
+    std::lock_guard<std::mutex> lk(m);
+    latePolicy = policy;
+}
+
+void PlayoutBuffer::setClockRate(double rate) {
+    std::lock_guard<std::mutex> lk(m);
+    clockRate = rate;
+    restartLocked();
+}
+
+void PlayoutBuffer::reset() {
+    std::lock_guard<std::mutex> lk(m);
+    restartLocked();
+    stats = {0};
+}
+
+void PlayoutBuffer::restartLocked() {
+    for (size_t i = 0; i < count; i++) {
+        entries[i].image.release();
+    }
+    count = 0;
+    started = false;
+    transit_samples = 0;
+    jitter = 0.0;
+    delay = latencyTarget;
+    released = false;
+}
+
+int64_t PlayoutBuffer::unwrapTimestamp(uint32_t timestamp) {
+    if (!started) {
+        last_unwrapped_timestamp = timestamp;
+    } else {
+        last_unwrapped_timestamp += (int32_t)(timestamp - last_timestamp);
+    }
+    last_timestamp = timestamp;
+    return last_unwrapped_timestamp;
+}
+
+double PlayoutBuffer::playoutTime(int64_t timestamp) {
+    return timestamp + std::min(min_transit_current, min_transit_previous) + delay;
+}
+
+bool PlayoutBuffer::push(const cv::Mat& image, uint32_t timestamp, std::chrono::steady_clock::time_point arrival) {
+    std::lock_guard<std::mutex> lk(m);
+    if (started && (int32_t)(timestamp - last_timestamp) < -PLAYOUT_RESTART_JUMP) {
+        // not late, the sender clock started over. Its frames would all be behind the last released one
+        // and the transit estimate is off by the jump.
+        restartLocked();
+    }
+    int64_t t = unwrapTimestamp(timestamp);
+    if (clockRate != 1.0) {
+        t = std::llround(t / clockRate);
+    }
+    double arrival_ms = std::chrono::duration<double, std::milli>(arrival.time_since_epoch()).count();
+    double transit = arrival_ms - t;
+
+    // minimal transit time over the last one to two windows, so it can follow clock drift
+    if (!started) {
+        min_transit_current = transit;
+        min_transit_previous = transit;
+        last_transit = transit;
+        delay = latencyTarget;
+        started = true;
+    }
+    min_transit_current = std::min(min_transit_current, transit);
+    if (++transit_samples >= PLAYOUT_TRANSIT_WINDOW) {
+        min_transit_previous = min_transit_current;
+        min_transit_current = transit;
+        transit_samples = 0;
+    }
+
+    jitter += (std::abs(transit - last_transit) - jitter) / 16.0;
+    last_transit = transit;
+
+    // smoothed delay, so the cadence does not jump with every frame
+    double target = adaptive ? std::min((double)latencyTarget, PLAYOUT_JITTER_FACTOR * jitter) : latencyTarget;
+    delay += (target - delay) / 16.0;
+
+    // never go back in time
+    if (released && t <= last_released_timestamp) {
+        stats.dropped_late++;
+        return false;
+    }
+    if (arrival_ms > playoutTime(t) && latePolicy == PlayoutLatePolicy::DROP) {
+        stats.dropped_late++;
+        return false;
+    }
+
+    if (count == PLAYOUT_BUFFER_SIZE) {
+        // drop the oldest frame
+        std::move(entries + 1, entries + count, entries);
+        count--;
+        stats.dropped_overflow++;
+    }
+    // sorted insert, frames can arrive out of order
+    size_t pos = count;
+    while (pos > 0 && entries[pos - 1].timestamp > t) {
+        entries[pos] = std::move(entries[pos - 1]);
+        pos--;
+    }
+    entries[pos].image = image;
+    entries[pos].timestamp = t;
+    count++;
+    push_cv.notify_one();
+    return true;
+}
+
+bool PlayoutBuffer::pop(cv::Mat& out, std::chrono::steady_clock::time_point now) {
+    std::lock_guard<std::mutex> lk(m);
+    return popLocked(out, now);
+}
+
+bool PlayoutBuffer::waitPop(cv::Mat& out, std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lk(m);
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        if (popLocked(out, now)) {
+            return true;
+        }
+        if (now >= deadline) {
+            return false;
+        }
+        // sleeps until the oldest frame is due, a push may bring an earlier one
+        auto wake = deadline;
+        if (count > 0) {
+            auto due = std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double, std::milli>(playoutTime(entries[0].timestamp))));
+            wake = std::min(wake, due);
+        }
+        push_cv.wait_until(lk, wake);
+    }
+}
+
+bool PlayoutBuffer::popLocked(cv::Mat& out, std::chrono::steady_clock::time_point now) {
+    double now_ms = std::chrono::duration<double, std::milli>(now.time_since_epoch()).count();
+    // newest frame that is due, the schedule grows with the timestamp
+    int index = -1;
+    for (size_t i = 0; i < count; i++) {
+        if (playoutTime(entries[i].timestamp) > now_ms) {
+            break;
+        }
+        index = i;
+    }
+    if (index < 0) {
+        return false;
+    }
+    stats.dropped_skipped += index;
+    stats.released++;
+    out = entries[index].image;
+    last_released_timestamp = entries[index].timestamp;
+    released = true;
+
+    std::move(entries + index + 1, entries + count, entries);
+    for (size_t i = count - index - 1; i < count; i++) {
+        entries[i].image.release();
+    }
+    count -= index + 1;
+    return true;
+}
+
+bool PlayoutBuffer::nextPlayoutTime(std::chrono::steady_clock::time_point& time) {
+    std::lock_guard<std::mutex> lk(m);
+    if (count == 0) {
+        return false;
+    }
+    auto ms = std::chrono::duration<double, std::milli>(playoutTime(entries[0].timestamp));
+    time = std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(ms));
+    return true;
+}
+
+playout_stats_t PlayoutBuffer::getStats() {
+    std::lock_guard<std::mutex> lk(m);
+    playout_stats_t s = stats;
+    s.delay = delay;
+    s.jitter = jitter;
+    return s;
+}
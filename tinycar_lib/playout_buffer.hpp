@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <opencv2/core.hpp>
+
+#define PLAYOUT_BUFFER_SIZE 8 // frames
+#define PLAYOUT_JITTER_FACTOR 3.0 // adaptive delay is this multiple of the measured jitter
+#define PLAYOUT_TRANSIT_WINDOW 64 // frames over which the minimal transit time is tracked
+#define PLAYOUT_RESTART_JUMP 1000 // ms; a sender timestamp this far behind the last one means the car restarted
+
+/// @brief What to do with frames that arrive after their playout time
+enum class PlayoutLatePolicy {
+    DROP, // late frames are never shown
+    PLAY_IF_NEWEST // late frames are shown right away, as long as no newer frame was released
+};
+
+typedef struct {
+    uint64_t released; // frames handed to the consumer
+    uint64_t dropped_late; // frames that arrived after their playout time
+    uint64_t dropped_skipped; // frames that were due but superseded by a newer due frame
+    uint64_t dropped_overflow; // frames pushed out because the buffer was full
+    double delay; // current playout delay in ms
+    double jitter; // transit time jitter in ms
+} playout_stats_t;
+
+/// @brief Adaptive jitter buffer. Frames are released on a schedule derived from the sender timestamp instead of their arrival time.
+///
+/// The playout time of a frame is sender timestamp + minimal transit time + playout delay. The minimal transit time is
+/// tracked over the last frames and absorbs the unknown clock offset between car and host. In adaptive mode the delay
+/// follows the measured jitter and is capped by the latency target, otherwise the target is used as fixed delay.
+class PlayoutBuffer {
+public:
+    PlayoutBuffer();
+
+    /// @brief Sets the latency target in ms. This is the maximal delay a frame is held back.
+    void setLatencyTarget(uint32_t ms);
+    void setAdaptive(bool adaptive);
+    void setLatePolicy(PlayoutLatePolicy policy);
+    /// @brief How fast the sender clock runs compared to the host clock, the speed of a replay. 1 for a live car. Restarts the buffer.
+    void setClockRate(double rate);
+
+    /// @brief Inserts a decoded frame. Thread safe.
+    /// @param timestamp sender timestamp in ms
+    /// @return false if the frame was dropped
+    bool push(const cv::Mat& image, uint32_t timestamp, std::chrono::steady_clock::time_point arrival);
+
+    /// @brief Takes the newest frame that is due. Older due frames are dropped. Thread safe.
+    /// @return true if a frame was released
+    bool pop(cv::Mat& out, std::chrono::steady_clock::time_point now);
+    /// @brief Like pop, but sleeps until a frame is due or the deadline passed. Thread safe.
+    bool waitPop(cv::Mat& out, std::chrono::steady_clock::time_point deadline);
+
+    /// @brief Playout time of the next frame in the buffer
+    /// @return false if the buffer is empty
+    bool nextPlayoutTime(std::chrono::steady_clock::time_point& time);
+
+    playout_stats_t getStats();
+    /// @brief Drops the buffered frames and the transit estimate. Also done by push when the sender clock jumps back.
+    void reset();
+private:
+    typedef struct {
+        cv::Mat image;
+        int64_t timestamp; // unwrapped sender timestamp in ms, on the host clock (see setClockRate)
+    } entry_t;
+
+    int64_t unwrapTimestamp(uint32_t timestamp);
+    /// @brief Playout time in host ms (steady clock) of an unwrapped sender timestamp
+    double playoutTime(int64_t timestamp);
+    bool popLocked(cv::Mat& out, std::chrono::steady_clock::time_point now);
+    /// @brief Like reset, but keeps the stats. Holds m.
+    void restartLocked();
+
+    std::condition_variable push_cv; // signaled on push, for waitPop
+
+    std::mutex m;
+    entry_t entries[PLAYOUT_BUFFER_SIZE]; // sorted by timestamp, oldest first
+    size_t count = 0;
+
+    uint32_t latencyTarget = 0;
+    bool adaptive = true;
+    PlayoutLatePolicy latePolicy = PlayoutLatePolicy::DROP;
+    double clockRate = 1.0;
+
+    // timestamp unwrapping
+    bool started = false;
+    uint32_t last_timestamp = 0;
+    int64_t last_unwrapped_timestamp = 0;
+
+    // transit time tracking (host ms - sender ms)
+    double min_transit_current; // minimum of the running window
+    double min_transit_previous; // minimum of the last complete window
+    uint32_t transit_samples = 0;
+    double last_transit = 0.0;
+    double jitter = 0.0;
+    double delay = 0.0; // smoothed playout delay
+
+    int64_t last_released_timestamp = 0;
+    bool released = false;
+    playout_stats_t stats;
+};
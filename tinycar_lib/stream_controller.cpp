@@ -0,0 +1,152 @@
+#include "stream_controller.hpp"
+
+#include <algorithm>
+
+typedef struct {
+    uint8_t jpeg_quality;
+    uint8_t frame_size;
+} stream_level_t;
+
+// lowest bitrate first. Quality is lowered before the resolution, since the lane detection copes better with artifacts than with fewer pixels.
+static const stream_level_t STREAM_LEVELS[] = {
+    {20, 2},
+    {40, 2},
+    {30, 1},
+    {45, 1},
+    {60, 1},
+    {40, 0},
+    {50, 0},
+    {60, 0},
+    {70, 0},
+    {80, 0},
+};
+static const int STREAM_LEVEL_COUNT = sizeof(STREAM_LEVELS) / sizeof(STREAM_LEVELS[0]);
+
+StreamController::StreamController(): latencyTarget(150) {
+    reset();
+}
+
+void StreamController::setLatencyTarget(uint32_t ms) {
+    std::lock_guard<std::mutex> lk(m);
+    latencyTarget = ms;
+}
+
+void StreamController::reset() {
+    std::lock_guard<std::mutex> lk(m);
+    started = false;
+    expected_fragments = 0;
+    received_fragments = 0;
+    transit_started = false;
+    transit_samples = 0;
+    max_queuing_delay = 0.0;
+    frame_latency = 0;
+    clean_intervals = 0;
+    probe_intervals = STREAM_CONTROL_PROBE_INTERVALS;
+    probing = false;
+    stats = {0};
+    // start at the top, the car streams at its best quality until told otherwise
+    setLevel(STREAM_LEVEL_COUNT - 1);
+}
+
+void StreamController::setLevel(int level) {
+    this->level = std::max(0, std::min(level, STREAM_LEVEL_COUNT - 1));
+    stats.level = this->level;
+    stats.jpeg_quality = STREAM_LEVELS[this->level].jpeg_quality;
+    stats.frame_size = STREAM_LEVELS[this->level].frame_size;
+}
+
+void StreamController::onFrame(uint8_t fragment_count, uint8_t fragments_received, uint32_t timestamp, std::chrono::steady_clock::time_point arrival) {
+    std::lock_guard<std::mutex> lk(m);
+    expected_fragments += fragment_count;
+    received_fragments += fragments_received;
+
+    if (!transit_started) {
+        last_unwrapped_timestamp = timestamp;
+    } else {
+        last_unwrapped_timestamp += (int32_t)(timestamp - last_timestamp);
+    }
+    last_timestamp = timestamp;
+    double arrival_ms = std::chrono::duration<double, std::milli>(arrival.time_since_epoch()).count();
+    double transit = arrival_ms - last_unwrapped_timestamp;
+
+    // minimal transit time over the last one to two windows, so it can follow clock drift
+    if (!transit_started) {
+        min_transit_current = transit;
+        min_transit_previous = transit;
+        transit_started = true;
+    }
+    min_transit_current = std::min(min_transit_current, transit);
+    if (++transit_samples >= STREAM_CONTROL_TRANSIT_WINDOW) {
+        min_transit_previous = min_transit_current;
+        min_transit_current = transit;
+        transit_samples = 0;
+    }
+    double queuing_delay = transit - std::min(min_transit_current, min_transit_previous);
+    max_queuing_delay = std::max(max_queuing_delay, queuing_delay);
+    stats.queuing_delay = queuing_delay;
+}
+
+void StreamController::onFrameLatency(uint32_t latency) {
+    std::lock_guard<std::mutex> lk(m);
+    frame_latency = latency;
+}
+
+bool StreamController::update(std::chrono::steady_clock::time_point now, tccp_stream_control_t& msg) {
+    std::lock_guard<std::mutex> lk(m);
+    if (!started) {
+        last_update = now;
+        started = true;
+        return false;
+    }
+    if (now - last_update < std::chrono::milliseconds(STREAM_CONTROL_INTERVAL) || expected_fragments == 0) {
+        return false;
+    }
+    last_update = now;
+
+    uint32_t loss = 100 * (expected_fragments - std::min(received_fragments, expected_fragments)) / expected_fragments;
+    stats.packet_loss = loss;
+    bool late = max_queuing_delay > latencyTarget / 2.0 || frame_latency > latencyTarget;
+
+    if (loss > STREAM_CONTROL_LOSS_HIGH || late) {
+        // a fixed number of steps down on heavy loss or if the queues are building up, one more if both
+        setLevel(level - STREAM_CONTROL_DECREASE_STEPS - ((loss > STREAM_CONTROL_LOSS_HIGH && late) ? 1 : 0));
+        stats.decreases++;
+        if (probing) {
+            // the last raise was too much, wait longer before the next one
+            probe_intervals = std::min(probe_intervals * 2, STREAM_CONTROL_MAX_PROBE_INTERVALS);
+        }
+        probing = false;
+        clean_intervals = 0;
+    } else if (loss < STREAM_CONTROL_LOSS_LOW && max_queuing_delay < latencyTarget / 4.0) {
+        if (++clean_intervals >= probe_intervals && level < STREAM_LEVEL_COUNT - 1) {
+            setLevel(level + 1);
+            stats.increases++;
+            probing = true;
+            clean_intervals = 0;
+        } else if (probing && clean_intervals >= STREAM_CONTROL_PROBE_INTERVALS) {
+            // the raise held, so the link is not at its limit
+            probe_intervals = STREAM_CONTROL_PROBE_INTERVALS;
+            probing = false;
+        }
+    } else {
+        clean_intervals = 0;
+    }
+
+    msg = {0};
+    msg.header.type = TCCP_TYPE_STREAM_CONTROL;
+    msg.header.subtype = TCCP_STREAM_CONTROL_REPORT;
+    msg.packet_loss = loss;
+    msg.jpeg_quality = STREAM_LEVELS[level].jpeg_quality;
+    msg.frame_size = STREAM_LEVELS[level].frame_size;
+    msg.frame_latency = std::min(frame_latency, (uint32_t)UINT16_MAX);
+
+    expected_fragments = 0;
+    received_fragments = 0;
+    max_queuing_delay = 0.0;
+    return true;
+}
+
+stream_control_stats_t StreamController::getStats() {
+    std::lock_guard<std::mutex> lk(m);
+    return stats;
+}
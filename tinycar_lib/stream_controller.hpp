@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+
+#include "tccp.hpp"
+
+#define STREAM_CONTROL_INTERVAL 500 // ms between two decisions (and stream control messages)
+#define STREAM_CONTROL_LOSS_HIGH 10 // percent, above this the level is lowered by STREAM_CONTROL_DECREASE_STEPS
+#define STREAM_CONTROL_DECREASE_STEPS 2 // levels dropped on heavy loss or building queues, one more if both happen together
+#define STREAM_CONTROL_LOSS_LOW 2 // percent, below this the link counts as clean
+#define STREAM_CONTROL_TRANSIT_WINDOW 64 // frames over which the minimal transit time is tracked
+#define STREAM_CONTROL_PROBE_INTERVALS 4 // clean intervals before the level is raised, doubles after every decrease up to STREAM_CONTROL_MAX_PROBE_INTERVALS
+#define STREAM_CONTROL_MAX_PROBE_INTERVALS 32
+
+typedef struct {
+    uint8_t level; // current step of the quality ladder, 0 = lowest bitrate
+    uint8_t jpeg_quality; // requested from the car
+    uint8_t frame_size; // requested from the car, 0 = full resolution
+    uint8_t packet_loss; // percent over the last interval
+    double queuing_delay; // ms the frames currently spend in queues on top of the minimal transit time
+    uint64_t decreases;
+    uint64_t increases;
+} stream_control_stats_t;
+
+/// @brief Congestion controller for the camera stream. Steps the JPEG quality and resolution of the car along a fixed ladder.
+///
+/// Congestion shows up as fragment loss or as growing transit time (sender timestamp to arrival), since WiFi queues fill up
+/// before they drop. The transit time above its minimum over the last frames is the queuing delay, the minimum also absorbs the
+/// clock offset between car and host. Every interval the level is lowered by STREAM_CONTROL_DECREASE_STEPS if loss is high or the
+/// queuing delay or frame latency exceeds the latency target, and raised by one step after enough clean intervals. A failed raise
+/// makes the next one wait longer.
+class StreamController {
+public:
+    StreamController();
+
+    /// @brief Maximal end to end frame latency in ms the controller aims for
+    void setLatencyTarget(uint32_t ms);
+
+    /// @brief Feeds the sender report of a received frame
+    /// @param fragments_received fragments that arrived over the network (without the ones recovered by FEC)
+    /// @param timestamp sender timestamp in ms
+    void onFrame(uint8_t fragment_count, uint8_t fragments_received, uint32_t timestamp, std::chrono::steady_clock::time_point arrival);
+    /// @brief Latest end to end frame latency measurement in ms
+    void onFrameLatency(uint32_t latency);
+
+    /// @brief Decides on the level once per STREAM_CONTROL_INTERVAL
+    /// @param msg filled with the stream control message to send
+    /// @return true if msg should be sent
+    bool update(std::chrono::steady_clock::time_point now, tccp_stream_control_t& msg);
+
+    stream_control_stats_t getStats();
+    void reset();
+private:
+    void setLevel(int level);
+
+    std::mutex m;
+    uint32_t latencyTarget;
+    int level;
+    bool started;
+    std::chrono::steady_clock::time_point last_update;
+
+    // loss over the current interval
+    uint32_t expected_fragments;
+    uint32_t received_fragments;
+
+    // transit time
+    bool transit_started;
+    int64_t last_unwrapped_timestamp;
+    uint32_t last_timestamp;
+    double min_transit_current;
+    double min_transit_previous;
+    uint32_t transit_samples;
+    double max_queuing_delay; // over the current interval
+    uint32_t frame_latency;
+
+    int clean_intervals;
+    int probe_intervals; // clean intervals needed before the next raise
+    bool probing; // the last change was a raise
+
+    stream_control_stats_t stats;
+};
@@ -1,17 +1,40 @@
 #include "tccp.hpp"
 
-TCCP_Client::TCCP_Client(const std::string& hostname): hostname(hostname) {
+#include <fcntl.h>
+#include <algorithm>
+#include <random>
+
+TCCP_Client::TCCP_Client(const std::string& hostname, uint16_t port): hostname(hostname), port(port) {
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    session = std::random_device()();
+}
+
+TCCP_Client::~TCCP_Client() {
+    {
+        std::lock_guard<std::mutex> lk(copy_m);
+        copyThreadRunning = false;
+    }
+    copy_cv.notify_one();
+    if (copyThread.joinable()) {
+        copyThread.join();
+    }
 }
 
 void TCCP_Client::startListener() {
     listenerThread = std::thread(&TCCP_Client::listener_task, this);
 }
 
+void TCCP_Client::setSending(bool enabled) {
+    sending = enabled;
+}
+
 int TCCP_Client::sendData(uint8_t* data, size_t len) {
+    if (!sending) {
+        return 0;
+    }
     sockaddr_in servaddr = {0};
     servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(TCCP_PORT);
+    servaddr.sin_port = htons(port);
     if (inet_pton(AF_INET, hostname.c_str(), &servaddr.sin_addr) <= 0) {
         std::cerr << "\033[1;31m[Tinycar] TCCP Error: inet:pron error for " << hostname << "\033[0m" << std::endl;
         return -1;
@@ -26,15 +49,90 @@ int TCCP_Client::sendData(uint8_t* data, size_t len) {
 }
 
 int TCCP_Client::sendControlMessage(tccp_control_t* control_msg_data) {
+    if (sequencedControl) {
+        return sendSequencedControlMessage(control_msg_data);
+    }
     return sendData(reinterpret_cast<uint8_t*>(control_msg_data), sizeof(tccp_control_t));
 }
 
+void TCCP_Client::setSequencedControl(bool enabled, uint8_t copies, uint32_t spacing) {
+    std::unique_lock<std::mutex> lk(copy_m);
+    this->copies = std::max<uint8_t>(1, std::min<uint8_t>(copies, TCCP_CONTROL_MAX_COPIES));
+    copySpacing = std::chrono::milliseconds(spacing);
+    copyPending = false;
+    if (enabled && this->copies > 1 && !copyThreadRunning) {
+        copyThreadRunning = true;
+        copyThread = std::thread(&TCCP_Client::copy_task, this);
+    }
+    sequencedControl = enabled;
+}
+
+int TCCP_Client::sendSequencedControlMessage(tccp_control_t* control_msg_data) {
+    tccp_sequenced_control_t message = {0};
+    message.control = *control_msg_data;
+    message.control.header.subtype = TCCP_CONTROL_SEQUENCED;
+    message.session = session;
+    {
+        std::lock_guard<std::mutex> lk(copy_m);
+        message.sequence = ++sequence;
+        if (copies > 1) {
+            // replaces the copies of the previous message, the car would drop them anyway
+            pendingCopy = message;
+            pendingCopy.copy = 1;
+            copyPending = true;
+            copyDue = std::chrono::steady_clock::now() + copySpacing;
+        }
+    }
+    copy_cv.notify_one();
+    return sendData(reinterpret_cast<uint8_t*>(&message), sizeof(message));
+}
+
+void TCCP_Client::copy_task() {
+    std::unique_lock<std::mutex> lk(copy_m);
+    while (copyThreadRunning) {
+        if (!copyPending) {
+            copy_cv.wait(lk);
+            continue;
+        }
+        if (copy_cv.wait_until(lk, copyDue) != std::cv_status::timeout) {
+            // a newer message or stop, the due time may have changed
+            continue;
+        }
+        if (!copyPending || std::chrono::steady_clock::now() < copyDue) {
+            continue;
+        }
+        tccp_sequenced_control_t message = pendingCopy;
+        if (++pendingCopy.copy >= copies) {
+            copyPending = false;
+        } else {
+            copyDue += copySpacing;
+        }
+        lk.unlock();
+        sendData(reinterpret_cast<uint8_t*>(&message), sizeof(message));
+        lk.lock();
+    }
+}
+
 int TCCP_Client::sendRTTMessage() {
     tccp_rtt_t rtt = {0};
     rtt.header.type = TCCP_TYPE_RTT;
     return sendData(reinterpret_cast<uint8_t*>(&rtt), sizeof(tccp_rtt_t));
 }
 
+int TCCP_Client::sendStreamControlMessage(tccp_stream_control_t* stream_control_msg_data) {
+    return sendData(reinterpret_cast<uint8_t*>(stream_control_msg_data), sizeof(tccp_stream_control_t));
+}
+
+int TCCP_Client::sendNackMessage(uint16_t frame_num, uint8_t first_fragment, uint64_t fragment_mask) {
+    tccp_nack_t nack = {0};
+    nack.header.type = TCCP_TYPE_STREAM_CONTROL;
+    nack.header.subtype = TCCP_STREAM_CONTROL_NACK;
+    nack.first_fragment = first_fragment;
+    nack.frame_num = frame_num;
+    nack.fragment_mask = fragment_mask;
+    return sendData(reinterpret_cast<uint8_t*>(&nack), sizeof(tccp_nack_t));
+}
+
 void TCCP_Client::registerTelemetryCallback(std::function<void(tccp_telemetry_t)> callback) {
     this->telemetryCallback = callback;
 }
@@ -45,43 +143,77 @@ void TCCP_Client::registerRTTCallback(std::function<void(uint32_t)> callback) {
 
 void TCCP_Client::listener_task() {
     int sockfdl = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-    sockaddr_in servaddr = {0};
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = INADDR_ANY;
-    servaddr.sin_port = htons(TCCP_PORT);
-    if(bind(sockfdl, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
-        std::cerr << "\033[1;31m[Tinycar] TCCP Error: bin error %d" << errno << "\033[0m" << std::endl;
+    if (bindListenerSocket(sockfdl) < 0) {
         return;
     }
 
-    char buffer[128];
+    uint8_t buffer[128];
 
     struct sockaddr_in source_addr;
     socklen_t socklen = sizeof(source_addr);
 
     while (true) {
         int n = recvfrom(sockfdl, buffer, sizeof(buffer), 0, (struct sockaddr *)&source_addr, &socklen);
+        handleMessage(buffer, n);
+    }
 
-        if (n >= sizeof(tccp_header_t)) {
-            tccp_header_t* header = reinterpret_cast<tccp_header_t*>(buffer);
-
-            if (header->type == TCCP_TYPE_TELEMETRY && n >= sizeof(tccp_telemetry_t)) {
-                tccp_telemetry_t* telemetry = reinterpret_cast<tccp_telemetry_t*>(buffer);
+    close(sockfdl);
+}
 
-                if (telemetryCallback) {
-                    telemetryCallback(*telemetry);
-                }
-            } else if (header->type == TCCP_TYPE_RTT && n >= sizeof(tccp_rtt_t)) {
-                tccp_rtt_t* rtt = reinterpret_cast<tccp_rtt_t*>(buffer);
-                if (rttCallback) {
-                    rttCallback(rtt->timestamp);
-                }
+void TCCP_Client::attach(NetReactor& reactor) {
+    // in reactor mode the send socket also receives, so there is only one socket to watch
+    if (bindListenerSocket(sockfd) < 0) {
+        return;
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    reactor.addSocket(sockfd, [this]() {
+        uint8_t buffer[128];
+        while (true) {
+            int n = recv(sockfd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (n < 0) {
+                break;
             }
-        } else {
-            std::cerr << "\033[1;31m[Tinycar] TCCP Error: Received invalid packet" << "\033[0m" << std::endl;
+            handleMessage(buffer, n);
         }
+    });
+}
+
+int TCCP_Client::bindListenerSocket(int fd) {
+    sockaddr_in servaddr = {0};
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = INADDR_ANY;
+    servaddr.sin_port = htons(TCCP_PORT);
+    if(bind(fd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+        std::cerr << "\033[1;31m[Tinycar] TCCP Error: bin error %d" << errno << "\033[0m" << std::endl;
+        return -1;
     }
+    return 0;
+}
 
-    close(sockfdl);
+void TCCP_Client::setCapture(std::shared_ptr<PacketCapture> capture) {
+    this->capture = capture;
 }
 
+void TCCP_Client::handleMessage(const uint8_t* buffer, int n) {
+    if (capture && n > 0) {
+        capture->write(CAPTURE_STREAM_TCCP, buffer, n);
+    }
+    if (n >= (int)sizeof(tccp_header_t)) {
+        const tccp_header_t* header = reinterpret_cast<const tccp_header_t*>(buffer);
+
+        if (header->type == TCCP_TYPE_TELEMETRY && n >= sizeof(tccp_telemetry_t)) {
+            const tccp_telemetry_t* telemetry = reinterpret_cast<const tccp_telemetry_t*>(buffer);
+
+            if (telemetryCallback) {
+                telemetryCallback(*telemetry);
+            }
+        } else if (header->type == TCCP_TYPE_RTT && n >= sizeof(tccp_rtt_t)) {
+            const tccp_rtt_t* rtt = reinterpret_cast<const tccp_rtt_t*>(buffer);
+            if (rttCallback) {
+                rttCallback(rtt->timestamp);
+            }
+        }
+    } else {
+        std::cerr << "\033[1;31m[Tinycar] TCCP Error: Received invalid packet" << "\033[0m" << std::endl;
+    }
+}
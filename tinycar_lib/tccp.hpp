@@ -3,13 +3,21 @@
 #include <stdint.h>
 #include <string>
 #include <functional>
+#include <memory>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <iostream>
 
+#include "net_reactor.hpp"
+#include "packet_capture.hpp"
+
 #define TCCP_PORT 55002
 
 #define TCCP_TYPE_CONTROL 0x00
@@ -17,9 +25,21 @@
 #define TCCP_TYPE_STREAM_CONTROL 0x02
 #define TCCP_TYPE_RTT 0x03
 
+// subtypes of TCCP_TYPE_CONTROL
+#define TCCP_CONTROL_PLAIN 0x00
+#define TCCP_CONTROL_SEQUENCED 0x01
+
+#define TCCP_CONTROL_MAX_COPIES 4 // transmissions of a sequenced control message, including the first
+#define TCCP_CONTROL_COPY_SPACING 4 // ms between two copies, long enough to get past short loss bursts
+
+// subtypes of TCCP_TYPE_STREAM_CONTROL
+#define TCCP_STREAM_CONTROL_REPORT 0x00
+#define TCCP_STREAM_CONTROL_NACK 0x01
+
 typedef struct {
     uint8_t type: 2; // 0 = control, 1 = telemetry
-    uint8_t padding: 6;
+    uint8_t subtype: 2; // meaning depends on type, 0 if unused
+    uint8_t padding: 4;
 } tccp_header_t;
 
 typedef struct {
@@ -40,11 +60,72 @@ typedef struct {
     int8_t motor_duty_cycle; // 0-255
 } tccp_control_t;
 
+/// @brief Control message that the car applies only if it is newer than the last one it applied (see TCCP_SequenceFilter).
+/// The same message may be sent several times a few ms apart, so a single lost datagram does not leave a stale setpoint.
+typedef struct {
+    tccp_control_t control; // header.subtype = TCCP_CONTROL_SEQUENCED
+    uint32_t sequence; // incremented for every message, copies repeat it
+    uint8_t session; // random per sender, a new session restarts the sequence on the car
+    uint8_t copy; // 0 = first transmission, 1.. = redundant copies
+} tccp_sequenced_control_t;
+
+enum class TCCP_SequenceResult {
+    APPLY, // newer than everything before
+    DUPLICATE, // copy of the message that was applied last
+    STALE // older than the message that was applied last, e.g. delayed or reordered
+};
+
+/// @brief Receiver side of tccp_sequenced_control_t, as implemented by the car (and the emulator).
+///
+/// Sequence numbers are compared with serial number arithmetic, so the comparison survives the wrap around. A new session
+/// (the runtime restarted) is accepted right away, whatever its sequence numbers are.
+/// Header only, so the emulator does not need the TCCP client.
+class TCCP_SequenceFilter {
+public:
+    TCCP_SequenceResult check(const tccp_sequenced_control_t& message) {
+        if (!started || message.session != session) {
+            started = true;
+            session = message.session;
+            last_sequence = message.sequence;
+            return TCCP_SequenceResult::APPLY;
+        }
+        int32_t diff = (int32_t)(message.sequence - last_sequence);
+        if (diff == 0) {
+            return TCCP_SequenceResult::DUPLICATE;
+        }
+        if (diff < 0) {
+            return TCCP_SequenceResult::STALE;
+        }
+        last_sequence = message.sequence;
+        return TCCP_SequenceResult::APPLY;
+    }
+
+    void reset() {
+        started = false;
+    }
+private:
+    bool started = false;
+    uint8_t session = 0;
+    uint32_t last_sequence = 0;
+};
+
 typedef struct {
     tccp_header_t header;
-    uint8_t packet_loss;
+    uint8_t packet_loss; // percent
+    uint8_t jpeg_quality; // requested JPEG quality 1-100, 0 = unchanged
+    uint8_t frame_size; // requested resolution, 0 = full, every step halves width and height
+    uint16_t frame_latency; // ms, network part of the frame latency as measured by the runtime
 } tccp_stream_control_t;
 
+/// @brief Requests fragments of a frame again. Sent by the runtime as soon as it detects a gap.
+/// Firmware that does not check the subtype takes it for a tccp_stream_control_t, so it is only sent if enabled (-n).
+typedef struct {
+    tccp_header_t header;
+    uint8_t first_fragment; // index of the fragment bit 0 of fragment_mask stands for
+    uint16_t frame_num;
+    uint64_t fragment_mask; // bit i set = fragment first_fragment + i is missing
+} tccp_nack_t;
+
 typedef struct {
     tccp_header_t header;
     uint32_t timestamp; // in ms
@@ -52,21 +133,59 @@ typedef struct {
 
 class TCCP_Client {
 public:
-    TCCP_Client(const std::string& hostname);
+    /// @param port the car receives TCCP messages on, only differs from TCCP_PORT for an emulator on the same host
+    TCCP_Client(const std::string& hostname, uint16_t port = TCCP_PORT);
+    ~TCCP_Client();
     void startListener();
+    /// @brief Alternative to startListener. Telemetry is received on the reactor thread through the send socket, no thread is started.
+    void attach(NetReactor& reactor);
+    /// @brief Handles a message. Called by the listener, or by whoever receives for this car if the socket is shared (see TinycarFleet).
+    void handleMessage(const uint8_t* buffer, int n);
+    /// @brief Records every received message. Must be set before the client is started.
+    void setCapture(std::shared_ptr<PacketCapture> capture);
     
+    /// @brief Sends a control message, as tccp_sequenced_control_t if sequenced control is enabled
     int sendControlMessage(tccp_control_t* control_msg_data); 
+    /// @brief Sends control messages with a sequence number, so the car drops messages that arrive after a newer one.
+    /// @param copies transmissions per message, 1 - TCCP_CONTROL_MAX_COPIES. Copies that are still pending when the next message is sent are dropped.
+    /// @param spacing ms between two copies
+    void setSequencedControl(bool enabled, uint8_t copies = 1, uint32_t spacing = TCCP_CONTROL_COPY_SPACING);
     int sendRTTMessage();
+    int sendStreamControlMessage(tccp_stream_control_t* stream_control_msg_data);
+    int sendNackMessage(uint16_t frame_num, uint8_t first_fragment, uint64_t fragment_mask);
     void registerTelemetryCallback(std::function<void(tccp_telemetry_t)> callback);
     void registerRTTCallback(std::function<void(uint32_t)> callback);
+    /// @brief If disabled, messages are dropped instead of sent, e.g. for a replayed car that is not connected to anything
+    void setSending(bool enabled);
 private:
     int sendData(uint8_t* data, size_t len);
     void listener_task();
+    int bindListenerSocket(int fd);
+    int sendSequencedControlMessage(tccp_control_t* control_msg_data);
+    /// @brief Sends the redundant copies of the last sequenced control message when they are due
+    void copy_task();
 
     std::string hostname;
+    uint16_t port;
     int sockfd;
+    std::atomic<bool> sending{true};
     std::thread listenerThread;
     std::function<void(tccp_telemetry_t)> telemetryCallback;
     std::function<void(uint32_t)> rttCallback;
+    std::shared_ptr<PacketCapture> capture;
+
+    // sequenced control
+    std::atomic<bool> sequencedControl{false};
+    uint8_t session;
+    std::mutex copy_m;
+    std::condition_variable copy_cv;
+    std::thread copyThread;
+    bool copyThreadRunning = false;
+    uint32_t sequence = 0;
+    uint8_t copies = 1;
+    std::chrono::milliseconds copySpacing{TCCP_CONTROL_COPY_SPACING};
+    tccp_sequenced_control_t pendingCopy; // copy.copy is the next copy to send
+    bool copyPending = false;
+    std::chrono::steady_clock::time_point copyDue;
 };
 
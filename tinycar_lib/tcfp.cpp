@@ -1,15 +1,69 @@
 #include "tcfp.hpp"
+#include "tcfp_fec.hpp"
+#include "tcfp_uring.hpp"
 
-TCFP_Client::TCFP_Client() {
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    frameBufferSize = DEFAULT_FRAGMENT_COUNT * DGRAM_SIZE;
-    frameBuffer = (uint8_t*)malloc(frameBufferSize);
-    senderReport = {0};
+#include <algorithm>
+#include <fcntl.h>
+
+#ifdef __linux__
+#define RECV_WAIT_FLAGS MSG_WAITFORONE // return as soon as one datagram is there instead of waiting for a full batch
+#else
+#define RECV_WAIT_FLAGS 0
+#endif
+
+void TCFP_FrameReleaser::operator()(tcfp_frame_slot_t* slot) const {
+    pool->release(slot);
+}
+
+TCFP_FramePool::TCFP_FramePool(size_t slotCount, size_t slotSize): slots(slotCount) {
+    freeSlots.reserve(slotCount);
+    for (auto& slot : slots) {
+        slot = {0};
+        slot.data = (uint8_t*)malloc(slotSize);
+        slot.parity = (uint8_t*)malloc(MAX_FEC_GROUPS * DGRAM_SIZE);
+        freeSlots.push_back(&slot);
+    }
+}
+
+TCFP_FramePool::~TCFP_FramePool() {
+    for (auto& slot : slots) {
+        free(slot.data);
+        free(slot.parity);
+    }
+}
+
+TCFP_Frame TCFP_FramePool::acquire() {
+    std::lock_guard<std::mutex> lk(m);
+    if (freeSlots.empty()) {
+        return TCFP_Frame(nullptr, TCFP_FrameReleaser{this});
+    }
+    tcfp_frame_slot_t* slot = freeSlots.back();
+    freeSlots.pop_back();
+    return TCFP_Frame(slot, TCFP_FrameReleaser{this});
+}
+
+void TCFP_FramePool::release(tcfp_frame_slot_t* slot) {
+    std::lock_guard<std::mutex> lk(m);
+    freeSlots.push_back(slot);
+}
+
+TCFP_Client::TCFP_Client(): framePool(FRAME_SLOT_COUNT, FRAME_SLOT_SIZE) {
+#ifdef __linux__
+    for (int i = 0; i < RECV_BATCH_SIZE; i++) {
+        recvIovecs[i].iov_base = recvBuffers[i];
+        recvIovecs[i].iov_len = RECV_DGRAM_SIZE;
+        recvMsgs[i] = {};
+        recvMsgs[i].msg_hdr.msg_iov = &recvIovecs[i];
+        recvMsgs[i].msg_hdr.msg_iovlen = 1;
+        recvMsgs[i].msg_hdr.msg_control = recvControl[i];
+    }
+#endif
 }
 
 TCFP_Client::~TCFP_Client() {
-    close(sockfd);
-    free(frameBuffer);
+    if (reactorSocket >= 0) {
+        close(reactorSocket);
+    }
 }
 
 void TCFP_Client::startListener() {
@@ -17,26 +71,106 @@ void TCFP_Client::startListener() {
     frameCompleteThread = std::thread(&TCFP_Client::frameComplete_task, this);
 }
 
-void TCFP_Client::registerFramePacketCallback(std::function<void( uint8_t *data, size_t len, tcfp_sender_report_t)> callback) {
+void TCFP_Client::setReceiveBackend(TCFP_ReceiveBackend backend) {
+    receiveBackend = backend;
+}
+
+TCFP_ReceiveBackend TCFP_Client::getReceiveBackend() {
+    return receiveBackend;
+}
+
+void TCFP_Client::registerFramePacketCallback(std::function<void(TCFP_Frame frame)> callback) {
     framePacketCallback = callback;
 }
 
+void TCFP_Client::setRetransmission(bool enabled, uint32_t deadline) {
+    retransmissionDeadline = deadline;
+    retransmission = enabled;
+}
+
+void TCFP_Client::registerFrameProgressCallback(std::function<void(const tcfp_frame_slot_t* frame)> callback) {
+    frameProgressCallback = callback;
+}
+
+void TCFP_Client::registerNackCallback(std::function<void(uint16_t frame_num, uint8_t first_fragment, uint64_t fragment_mask)> callback) {
+    nackCallback = callback;
+}
+
+void TCFP_Client::setCapture(std::shared_ptr<PacketCapture> capture) {
+    this->capture = capture;
+}
+
 void TCFP_Client::frameComplete_task() {
     std::unique_lock<std::mutex> lk(cv_m);
     while (true) {
-        cv.wait(lk, [this]{ return frameComplete; });
-        // do stuff with frame completion
+        cv.wait(lk, [this]{ return completedCount > 0; });
+        TCFP_Frame frame = std::move(completedFrames[completedHead]);
+        completedHead = (completedHead + 1) % FRAME_SLOT_COUNT;
+        completedCount--;
+        // the listener must be able to queue the next frame while this one is decoded
+        lk.unlock();
         if (framePacketCallback) {
-            framePacketCallback(frameBuffer, frameBufferActualSize, senderReport);
+            framePacketCallback(std::move(frame));
         }
-        senderReport = {0};
-        packets_received = 0;
-        frameBufferActualSize = 0;
-        frameComplete = false;
+        lk.lock();
     }
 }
 
-void TCFP_Client::listener_task() {
+void TCFP_Client::pushCompletedFrame(TCFP_Frame frame) {
+    if (inlineDelivery) {
+        // reactor mode, the frame is handled on the network thread
+        if (framePacketCallback) {
+            framePacketCallback(std::move(frame));
+        }
+        return;
+    }
+    TCFP_Frame dropped;
+    {
+        std::lock_guard<std::mutex> lk(cv_m);
+        // the pool has slots for decode workers as well, a slow frame thread must not queue all of them
+        if (completedCount == MAX_FRAMES_WAITING) {
+            dropped = std::move(completedFrames[completedHead]);
+            completedHead = (completedHead + 1) % FRAME_SLOT_COUNT;
+            completedCount--;
+        }
+        completedFrames[(completedHead + completedCount) % FRAME_SLOT_COUNT] = std::move(frame);
+        completedCount++;
+    }
+    cv.notify_one();
+    if (dropped) {
+        std::cerr << "\033[1;33m[Tinycar] TCFP Warning: decoder is too slow. Dropped frame " << dropped->frame_num << "\033[0m" << std::endl;
+    }
+}
+
+TCFP_Frame TCFP_Client::acquireFrameSlot() {
+    TCFP_Frame frame = framePool.acquire();
+    if (!frame) {
+        std::lock_guard<std::mutex> lk(cv_m);
+        if (completedCount > 0) {
+            frame = std::move(completedFrames[completedHead]);
+            completedHead = (completedHead + 1) % FRAME_SLOT_COUNT;
+            completedCount--;
+            std::cerr << "\033[1;33m[Tinycar] TCFP Warning: decoder is too slow. Dropped frame " << frame->frame_num << "\033[0m" << std::endl;
+        }
+    }
+    return frame;
+}
+
+tcfp_receive_stats_t TCFP_Client::getReceiveStats() {
+    tcfp_receive_stats_t stats;
+    stats.datagrams = statDatagrams.load(std::memory_order_relaxed);
+    stats.syscalls = statSyscalls.load(std::memory_order_relaxed);
+    stats.frames_complete = statFramesComplete.load(std::memory_order_relaxed);
+    stats.frames_incomplete = statFramesIncomplete.load(std::memory_order_relaxed);
+    stats.fragments_late = statFragmentsLate.load(std::memory_order_relaxed);
+    stats.fragments_recovered = statFragmentsRecovered.load(std::memory_order_relaxed);
+    stats.nacks_sent = statNacksSent.load(std::memory_order_relaxed);
+    stats.fragments_retransmitted = statFragmentsRetransmitted.load(std::memory_order_relaxed);
+    stats.receive_cpu_ns = statReceiveCpu.load(std::memory_order_relaxed);
+    return stats;
+}
+
+int TCFP_Client::openListenerSocket() {
     int sockfdl = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
     sockaddr_in servaddr = {0};
     servaddr.sin_family = AF_INET;
@@ -44,67 +178,448 @@ void TCFP_Client::listener_task() {
     servaddr.sin_port = htons(RTP_PORT);
     if(bind(sockfdl, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
         std::cerr << "\033[1;31m[Tinycar] TCFP Error: bind error %d" << errno << "\033[0m" << std::endl;
-        return;
+        close(sockfdl);
+        return -1;
+    }
+    // arrival times are taken by the kernel, so they do not depend on when the listener gets to run
+    if (tcfpEnableTimestamps(sockfdl) < 0) {
+        std::cerr << "\033[1;33m[Tinycar] TCFP Warning: no kernel receive timestamps, arrival times include the scheduling delay of the listener" << "\033[0m" << std::endl;
     }
+    return sockfdl;
+}
 
+int TCFP_Client::receiveBatch(int fd, int flags) {
+#ifdef __linux__
+    // Batched receive. Takes everything that is queued (up to RECV_BATCH_SIZE).
+    // The target offset is only known after reading the header, so payloads are copied from the batch buffers into the slot.
+    for (int i = 0; i < RECV_BATCH_SIZE; i++) {
+        // the kernel sets it to the length of the control messages it wrote
+        recvMsgs[i].msg_hdr.msg_controllen = TCFP_TIMESTAMP_CONTROL_SIZE;
+    }
+    int count = recvmmsg(fd, recvMsgs, RECV_BATCH_SIZE, flags, nullptr);
+    if (count <= 0) {
+        return count;
+    }
+    TCFP_ArrivalClock clock;
+    statSyscalls.fetch_add(1, std::memory_order_relaxed);
+    statDatagrams.fetch_add(count, std::memory_order_relaxed);
+    for (int i = 0; i < count; i++) {
+        handleDatagram(recvBuffers[i], recvMsgs[i].msg_len, clock.arrival(&recvMsgs[i].msg_hdr));
+    }
+    return count;
+#else
     struct sockaddr_in source_addr;
     socklen_t socklen = sizeof(source_addr);
+    int n = recvfrom(fd, recvBuffers[0], RECV_DGRAM_SIZE, flags, (struct sockaddr *)&source_addr, &socklen);
+    if (n < 0) {
+        return n;
+    }
+    statSyscalls.fetch_add(1, std::memory_order_relaxed);
+    statDatagrams.fetch_add(1, std::memory_order_relaxed);
+    handleDatagram(recvBuffers[0], n, std::chrono::steady_clock::now());
+    return 1;
+#endif
+}
+
+void TCFP_Client::listener_task() {
+    int sockfdl = openListenerSocket();
+    if (sockfdl < 0) {
+        return;
+    }
 
     std::cout << "\033[1;32m[Tinycar] TCFP Info: Listener started." << "\033[0m" << std::endl;
 
+    if (receiveBackend == TCFP_ReceiveBackend::IO_URING) {
+        TCFP_UringReceiver uring;
+        if (uring.init(sockfdl, RECV_DGRAM_SIZE, [this](const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival) {
+            handleDatagram(buffer, n, arrival);
+        }) == 0) {
+            std::cout << "\033[1;32m[Tinycar] TCFP Info: Receiving with io_uring." << "\033[0m" << std::endl;
+            while (true) {
+                int count = uring.receive();
+                if (count < 0) {
+                    break;
+                }
+                statSyscalls.fetch_add(1, std::memory_order_relaxed);
+                statDatagrams.fetch_add(count, std::memory_order_relaxed);
+            }
+        }
+        // not available or failed, datagrams not yet received are still in the socket
+        std::cerr << "\033[1;33m[Tinycar] TCFP Warning: io_uring not usable (" << strerror(errno) << "). Falling back to recvmmsg." << "\033[0m" << std::endl;
+        receiveBackend = TCFP_ReceiveBackend::RECVMMSG;
+    }
+
     while (true) {
-        int n = recvfrom(sockfdl, buffer, sizeof(buffer), 0, (struct sockaddr *)&source_addr, &socklen);
-        if (n < 0) {
-            std::cerr << "\033[1;31m[Tinycar] TCFP Error: recvfrom error %d" << errno << "\033[0m" << std::endl;
-            return;
+        // blocks until at least one datagram is there
+        if (receiveBatch(sockfdl, RECV_WAIT_FLAGS) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "\033[1;31m[Tinycar] TCFP Error: receive error %d" << errno << "\033[0m" << std::endl;
+            break;
         }
-        if (n >= sizeof(tcfp_header_t)) {
-            tcfp_header_t* header = reinterpret_cast<tcfp_header_t*>(buffer);
-            // Allocate more memory if needed
-            if (frameBufferSize < header->fragment_count * DGRAM_SIZE) {
-                frameBufferSize = header->fragment_count * DGRAM_SIZE;
-                frameBuffer = (uint8_t*)realloc(frameBuffer, frameBufferSize);
+    }
+
+    close(sockfdl);
+}
+
+void TCFP_Client::attach(NetReactor& reactor) {
+    reactorSocket = openListenerSocket();
+    if (reactorSocket < 0) {
+        return;
+    }
+    fcntl(reactorSocket, F_SETFL, fcntl(reactorSocket, F_GETFL) | O_NONBLOCK);
+    inlineDelivery = true;
+
+    reactor.addSocket(reactorSocket, [this]() {
+        // drain the socket, but give the other sockets and timers a chance under load
+        for (int i = 0; i < REACTOR_RECV_BATCHES; i++) {
+            if (receiveBatch(reactorSocket, MSG_DONTWAIT) <= 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    std::cerr << "\033[1;31m[Tinycar] TCFP Error: receive error %d" << errno << "\033[0m" << std::endl;
+                }
+                break;
             }
-            if (current_frame_num == 0) {
-                current_frame_num = header->frame_num;
+        }
+    });
+    // incomplete frames must not wait for the next frame to be delivered
+    reactor.addTimer(RETRANSMISSION_TIMER_INTERVAL, [this]() { expireFrames(); });
+
+    std::cout << "\033[1;32m[Tinycar] TCFP Info: Listener attached to reactor." << "\033[0m" << std::endl;
+}
+
+void TCFP_Client::startExternal() {
+    inlineDelivery = true;
+}
+
+void TCFP_Client::receiveDatagram(const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival) {
+    statDatagrams.fetch_add(1, std::memory_order_relaxed);
+    handleDatagram(buffer, n, arrival);
+}
+
+void TCFP_Client::expireFrames(std::chrono::steady_clock::time_point now) {
+    deliverExpiredFrames(now);
+}
+
+void TCFP_Client::reset() {
+    for (auto& frame : inflightFrames) {
+        frame.reset();
+    }
+    recentFrameHead = 0;
+    recentFrameCount = 0;
+}
+
+void TCFP_Client::handleDatagram(const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival) {
+    if (capture) {
+        capture->write(CAPTURE_STREAM_TCFP, buffer, n, arrival);
+    }
+    if (n < sizeof(tcfp_header_t)) {
+        std::cerr << "\033[1;31m[Tinycar] TCFP Error: packet too small for JPEG stream. Will be ignored. \033[0m" << std::endl;
+        return;
+    }
+    const tcfp_header_t* header = reinterpret_cast<const tcfp_header_t*>(buffer);
+    if (header->fragment_offset == FEC_FRAGMENT_OFFSET) {
+        handleParityDatagram(buffer, n, arrival);
+        return;
+    }
+    uint32_t payload_len = n - sizeof(tcfp_header_t);
+    if (header->fragment_offset + payload_len > FRAME_SLOT_SIZE) {
+        std::cerr << "\033[1;31m[Tinycar] TCFP Error: fragment offset " << header->fragment_offset << " exceeds frame buffer. Will be ignored. \033[0m" << std::endl;
+        return;
+    }
+    if (header->fragment_count == 0 || (!header->marker && payload_len == 0)) {
+        return;
+    }
+    tcfp_frame_slot_t* frame = getInflightFrame(header, arrival);
+    if (frame == nullptr) {
+        return;
+    }
+
+    // All fragments except the last one carry the same amount of payload, so the index follows from the offset.
+    // The last fragment is the only one with the marker bit. Its offset tells the stride if no other fragment was seen yet.
+    uint32_t index;
+    if (header->marker) {
+        index = header->fragment_count - 1;
+        if (frame->fragment_stride == 0 && index > 0) {
+            frame->fragment_stride = header->fragment_offset / index;
+        }
+    } else {
+        if (frame->fragment_stride == 0) {
+            frame->fragment_stride = payload_len;
+        }
+        index = header->fragment_offset / frame->fragment_stride;
+    }
+    if (index >= frame->fragment_count || (frame->fragment_stride > 0 && header->fragment_offset != index * frame->fragment_stride)) {
+        std::cerr << "\033[1;31m[Tinycar] TCFP Error: fragment at offset " << header->fragment_offset << " does not fit frame " << header->frame_num << ". Will be ignored. \033[0m" << std::endl;
+        return;
+    }
+    if (tcfpFragmentReceived(frame, index)) {
+        // duplicate
+        return;
+    }
+    if ((frame->nacked_fragments[index / 64] >> (index % 64)) & 1) {
+        statFragmentsRetransmitted.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Copy data to frame buffer
+    memcpy(frame->data + header->fragment_offset, buffer + sizeof(tcfp_header_t), payload_len);
+    frame->received_fragments[index / 64] |= (uint64_t)1 << (index % 64);
+    frame->packets_received++;
+    frame->senderReport.start_rtt |= header->rtt_start;
+    frame->senderReport.last_arrival = std::max(frame->senderReport.last_arrival, arrival);
+    if (header->marker) {
+        frame->marker_received = 1;
+        frame->len = header->fragment_offset + payload_len;
+    } else if (!frame->marker_received) {
+        frame->len = std::max(frame->len, (uint32_t)(header->fragment_offset + payload_len));
+    }
+
+    if (!checkFrame(frame, index) && retransmission && index >= NACK_REORDER_THRESHOLD) {
+        requestRetransmission(frame, index - NACK_REORDER_THRESHOLD + 1, arrival);
+    }
+}
+
+void TCFP_Client::handleParityDatagram(const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival) {
+    const tcfp_header_t* header = reinterpret_cast<const tcfp_header_t*>(buffer);
+    if (n < sizeof(tcfp_header_t) + sizeof(tcfp_fec_header_t) || header->fragment_count == 0) {
+        return;
+    }
+    const tcfp_fec_header_t* fec = reinterpret_cast<const tcfp_fec_header_t*>(buffer + sizeof(tcfp_header_t));
+    if (fec->fragment_stride == 0 || fec->fragment_stride > DGRAM_SIZE || n != sizeof(tcfp_header_t) + sizeof(tcfp_fec_header_t) + fec->fragment_stride ||
+        fec->group_size == 0 || fec->group_start >= header->fragment_count) {
+        std::cerr << "\033[1;31m[Tinycar] TCFP Error: invalid parity datagram. Will be ignored. \033[0m" << std::endl;
+        return;
+    }
+
+    tcfp_frame_slot_t* frame = getInflightFrame(header, arrival);
+    if (frame == nullptr) {
+        return;
+    }
+    if (frame->fragment_stride == 0) {
+        frame->fragment_stride = fec->fragment_stride;
+    } else if (frame->fragment_stride != fec->fragment_stride) {
+        return;
+    }
+
+    tcfp_fec_group_t* group = nullptr;
+    for (size_t i = 0; i < frame->fec_group_count; i++) {
+        if (frame->fec_groups[i].group_start == fec->group_start) {
+            // duplicate
+            return;
+        }
+    }
+    if (frame->fec_group_count == MAX_FEC_GROUPS) {
+        return;
+    }
+    group = &frame->fec_groups[frame->fec_group_count];
+    group->group_start = fec->group_start;
+    group->group_size = fec->group_size;
+    group->length_recovery = fec->length_recovery;
+    group->used = 1;
+    memcpy(frame->parity + frame->fec_group_count * DGRAM_SIZE, buffer + sizeof(tcfp_header_t) + sizeof(tcfp_fec_header_t), fec->fragment_stride);
+    frame->fec_group_count++;
+    // may complete the frame
+    frame->senderReport.last_arrival = std::max(frame->senderReport.last_arrival, arrival);
+
+    checkFrame(frame, fec->group_start);
+}
+
+bool TCFP_Client::checkFrame(tcfp_frame_slot_t* frame, uint32_t index) {
+    for (size_t i = 0; i < frame->fec_group_count; i++) {
+        tcfp_fec_group_t* group = &frame->fec_groups[i];
+        if (group->used && index >= group->group_start && index < (uint32_t)group->group_start + group->group_size) {
+            if (tcfpFecRecover(frame, group) >= 0) {
+                statFragmentsRecovered.fetch_add(1, std::memory_order_relaxed);
             }
-            // check if frame number matches with expected frame number
-            if (header->frame_num != current_frame_num) {
-                std::cerr << "\033[1;33m[Tinycar] TCFP Warning: frame number mismatch. Expected " << current_frame_num << " but got " << header->frame_num << "\033[0m" << std::endl;
-                // reset frame number
-                current_frame_num = header->frame_num;
-                // reset frame buffer
-                packets_received = 0;
-                frameBufferActualSize = 0;
+        }
+    }
+
+    if (frameProgressCallback) {
+        frameProgressCallback(frame);
+    }
+    // Check if frame is complete
+    if (frame->packets_received == frame->fragment_count) {
+        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            if (inflightFrames[i].get() == frame) {
+                deliverInflightFrame(i);
+                return true;
             }
-            // Copy data to frame buffer
-            memcpy(frameBuffer + header->fragment_offset, buffer + sizeof(tcfp_header_t), n - sizeof(tcfp_header_t));
-            packets_received++;
-            // Check if frame is complete
-            if (header->marker) {
-                // increase frame number to prepare for next frame
-                current_frame_num = (header->frame_num + 1) % 65536;
-
-                frameBufferActualSize = header->fragment_offset + n - sizeof(tcfp_header_t);
-                senderReport.timestamp = header->timestamp;
-                senderReport.fragement_count = header->fragment_count;
-                senderReport.width = header->width;
-                senderReport.height = header->height;
-                senderReport.frame_num = header->frame_num;
-                senderReport.fragments_included = packets_received;
-                senderReport.start_rtt = header->rtt_start;
-                // do stuff with frame completion on different thread
-                {
-                    std::lock_guard<std::mutex> lk(cv_m);
-                    frameComplete = true;
+        }
+    }
+    return false;
+}
+
+void TCFP_Client::requestRetransmission(tcfp_frame_slot_t* frame, uint32_t end, std::chrono::steady_clock::time_point now) {
+    if (!nackCallback) {
+        return;
+    }
+    end = std::min(end, (uint32_t)frame->fragment_count);
+    bool deadlineChecked = false;
+    uint32_t first = 0;
+    uint64_t mask = 0;
+    for (uint32_t word = 0; word * 64 < end; word++) {
+        uint64_t missing = ~(frame->received_fragments[word] | frame->nacked_fragments[word]);
+        if (end - word * 64 < 64) {
+            missing &= ((uint64_t)1 << (end - word * 64)) - 1;
+        }
+        while (missing != 0) {
+            uint32_t index = word * 64 + __builtin_ctzll(missing);
+            missing &= missing - 1;
+            if (!deadlineChecked) {
+                // a retransmission that arrives after the deadline is of no use
+                auto age = std::chrono::duration_cast<std::chrono::milliseconds>(now - frame->senderReport.first_arrival);
+                if (age.count() >= retransmissionDeadline) {
+                    return;
                 }
-                cv.notify_one();
+                deadlineChecked = true;
+            }
+            if (mask != 0 && index - first >= 64) {
+                nackCallback(frame->frame_num, first, mask);
+                statNacksSent.fetch_add(1, std::memory_order_relaxed);
+                mask = 0;
             }
+            if (mask == 0) {
+                first = index;
+            }
+            mask |= (uint64_t)1 << (index - first);
+            frame->nacked_fragments[word] |= (uint64_t)1 << (index % 64);
+        }
+    }
+    if (mask != 0) {
+        nackCallback(frame->frame_num, first, mask);
+        statNacksSent.fetch_add(1, std::memory_order_relaxed);
+    }
+}
 
-        } else {
-            std::cerr << "\033[1;31m[Tinycar] TCFP Error: packet too small for JPEG stream. Will be ignored. \033[0m" << std::endl;
+void TCFP_Client::deliverExpiredFrames(std::chrono::steady_clock::time_point now) {
+    uint32_t deadline = getFrameDeadline();
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        if (!inflightFrames[i]) {
+            continue;
+        }
+        auto age = std::chrono::duration_cast<std::chrono::milliseconds>(now - inflightFrames[i]->senderReport.first_arrival);
+        if (age.count() >= deadline) {
+            deliverInflightFrame(i);
         }
     }
+}
 
-    close(sockfdl);
-}
\ No newline at end of file
+uint32_t TCFP_Client::getFrameDeadline() {
+    return retransmission ? retransmissionDeadline.load() : INCOMPLETE_FRAME_DEADLINE;
+}
+
+void TCFP_Client::expireInflightFrames(uint16_t new_frame_num, std::chrono::steady_clock::time_point now) {
+    deliverExpiredFrames(now);
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        if (!inflightFrames[i]) {
+            continue;
+        }
+        if (tcfpFrameNumBefore(inflightFrames[i]->frame_num, new_frame_num)) {
+            // the sender moved on, so whatever is still missing at the end of this frame was lost
+            requestRetransmission(inflightFrames[i].get(), inflightFrames[i]->fragment_count, now);
+        }
+    }
+}
+
+tcfp_frame_slot_t* TCFP_Client::getInflightFrame(const tcfp_header_t* header, std::chrono::steady_clock::time_point arrival) {
+    size_t freeIndex = MAX_FRAMES_IN_FLIGHT;
+    size_t oldestIndex = MAX_FRAMES_IN_FLIGHT;
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        if (!inflightFrames[i]) {
+            freeIndex = i;
+            continue;
+        }
+        if (inflightFrames[i]->frame_num == header->frame_num) {
+            return inflightFrames[i].get();
+        }
+        if (oldestIndex == MAX_FRAMES_IN_FLIGHT || tcfpFrameNumBefore(inflightFrames[i]->frame_num, inflightFrames[oldestIndex]->frame_num)) {
+            oldestIndex = i;
+        }
+    }
+
+    // fragments of frames that were already delivered are of no use anymore
+    if (wasDelivered(header->frame_num)) {
+        statFragmentsLate.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    if (retransmission) {
+        expireInflightFrames(header->frame_num, arrival);
+    } else {
+        // without retransmission a lost fragment never arrives, the frame must not hold its slot until it is evicted
+        deliverExpiredFrames(arrival);
+    }
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        if (!inflightFrames[i]) {
+            freeIndex = i;
+        }
+    }
+
+    if (freeIndex == MAX_FRAMES_IN_FLIGHT) {
+        // too many frames in flight, give up on the oldest one unless the new frame is even older
+        if (tcfpFrameNumBefore(header->frame_num, inflightFrames[oldestIndex]->frame_num)) {
+            statFragmentsLate.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        deliverInflightFrame(oldestIndex);
+        freeIndex = oldestIndex;
+    }
+
+    TCFP_Frame frame = acquireFrameSlot();
+    if (!frame) {
+        // all slots are held by the consumer
+        return nullptr;
+    }
+    frame->len = 0;
+    frame->frame_num = header->frame_num;
+    frame->fragment_count = header->fragment_count;
+    frame->packets_received = 0;
+    frame->marker_received = 0;
+    frame->fragment_stride = 0;
+    memset(frame->received_fragments, 0, sizeof(frame->received_fragments));
+    frame->fragments_recovered = 0;
+    frame->fec_group_count = 0;
+    memset(frame->nacked_fragments, 0, sizeof(frame->nacked_fragments));
+    tcfp_sender_report_t& senderReport = frame->senderReport;
+    senderReport = {0};
+    senderReport.first_arrival = arrival;
+    senderReport.last_arrival = arrival;
+    senderReport.timestamp = header->timestamp;
+    senderReport.fragement_count = header->fragment_count;
+    senderReport.width = header->width;
+    senderReport.height = header->height;
+    senderReport.frame_num = header->frame_num;
+    inflightFrames[freeIndex] = std::move(frame);
+    return inflightFrames[freeIndex].get();
+}
+
+bool TCFP_Client::wasDelivered(uint16_t frame_num) {
+    for (size_t i = 0; i < recentFrameCount; i++) {
+        if (recentFrameNums[i] == frame_num) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TCFP_Client::deliverInflightFrame(size_t index) {
+    TCFP_Frame frame = std::move(inflightFrames[index]);
+    frame->completed = std::chrono::steady_clock::now();
+    // once per frame is enough to compare receive backends and cheap compared to the receive syscalls
+    struct timespec cpu;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    statReceiveCpu.store(cpu.tv_sec * 1000000000ull + cpu.tv_nsec, std::memory_order_relaxed);
+    frame->senderReport.fragments_included = frame->packets_received;
+    frame->senderReport.fragments_recovered = frame->fragments_recovered;
+    if (frame->packets_received == frame->fragment_count) {
+        statFramesComplete.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        statFramesIncomplete.fetch_add(1, std::memory_order_relaxed);
+    }
+    // remember frame number, the oldest entry gets overwritten
+    recentFrameNums[recentFrameHead] = frame->frame_num;
+    recentFrameHead = (recentFrameHead + 1) % RECENT_FRAME_COUNT;
+    recentFrameCount = std::min(recentFrameCount + 1, (size_t)RECENT_FRAME_COUNT);
+    // do stuff with frame completion on different thread
+    pushCompletedFrame(std::move(frame));
+}
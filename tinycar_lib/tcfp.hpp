@@ -4,18 +4,49 @@
 #include <cstring>
 #include <string>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <thread>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <iostream>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 
+#include "net_reactor.hpp"
+#include "packet_capture.hpp"
+#include "tcfp_timestamp.hpp"
+
 
 #define RTP_PORT 4998
 #define DGRAM_SIZE 1024
-#define DEFAULT_FRAGMENT_COUNT 20
+#define MAX_FRAGMENT_COUNT 255 // fragment_count is a uint8_t
+#define MAX_FRAMES_IN_FLIGHT 3 // frames reassembled at the same time
+#define MAX_FRAMES_WAITING 2 // completed frames queued for the frame thread, the oldest is dropped for a new one
+#define MAX_FRAMES_DECODING 8 // frames handed to decode workers, being decoded or queued (see DecodePool)
+#define FRAME_SLOT_COUNT (MAX_FRAMES_IN_FLIGHT + 1 + MAX_FRAMES_WAITING + MAX_FRAMES_DECODING) // in flight, one on the frame thread, waiting, at the decode workers
+#define RECENT_FRAME_COUNT 16 // number of delivered frame numbers remembered to drop late fragments
+#define FRAGMENT_BITMAP_WORDS ((MAX_FRAGMENT_COUNT + 63) / 64)
+#define FRAME_SLOT_SIZE (MAX_FRAGMENT_COUNT * DGRAM_SIZE)
+#define RECV_BATCH_SIZE 32 // max datagrams fetched per receive syscall (recvmmsg)
+#define REACTOR_RECV_BATCHES 4 // receive syscalls per readable event in reactor mode
+#define RETRANSMISSION_TIMER_INTERVAL 5 // ms, reactor mode only
+#define RECV_DGRAM_SIZE 1500 // largest datagram accepted, parity datagrams are larger than DGRAM_SIZE
+
+// Optional forward error correction: the sender adds a parity datagram per group of consecutive fragments.
+// It is sent like a fragment but with fragment_offset set to FEC_FRAGMENT_OFFSET, followed by tcfp_fec_header_t
+// and the XOR of the group's payloads (each zero padded to fragment_stride).
+#define FEC_FRAGMENT_OFFSET 0xFFFFFF // no data fragment can start there
+#define MAX_FEC_GROUPS 64 // parity datagrams per frame
+
+// Retransmission: missing fragments are requested from the sender with a NACK (see TCCP)
+#define NACK_REORDER_THRESHOLD 2 // a fragment counts as lost once a fragment this many indices later of the same frame arrived
+#define DEFAULT_RETRANSMISSION_DEADLINE 100 // ms after the first fragment of a frame; no NACKs later than this
+#define INCOMPLETE_FRAME_DEADLINE 50 // ms after the first fragment an incomplete frame is given up if retransmission is off
 
 typedef struct {
     uint32_t timestamp;
@@ -37,34 +68,225 @@ typedef struct {
     uint8_t height; // mutiple of 8
     uint16_t frame_num;
     uint8_t start_rtt;
+    uint8_t fragments_recovered; // fragments included in frame that were recovered by FEC
+    // kernel receive timestamps (see TCFP_ArrivalClock), the time the datagram was read if the socket has none
+    std::chrono::steady_clock::time_point first_arrival; // first fragment that arrived
+    std::chrono::steady_clock::time_point last_arrival; // last fragment that arrived
 } tcfp_sender_report_t;
 
+typedef struct {
+    uint8_t group_start; // index of the first fragment protected by this parity
+    uint8_t group_size; // number of consecutive fragments in the group
+    uint16_t length_recovery; // XOR of the payload lengths of the group
+    uint16_t fragment_stride; // payload bytes of every fragment but the last one
+    uint16_t reserved;
+} tcfp_fec_header_t;
+
+typedef struct {
+    uint8_t group_start;
+    uint8_t group_size;
+    uint16_t length_recovery;
+    uint8_t used; // parity of the group is still needed
+} tcfp_fec_group_t;
+
+/// @brief Preallocated buffer a single frame is reassembled in
+typedef struct {
+    uint8_t* data; // FRAME_SLOT_SIZE bytes, allocated once by the pool
+    uint32_t len; // actual size of frame inside buffer. Only exact if the marker fragment was received
+    uint16_t frame_num;
+    uint8_t fragment_count;
+    uint8_t packets_received;
+    uint8_t marker_received;
+    uint32_t fragment_stride; // payload bytes of every fragment but the last one, 0 until known
+    uint64_t received_fragments[FRAGMENT_BITMAP_WORDS]; // bit i is set if fragment i was received
+    uint8_t fragments_recovered;
+    // forward error correction
+    uint8_t* parity; // MAX_FEC_GROUPS * DGRAM_SIZE bytes, allocated once by the pool. Parity of group i at i * DGRAM_SIZE
+    tcfp_fec_group_t fec_groups[MAX_FEC_GROUPS];
+    uint8_t fec_group_count;
+    // retransmission
+    uint64_t nacked_fragments[FRAGMENT_BITMAP_WORDS]; // bit i is set if fragment i was already requested again
+    std::chrono::steady_clock::time_point completed; // the frame was delivered by the receiver, complete or not
+    tcfp_sender_report_t senderReport;
+} tcfp_frame_slot_t;
+
+inline bool tcfpFragmentReceived(const tcfp_frame_slot_t* slot, uint32_t index) {
+    return (slot->received_fragments[index / 64] >> (index % 64)) & 1;
+}
+
+/// @brief Index of the first fragment at or after first that was not received yet, fragment_count if there is none
+inline uint32_t tcfpFirstMissingFragment(const tcfp_frame_slot_t* slot, uint32_t first) {
+    while (first < slot->fragment_count && tcfpFragmentReceived(slot, first)) {
+        first++;
+    }
+    return first;
+}
+
+/// @brief true if frame number a was sent before b (handles wrap around)
+inline bool tcfpFrameNumBefore(uint16_t a, uint16_t b) {
+    return (int16_t)(a - b) < 0;
+}
+
+typedef struct {
+    uint64_t datagrams; // datagrams received
+    uint64_t syscalls; // receive syscalls that returned data
+    uint64_t frames_complete; // frames delivered with all fragments
+    uint64_t frames_incomplete; // frames delivered with missing fragments
+    uint64_t fragments_late; // fragments of frames that were already delivered
+    uint64_t fragments_recovered; // fragments recovered from parity datagrams
+    uint64_t nacks_sent; // retransmission requests
+    uint64_t fragments_retransmitted; // requested fragments that arrived in time
+    uint64_t receive_cpu_ns; // CPU time of the receiving thread, sampled whenever a frame is delivered
+} tcfp_receive_stats_t;
+
+/// @brief How the listener thread receives datagrams
+enum class TCFP_ReceiveBackend {
+    RECVMMSG, // batches of datagrams with recvmmsg, recvfrom on non Linux systems
+    IO_URING // multishot receive into a ring of provided buffers (Linux >= 6.0). Falls back to RECVMMSG if unavailable
+};
+
+class TCFP_FramePool;
+
+struct TCFP_FrameReleaser {
+    TCFP_FramePool* pool = nullptr;
+    void operator()(tcfp_frame_slot_t* slot) const;
+};
+
+/// @brief Owning handle to a reassembly slot. The slot goes back to its pool as soon as the handle is destroyed.
+typedef std::unique_ptr<tcfp_frame_slot_t, TCFP_FrameReleaser> TCFP_Frame;
+
+/// @brief Fixed set of reassembly slots. All memory is allocated up front, so no allocation happens while receiving.
+class TCFP_FramePool {
+public:
+    TCFP_FramePool(size_t slotCount, size_t slotSize);
+    ~TCFP_FramePool();
+
+    /// @brief Takes a free slot out of the pool
+    /// @return empty handle if all slots are in use
+    TCFP_Frame acquire();
+private:
+    friend struct TCFP_FrameReleaser;
+    void release(tcfp_frame_slot_t* slot);
+
+    std::vector<tcfp_frame_slot_t> slots;
+    std::vector<tcfp_frame_slot_t*> freeSlots; // capacity reserved for all slots, never reallocates
+    std::mutex m;
+};
+
 class TCFP_Client {
 public:
     TCFP_Client();
     ~TCFP_Client();
     void startListener();
+    /// @brief Selects the receive backend of the listener thread. Must be called before startListener. The reactor always waits for readiness and uses recvmmsg.
+    void setReceiveBackend(TCFP_ReceiveBackend backend);
+    /// @brief Backend in use, changes to RECVMMSG if io_uring turned out to be unavailable
+    TCFP_ReceiveBackend getReceiveBackend();
+    /// @brief Alternative to startListener. Receives on the reactor thread and calls the frame callback there, no threads are started.
+    void attach(NetReactor& reactor);
+    /// @brief Alternative to startListener if the socket is shared by several cars (see TinycarFleet). Datagrams are fed with receiveDatagram and frames are delivered on the calling thread.
+    void startExternal();
+    /// @brief Handles a datagram of this stream that was received by someone else. Always call from the same thread.
+    /// @param arrival receive time of the datagram, see TCFP_ArrivalClock
+    void receiveDatagram(const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival = std::chrono::steady_clock::now());
+    /// @brief Delivers incomplete frames that passed their deadline. Call periodically from the receiving thread if the client is driven externally.
+    /// @param now on the clock of the arrival times, e.g. the capture time of a replay
+    void expireFrames(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+    /// @brief Drops the frames in flight and forgets the delivered frame numbers, for a stream that starts over. Receiving thread.
+    void reset();
     
-    void registerFramePacketCallback(std::function<void(uint8_t *data, size_t len, tcfp_sender_report_t)> callback);
+    /// @brief The callback takes ownership of the frame. It can keep the handle as long as it needs the data, but the slot is not available for reception until it is released.
+    void registerFramePacketCallback(std::function<void(TCFP_Frame frame)> callback);
+    /// @brief Called on the receiving thread whenever fragments of a frame in flight were stored, also for the fragment that completes
+    /// the frame, right before it is delivered. The slot may only be read during the call. Fragments can arrive in any order,
+    /// see tcfpFragmentReceived. Must be set before the client is started.
+    void registerFrameProgressCallback(std::function<void(const tcfp_frame_slot_t* frame)> callback);
+    /// @brief Counters of the receive path. datagrams / syscalls is the average batch size.
+    tcfp_receive_stats_t getReceiveStats();
+
+    /// @brief If enabled, missing fragments are reported through the NACK callback as soon as a gap is detected. Incomplete frames are then held back until their deadline passed or they are evicted by newer frames.
+    /// @param deadline ms after the first fragment of a frame, after that the frame is neither NACKed nor waited for anymore
+    void setRetransmission(bool enabled, uint32_t deadline = DEFAULT_RETRANSMISSION_DEADLINE);
+    /// @brief Called on the listener thread for every retransmission request. Bit i of fragment_mask stands for fragment first_fragment + i.
+    void registerNackCallback(std::function<void(uint16_t frame_num, uint8_t first_fragment, uint64_t fragment_mask)> callback);
+    /// @brief Records every received datagram. Must be set before the client is started.
+    void setCapture(std::shared_ptr<PacketCapture> capture);
 private:
     void listener_task();
+    /// @return bound socket, -1 on error
+    int openListenerSocket();
+    /// @brief Receives one batch of datagrams and handles them
+    /// @return number of datagrams, -1 on error (see errno)
+    int receiveBatch(int fd, int flags);
     void frameComplete_task();
+    /// @brief Copies a single datagram into its reassembly slot. Fragments may arrive in any order.
+    void handleDatagram(const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival);
+    /// @brief Stores a parity datagram in the slot of its frame
+    void handleParityDatagram(const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival);
+    /// @brief Tries to recover a missing fragment of the FEC group that contains the fragment and checks if the frame is complete
+    /// @return true if the frame was delivered
+    bool checkFrame(tcfp_frame_slot_t* frame, uint32_t index);
+    /// @brief Requests all missing fragments below end that were not requested yet, unless the frame passed the deadline at now
+    void requestRetransmission(tcfp_frame_slot_t* frame, uint32_t end, std::chrono::steady_clock::time_point now);
+    /// @brief Delivers in flight frames that passed the retransmission deadline. Requests the tail of the others, since a new frame started.
+    void expireInflightFrames(uint16_t new_frame_num, std::chrono::steady_clock::time_point now);
+    /// @brief Delivers in flight frames that passed their deadline, see getFrameDeadline
+    void deliverExpiredFrames(std::chrono::steady_clock::time_point now);
+    /// @brief ms after the first fragment an incomplete frame is waited for
+    uint32_t getFrameDeadline();
+
+    /// @brief Returns the in flight slot for the frame number. Starts a new one if there is none, which may evict the oldest frame in flight.
+    /// @return nullptr if the fragment is late or no slot is available
+    tcfp_frame_slot_t* getInflightFrame(const tcfp_header_t* header, std::chrono::steady_clock::time_point arrival);
+    /// @brief Delivers the in flight frame at index, complete or not. Frames complete in any order, so delivery order is not guaranteed.
+    void deliverInflightFrame(size_t index);
+    bool wasDelivered(uint16_t frame_num);
+    /// @brief Hands a reassembled frame over to the frameComplete thread. If the queue is full the oldest waiting frame is dropped.
+    void pushCompletedFrame(TCFP_Frame frame);
+    /// @brief Gets a slot for a new frame. Reclaims the oldest frame not yet picked up by the decoder if the pool is empty.
+    TCFP_Frame acquireFrameSlot();
 
     // for frame assembly
-    uint8_t* frameBuffer; // dynamically allocated
-    uint32_t frameBufferSize;
-    uint32_t frameBufferActualSize; // actual size of frame inside buffer. frameBufferSize >= frameBufferActualSize
-    uint16_t current_frame_num;
-    uint8_t packets_received;
-    tcfp_sender_report_t senderReport;
+    TCFP_FramePool framePool;
+    TCFP_Frame inflightFrames[MAX_FRAMES_IN_FLIGHT]; // frames currently being received, owned by listener thread
+    uint16_t recentFrameNums[RECENT_FRAME_COUNT]; // ring buffer of delivered frame numbers
+    size_t recentFrameHead = 0;
+    size_t recentFrameCount = 0;
+
+    // completed frames waiting for the frameComplete thread (ring buffer)
+    TCFP_Frame completedFrames[FRAME_SLOT_COUNT];
+    size_t completedHead = 0;
+    size_t completedCount = 0;
 
     std::condition_variable cv;
     std::mutex cv_m;
-    bool frameComplete = false;
 
-    int sockfd;
-    char buffer[DGRAM_SIZE];
+    // the socket is opened when reception starts, a client fed by a TinycarFleet has none
+    int reactorSocket = -1;
+    bool inlineDelivery = false; // reactor mode, frames are not handed to the frameComplete thread
+    uint8_t recvBuffers[RECV_BATCH_SIZE][RECV_DGRAM_SIZE];
+#ifdef __linux__
+    struct mmsghdr recvMsgs[RECV_BATCH_SIZE];
+    struct iovec recvIovecs[RECV_BATCH_SIZE];
+    // CMSG_FIRSTHDR reads a cmsghdr from the start of each buffer, CMSG_SPACE keeps the rows aligned
+    alignas(struct cmsghdr) uint8_t recvControl[RECV_BATCH_SIZE][TCFP_TIMESTAMP_CONTROL_SIZE];
+#endif
+    std::atomic<uint64_t> statDatagrams{0};
+    std::atomic<uint64_t> statSyscalls{0};
+    std::atomic<uint64_t> statFramesComplete{0};
+    std::atomic<uint64_t> statFramesIncomplete{0};
+    std::atomic<uint64_t> statFragmentsLate{0};
+    std::atomic<uint64_t> statFragmentsRecovered{0};
+    std::atomic<uint64_t> statNacksSent{0};
+    std::atomic<uint64_t> statFragmentsRetransmitted{0};
+    std::atomic<uint64_t> statReceiveCpu{0};
+    std::atomic<TCFP_ReceiveBackend> receiveBackend{TCFP_ReceiveBackend::RECVMMSG};
     std::thread listenerThread;
     std::thread frameCompleteThread;
-    std::function<void(uint8_t *data, size_t len, tcfp_sender_report_t)> framePacketCallback;
-};
\ No newline at end of file
+    std::function<void(TCFP_Frame frame)> framePacketCallback;
+    std::function<void(uint16_t, uint8_t, uint64_t)> nackCallback;
+    std::function<void(const tcfp_frame_slot_t*)> frameProgressCallback;
+    std::shared_ptr<PacketCapture> capture;
+    std::atomic<bool> retransmission{false};
+    std::atomic<uint32_t> retransmissionDeadline{DEFAULT_RETRANSMISSION_DEADLINE};
+};
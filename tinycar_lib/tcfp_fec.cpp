@@ -0,0 +1,104 @@
+#include "tcfp_fec.hpp"
+
+#include <algorithm>
+
+void tcfpFecXor(uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+    // word wise, the compiler vectorizes this
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+size_t tcfpFecEncode(const tcfp_header_t& header, const uint8_t* frame, size_t len, uint32_t stride, uint8_t group_start, uint8_t group_size, uint8_t* out) {
+    tcfp_header_t* h = reinterpret_cast<tcfp_header_t*>(out);
+    *h = header;
+    h->marker = 0;
+    h->rtt_start = 0;
+    h->fragment_offset = FEC_FRAGMENT_OFFSET;
+
+    tcfp_fec_header_t* fec = reinterpret_cast<tcfp_fec_header_t*>(out + sizeof(tcfp_header_t));
+    *fec = {0};
+    fec->group_start = group_start;
+    fec->group_size = group_size;
+    fec->fragment_stride = stride;
+
+    uint8_t* parity = out + sizeof(tcfp_header_t) + sizeof(tcfp_fec_header_t);
+    memset(parity, 0, stride);
+    for (uint32_t i = group_start; i < (uint32_t)group_start + group_size; i++) {
+        size_t offset = (size_t)i * stride;
+        if (offset >= len) {
+            break;
+        }
+        size_t fragment_len = std::min((size_t)stride, len - offset);
+        tcfpFecXor(parity, frame + offset, fragment_len);
+        fec->length_recovery ^= fragment_len;
+    }
+    return sizeof(tcfp_header_t) + sizeof(tcfp_fec_header_t) + stride;
+}
+
+int tcfpFecRecover(tcfp_frame_slot_t* frame, tcfp_fec_group_t* group) {
+    uint32_t stride = frame->fragment_stride;
+    uint32_t end = std::min((uint32_t)group->group_start + group->group_size, (uint32_t)frame->fragment_count);
+    if (!group->used || stride == 0 || group->group_start >= end) {
+        return -1;
+    }
+    int missing = -1;
+    for (uint32_t i = group->group_start; i < end; i++) {
+        if (!tcfpFragmentReceived(frame, i)) {
+            if (missing >= 0) {
+                // more than one fragment lost, wait for more
+                return -1;
+            }
+            missing = i;
+        }
+    }
+    if (missing < 0) {
+        // nothing to recover, parity not needed anymore
+        group->used = 0;
+        return -1;
+    }
+    // the length of the last fragment is only known if the marker was received
+    bool last_missing = (uint32_t)missing == (uint32_t)frame->fragment_count - 1;
+    if (!last_missing && end == frame->fragment_count && !frame->marker_received) {
+        return -1;
+    }
+
+    size_t group_index = group - frame->fec_groups;
+    uint8_t* parity = frame->parity + group_index * DGRAM_SIZE;
+    uint16_t length = group->length_recovery;
+    for (uint32_t i = group->group_start; i < end; i++) {
+        if ((int)i == missing) {
+            continue;
+        }
+        size_t offset = (size_t)i * stride;
+        size_t fragment_len = i == (uint32_t)frame->fragment_count - 1 ? frame->len - offset : stride;
+        tcfpFecXor(parity, frame->data + offset, fragment_len);
+        length ^= fragment_len;
+    }
+    if (length > stride || (!last_missing && length != stride)) {
+        // parity does not fit the frame
+        group->used = 0;
+        return -1;
+    }
+    size_t offset = (size_t)missing * stride;
+    memcpy(frame->data + offset, parity, length);
+    frame->received_fragments[missing / 64] |= (uint64_t)1 << (missing % 64);
+    frame->packets_received++;
+    frame->fragments_recovered++;
+    if (last_missing) {
+        frame->marker_received = 1;
+        frame->len = offset + length;
+    } else if (!frame->marker_received) {
+        frame->len = std::max(frame->len, (uint32_t)(offset + length));
+    }
+    group->used = 0;
+    return missing;
+}
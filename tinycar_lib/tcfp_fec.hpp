@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+
+#include "tcfp.hpp"
+
+/// @brief dst ^= src
+void tcfpFecXor(uint8_t* dst, const uint8_t* src, size_t len);
+
+/// @brief Builds the parity datagram for a group of consecutive fragments (sender side)
+/// @param header header of the frame, fragment_offset and marker are overwritten
+/// @param frame complete JPEG frame
+/// @param len length of frame
+/// @param stride payload bytes per fragment
+/// @param group_start index of the first fragment in the group
+/// @param group_size number of fragments in the group
+/// @param out buffer for the datagram, at least sizeof(tcfp_header_t) + sizeof(tcfp_fec_header_t) + stride bytes
+/// @return size of the datagram
+size_t tcfpFecEncode(const tcfp_header_t& header, const uint8_t* frame, size_t len, uint32_t stride, uint8_t group_start, uint8_t group_size, uint8_t* out);
+
+/// @brief Recovers the fragment of a group if exactly one of its fragments is missing and its parity was received (receiver side)
+/// @return index of the recovered fragment, -1 if nothing could be recovered
+int tcfpFecRecover(tcfp_frame_slot_t* frame, tcfp_fec_group_t* group);
@@ -0,0 +1,41 @@
+#include "tcfp_timestamp.hpp"
+
+int tcfpEnableTimestamps(int fd) {
+#ifdef SO_TIMESTAMPNS
+    int enabled = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enabled, sizeof(enabled));
+#else
+    return -1;
+#endif
+}
+
+TCFP_ArrivalClock::TCFP_ArrivalClock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    steady = std::chrono::steady_clock::now();
+    realtime = ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+std::chrono::steady_clock::time_point TCFP_ArrivalClock::arrival(const struct msghdr* msg) const {
+#ifdef SO_TIMESTAMPNS
+    if (msg->msg_controllen == 0) {
+        return steady;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(const_cast<struct msghdr*>(msg), cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            const struct timespec* ts = reinterpret_cast<const struct timespec*>(CMSG_DATA(cmsg));
+            int64_t age = realtime - (ts->tv_sec * 1000000000ll + ts->tv_nsec);
+            // the wall clock was set in between, then the timestamp says nothing
+            if (age < 0 || age > TCFP_TIMESTAMP_MAX_AGE * 1000000ll) {
+                return steady;
+            }
+            return steady - std::chrono::nanoseconds(age);
+        }
+    }
+#endif
+    return steady;
+}
+
+std::chrono::steady_clock::time_point TCFP_ArrivalClock::now() const {
+    return steady;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <time.h>
+#include <sys/socket.h>
+
+#define TCFP_TIMESTAMP_CONTROL_SIZE CMSG_SPACE(sizeof(struct timespec)) // control buffer per datagram for the receive timestamp
+#define TCFP_TIMESTAMP_MAX_AGE 1000 // ms, older timestamps are ignored since the wall clock was most likely set forward
+
+/// @brief Enables kernel receive timestamps (SO_TIMESTAMPNS) on a socket. Linux only.
+/// @return 0 on success, -1 if not supported. Arrival times then fall back to the time the datagram was read.
+int tcfpEnableTimestamps(int fd);
+
+/// @brief Converts kernel receive timestamps to steady_clock.
+///
+/// The kernel stamps datagrams with CLOCK_REALTIME when they arrive on the socket, before the receiving thread wakes up. Both clocks
+/// are sampled once per receive batch and only the age of a timestamp (realtime now - timestamp) is applied to steady_clock, so
+/// arrival times stay monotonic and a step of the wall clock can only affect the datagrams of a single batch.
+class TCFP_ArrivalClock {
+public:
+    /// @brief Samples both clocks, create right after the receive call returned
+    TCFP_ArrivalClock();
+    /// @brief Arrival time of a datagram from the SCM_TIMESTAMPNS message of msg, the time of the sample if there is none
+    std::chrono::steady_clock::time_point arrival(const struct msghdr* msg) const;
+    /// @brief Arrival time of a datagram that was received without timestamp
+    std::chrono::steady_clock::time_point now() const;
+private:
+    std::chrono::steady_clock::time_point steady;
+    int64_t realtime; // ns
+};
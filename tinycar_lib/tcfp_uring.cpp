@@ -0,0 +1,208 @@
+#include "tcfp_uring.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#ifdef TCFP_HAVE_IO_URING
+#include <sys/mman.h>
+#include <unistd.h>
+
+TCFP_UringReceiver::TCFP_UringReceiver() {}
+
+TCFP_UringReceiver::~TCFP_UringReceiver() {
+    cleanup();
+}
+
+void TCFP_UringReceiver::cleanup() {
+    if (ring != nullptr) {
+        munmap(ring, ringSize);
+        ring = nullptr;
+    }
+    if (sqes != nullptr) {
+        munmap(sqes, sqesSize);
+        sqes = nullptr;
+    }
+    if (ringFd >= 0) {
+        // unregisters the buffer ring as well
+        close(ringFd);
+        ringFd = -1;
+    }
+    if (bufRing != nullptr) {
+        munmap(bufRing, bufRingSize);
+        bufRing = nullptr;
+    }
+    free(buffers);
+    buffers = nullptr;
+}
+
+int TCFP_UringReceiver::init(int fd, size_t datagramSize, std::function<void(const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival)> handler) {
+    this->fd = fd;
+    bufferSize = sizeof(struct io_uring_recvmsg_out) + TCFP_TIMESTAMP_CONTROL_SIZE + datagramSize;
+    this->handler = handler;
+    memset(&msgTemplate, 0, sizeof(msgTemplate));
+    msgTemplate.msg_controllen = TCFP_TIMESTAMP_CONTROL_SIZE;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // every buffer can be waiting in the completion queue at once
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_BUFFER_COUNT * 2;
+    ringFd = syscall(__NR_io_uring_setup, 4, &params);
+    if (ringFd < 0) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cleanup();
+        return -1;
+    }
+
+    ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    ring = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        ring = nullptr;
+        cleanup();
+        return -1;
+    }
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe*)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        sqes = nullptr;
+        cleanup();
+        return -1;
+    }
+    uint8_t* base = (uint8_t*)ring;
+    sqTail = (uint32_t*)(base + params.sq_off.tail);
+    sqMask = (uint32_t*)(base + params.sq_off.ring_mask);
+    sqArray = (uint32_t*)(base + params.sq_off.array);
+    cqHead = (uint32_t*)(base + params.cq_off.head);
+    cqTail = (uint32_t*)(base + params.cq_off.tail);
+    cqMask = (uint32_t*)(base + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+    // the buffer ring has to be page aligned
+    bufRingSize = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    bufRing = (struct io_uring_buf_ring*)mmap(nullptr, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufRing == MAP_FAILED) {
+        bufRing = nullptr;
+        cleanup();
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)bufRing;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        cleanup();
+        return -1;
+    }
+    buffers = (uint8_t*)malloc(URING_BUFFER_COUNT * bufferSize);
+    for (uint16_t i = 0; i < URING_BUFFER_COUNT; i++) {
+        provideBuffer(i);
+    }
+    __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+
+    submitReceive();
+    return 0;
+}
+
+void TCFP_UringReceiver::provideBuffer(uint16_t bid) {
+    // not bufRing->bufs, in C++ the flexible array member of the kernel header ends up at offset 8 instead of 0
+    struct io_uring_buf* buf = reinterpret_cast<struct io_uring_buf*>(bufRing) + (bufTail & (URING_BUFFER_COUNT - 1));
+    buf->addr = (uint64_t)(buffers + bid * bufferSize);
+    buf->len = bufferSize;
+    buf->bid = bid;
+    bufTail++;
+}
+
+void TCFP_UringReceiver::submitReceive() {
+    uint32_t tail = *sqTail;
+    uint32_t index = tail & *sqMask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)&msgTemplate;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    // submitted with the next wait
+    toSubmit++;
+}
+
+int TCFP_UringReceiver::receive() {
+    int ret = syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (ret < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    toSubmit = 0;
+
+    int count = 0;
+    int error = 0;
+    bool rearm = false;
+    uint32_t head = *cqHead;
+    uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    TCFP_ArrivalClock clock;
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &cqes[head & *cqMask];
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe->res >= 0) {
+                // io_uring_recvmsg_out, then the name (none requested), the control messages and the payload
+                uint8_t* buffer = buffers + bid * bufferSize;
+                struct io_uring_recvmsg_out* out = reinterpret_cast<struct io_uring_recvmsg_out*>(buffer);
+                uint8_t* control = buffer + sizeof(struct io_uring_recvmsg_out) + msgTemplate.msg_namelen;
+                uint8_t* payload = control + msgTemplate.msg_controllen;
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_control = control;
+                msg.msg_controllen = out->controllen;
+                size_t n = std::min((size_t)out->payloadlen, (size_t)(buffer + cqe->res - payload));
+                handler(payload, n, clock.arrival(&msg));
+                count++;
+            }
+            provideBuffer(bid);
+        } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+            error = -cqe->res;
+        }
+        // the kernel ends the multishot receive on errors, e.g. if it ran out of buffers. Datagrams stay in the socket until it is armed again.
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            rearm = true;
+        }
+        head++;
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    if (rearm) {
+        submitReceive();
+    }
+    return count;
+}
+
+#else
+
+TCFP_UringReceiver::TCFP_UringReceiver() {}
+
+TCFP_UringReceiver::~TCFP_UringReceiver() {}
+
+int TCFP_UringReceiver::init(int fd, size_t datagramSize, std::function<void(const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival)> handler) {
+    return -1;
+}
+
+int TCFP_UringReceiver::receive() {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <functional>
+#include <chrono>
+
+#include "tcfp_timestamp.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+// multishot receive (kernel 6.0) and provided buffer rings (kernel 5.19) must be known to the headers. The running kernel is checked in init()
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define TCFP_HAVE_IO_URING
+#endif
+#endif
+
+#define URING_BUFFER_COUNT 256 // provided receive buffers, must be a power of 2
+#define URING_BUFFER_GROUP 0
+
+/// @brief Receives datagrams of a socket with io_uring.
+///
+/// A single multishot recvmsg stays armed on the socket and the kernel places every datagram into one of the provided buffers
+/// of a buffer ring, together with its receive timestamp if the socket has them enabled (see tcfpEnableTimestamps). Waiting for
+/// completions is the only syscall, no matter how many datagrams arrived in the meantime.
+/// Buffers are handed back to the kernel right after the handler returned. Uses the raw syscalls, liburing is not needed.
+class TCFP_UringReceiver {
+public:
+    TCFP_UringReceiver();
+    ~TCFP_UringReceiver();
+
+    /// @brief Sets up the ring, registers the receive buffers and arms the receive on fd
+    /// @param datagramSize largest datagram, larger datagrams are truncated
+    /// @param handler called for every datagram with its arrival time (see TCFP_ArrivalClock)
+    /// @return 0 on success, -1 if io_uring is not available (not compiled in, kernel too old or forbidden)
+    int init(int fd, size_t datagramSize, std::function<void(const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival)> handler);
+    /// @brief Waits until at least one datagram was received and hands all received datagrams to the handler
+    /// @return number of datagrams, -1 on error (see errno). EINVAL here means the kernel does not support multishot receive.
+    int receive();
+private:
+    std::function<void(const uint8_t* buffer, size_t n, std::chrono::steady_clock::time_point arrival)> handler;
+#ifdef TCFP_HAVE_IO_URING
+    void submitReceive();
+    void provideBuffer(uint16_t bid);
+    void cleanup();
+
+    int fd = -1;
+    int ringFd = -1;
+    void* ring = nullptr; // submission and completion ring share one mapping
+    size_t ringSize = 0;
+    struct io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+    uint32_t* sqTail;
+    uint32_t* sqMask;
+    uint32_t* sqArray;
+    uint32_t toSubmit = 0;
+    uint32_t* cqHead;
+    uint32_t* cqTail;
+    uint32_t* cqMask;
+    struct io_uring_cqe* cqes;
+
+    struct io_uring_buf_ring* bufRing = nullptr;
+    size_t bufRingSize = 0;
+    uint16_t bufTail = 0;
+    uint8_t* buffers = nullptr;
+    size_t bufferSize = 0; // io_uring_recvmsg_out, control messages and the datagram
+    struct msghdr msgTemplate; // tells the kernel how much space the control messages get in every buffer
+#endif
+};
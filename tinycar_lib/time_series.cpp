@@ -0,0 +1,69 @@
+#include "time_series.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+TimeSeries::TimeSeries(size_t capacity): values(std::max<size_t>(capacity, 1)), scratch(std::max<size_t>(capacity, 1)) {}
+
+void TimeSeries::add(float value) {
+    std::lock_guard<std::mutex> lk(m);
+    values[next] = value;
+    next = (next + 1) % values.size();
+    size = std::min(size + 1, values.size());
+    total++;
+}
+
+void TimeSeries::getValues(std::vector<float>& out) {
+    std::lock_guard<std::mutex> lk(m);
+    out.resize(size);
+    size_t first = (next + values.size() - size) % values.size();
+    for (size_t i = 0; i < size; i++) {
+        out[i] = values[(first + i) % values.size()];
+    }
+}
+
+time_series_stats_t TimeSeries::getStats() {
+    std::lock_guard<std::mutex> lk(m);
+    time_series_stats_t stats = {0};
+    stats.count = size;
+    if (size == 0) {
+        return stats;
+    }
+    stats.last = values[(next + values.size() - 1) % values.size()];
+    // the window is not in order once the ring wrapped, which does not matter for the statistics
+    double sum = 0.0;
+    for (size_t i = 0; i < size; i++) {
+        scratch[i] = values[i];
+        sum += values[i];
+    }
+    stats.mean = sum / size;
+    auto begin = scratch.begin();
+    auto end = begin + size;
+    stats.min = *std::min_element(begin, end);
+    stats.max = *std::max_element(begin, end);
+    // nearest rank, each nth_element only partitions the part above the previous percentile
+    auto percentile = [&](double p, std::vector<float>::iterator from) {
+        size_t index = (size_t)std::max(0.0, std::ceil(p / 100.0 * size) - 1);
+        auto nth = begin + index;
+        std::nth_element(from, nth, end);
+        return nth;
+    };
+    auto p50 = percentile(50.0, begin);
+    stats.p50 = *p50;
+    auto p95 = percentile(95.0, p50);
+    stats.p95 = *p95;
+    stats.p99 = *percentile(99.0, p95);
+    return stats;
+}
+
+uint64_t TimeSeries::getTotalCount() {
+    std::lock_guard<std::mutex> lk(m);
+    return total;
+}
+
+void TimeSeries::clear() {
+    std::lock_guard<std::mutex> lk(m);
+    next = 0;
+    size = 0;
+    total = 0;
+}
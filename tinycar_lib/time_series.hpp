@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+
+#define TIME_SERIES_DEFAULT_CAPACITY 512 // samples, about 17 s of per frame metrics at 30 fps
+
+typedef struct {
+    size_t count; // samples in the window
+    float last;
+    float mean;
+    float min;
+    float max;
+    float p50;
+    float p95;
+    float p99;
+} time_series_stats_t;
+
+/// @brief Ring buffer of the last samples of a metric, with percentiles over that window.
+///
+/// The memory is allocated once in the constructor, adding a sample never allocates. Percentiles use the nearest rank on a copy
+/// of the window (partially sorted with nth_element), so they cost O(capacity) per call and are meant to be read at GUI rate.
+/// Thread safe, samples are usually added on a network thread and read by the GUI.
+class TimeSeries {
+public:
+    TimeSeries(size_t capacity = TIME_SERIES_DEFAULT_CAPACITY);
+
+    void add(float value);
+    /// @brief Copies the window to out, oldest sample first
+    void getValues(std::vector<float>& out);
+    time_series_stats_t getStats();
+    /// @brief Samples added since construction or the last clear, including the ones that left the window
+    uint64_t getTotalCount();
+    void clear();
+private:
+    std::mutex m;
+    std::vector<float> values;
+    std::vector<float> scratch; // for the percentiles
+    size_t next = 0; // index the next sample is written to
+    size_t size = 0;
+    uint64_t total = 0;
+};
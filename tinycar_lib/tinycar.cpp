@@ -1,30 +1,195 @@
 #include "tinycar.hpp"
 
-Tinycar::Tinycar(const std::string& hostname): tccp_client(hostname), hostname(hostname), telemetryListenerRunning(false), tcfp_client() {
+#include <cmath>
+#include <algorithm>
+
+Tinycar::Tinycar(const std::string& hostname, const tinycar_options_t& options): tccp_client(hostname, options.carControlPort), hostname(hostname), options(options), telemetryListenerRunning(false), tcfp_client() {
     last_control_message = {0};
     last_control_message.header.type = TCCP_TYPE_CONTROL;
-    frameMatPulled = true;
+    // decoded frames are recycled once nobody references them anymore
+    decodePool.setAllocator(FrameBufferPool::getInstance());
+    decodePool.registerDeliveryCallback([this](decoded_frame_t& frame) { deliverFrame(frame); });
 
-    tcfp_client.registerFramePacketCallback(std::bind(&Tinycar::tcfpFramePacketCallback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+    tcfp_client.registerFramePacketCallback([this](TCFP_Frame frame) { tcfpFramePacketCallback(std::move(frame)); });
+    tcfp_client.registerFrameProgressCallback([this](const tcfp_frame_slot_t* frame) { decodePool.progress(frame); });
     tccp_client.registerRTTCallback(std::bind(&Tinycar::tccpRTTCallback, this, std::placeholders::_1));
-    tcfp_client.startListener();
+    tccp_client.registerTelemetryCallback(std::bind(&Tinycar::tccpTelemetryCallback, this, std::placeholders::_1));
+    tcfp_client.registerNackCallback([this](uint16_t frame_num, uint8_t first_fragment, uint64_t fragment_mask) {
+        tccp_client.sendNackMessage(frame_num, first_fragment, fragment_mask);
+    });
+    if (!options.capturePath.empty() && !options.sharedNetwork) {
+        capture = std::make_shared<PacketCapture>();
+        if (capture->open(options.capturePath) == 0) {
+            tcfp_client.setCapture(capture);
+            tccp_client.setCapture(capture);
+        }
+    }
+}
+
+void Tinycar::start() {
+    if (started) {
+        return;
+    }
+    started = true;
+    if (options.sharedNetwork) {
+        // the fleet feeds datagrams and decodes frames on its own threads
+        tcfp_client.startExternal();
+        telemetryListenerRunning = true;
+    } else if (options.useReactor) {
+        reactor = std::make_unique<NetReactor>();
+        tcfp_client.attach(*reactor);
+        tccp_client.attach(*reactor);
+        telemetryListenerRunning = true;
+        reactor->addTimer(ANTISPAM_DELAY, [this]() { flushControlMessage(); });
+        reactor->addTimer(ALIVE_CHECK_INTERVAL, [this]() { checkAlive(); });
+        reactor->start(options.reactorCpu);
+    } else {
+        tcfp_client.setReceiveBackend(options.receiveBackend);
+        tcfp_client.startListener();
+    }
 }
 
 int Tinycar::getImage(cv::Mat& out) {
-    if (!frameMatPulled) {
-        out = frameMat;
-        frameMatPulled = true;
+    if (playoutEnabled) {
+        return playoutBuffer.pop(out, std::chrono::steady_clock::now());
+    }
+    mailbox_frame_t frame;
+    if (frameMailbox.tryTake(frame)) {
+        out = frame.image;
+        return true;
+    }
+    return false;
+}
+
+bool Tinycar::waitForImage(cv::Mat& out, uint32_t timeout) {
+    if (playoutEnabled) {
+        return playoutBuffer.waitPop(out, std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout));
+    }
+    mailbox_frame_t frame;
+    if (frameMailbox.waitTake(frame, std::chrono::milliseconds(timeout))) {
+        out = frame.image;
         return true;
     }
     return false;
 }
 
+uint64_t Tinycar::getSkippedFrameCount() {
+    return frameMailbox.getDroppedCount();
+}
+
 double Tinycar::getFPS() {
     return current_fps;
 }
 
+tcfp_receive_stats_t Tinycar::getReceiveStats() {
+    return tcfp_client.getReceiveStats();
+}
+
+void Tinycar::setPlayoutLatency(uint32_t latencyTarget, bool adaptive) {
+    playoutBuffer.setLatencyTarget(latencyTarget);
+    playoutBuffer.setAdaptive(adaptive);
+    playoutBuffer.reset();
+    playoutEnabled = latencyTarget > 0;
+}
+
+bool Tinycar::isPlayoutEnabled() {
+    return playoutEnabled;
+}
+
+playout_stats_t Tinycar::getPlayoutStats() {
+    return playoutBuffer.getStats();
+}
+
+void Tinycar::setErrorConcealment(bool enabled) {
+    errorConcealment = enabled;
+}
+
+uint64_t Tinycar::getConcealedFrameCount() {
+    return concealed_frames;
+}
+
+void Tinycar::setDecodeRegion(const jpeg_decode_region_t& region) {
+    decodePool.setRegion(region);
+}
+
+void Tinycar::setDecodeWorkers(int workers, bool latestWins) {
+    decodePool.start(workers, latestWins);
+}
+
+void Tinycar::setStreamingDecode(bool enabled) {
+    decodePool.setStreaming(enabled);
+}
+
+bool Tinycar::isStreamingDecode() {
+    return decodePool.isStreaming();
+}
+
+int Tinycar::getDecodeWorkerCount() {
+    return decodePool.getWorkerCount();
+}
+
+decode_pool_stats_t Tinycar::getDecodeStats() {
+    return decodePool.getStats();
+}
+
+void Tinycar::setRetransmission(bool enabled, uint32_t deadline) {
+    tcfp_client.setRetransmission(enabled, deadline);
+}
+
+void Tinycar::setStreamControl(uint32_t latencyTarget) {
+    streamController.setLatencyTarget(latencyTarget);
+    streamController.reset();
+    streamControlEnabled = latencyTarget > 0;
+}
+
+bool Tinycar::isStreamControlEnabled() {
+    return streamControlEnabled;
+}
+
+stream_control_stats_t Tinycar::getStreamControlStats() {
+    return streamController.getStats();
+}
+
 ////// CONTROL FUNCTIONS
 
+void Tinycar::startControlLoop(uint32_t rate, bool realtime) {
+    if (!telemetryListenerRunning) {
+        tccp_client.startListener();
+        telemetryListenerRunning = true;
+    }
+    uint64_t setpoint = 0;
+    memcpy(&setpoint, &last_control_message, sizeof(last_control_message));
+    controlSetpoint.store(setpoint, std::memory_order_release);
+    controlLoop.start(rate, [this]() { controlTick(); }, realtime);
+}
+
+void Tinycar::stopControlLoop() {
+    controlLoop.stop();
+}
+
+bool Tinycar::isControlLoopRunning() {
+    return controlLoop.isRunning();
+}
+
+uint32_t Tinycar::getControlLoopRate() {
+    return controlLoop.getRate();
+}
+
+control_loop_stats_t Tinycar::getControlLoopStats() {
+    return controlLoop.getStats();
+}
+
+void Tinycar::setSequencedControl(bool enabled, uint8_t copies, uint32_t spacing) {
+    tccp_client.setSequencedControl(enabled, copies, spacing);
+}
+
+void Tinycar::controlTick() {
+    uint64_t setpoint = controlSetpoint.load(std::memory_order_acquire);
+    tccp_control_t message;
+    memcpy(&message, &setpoint, sizeof(message));
+    tccp_client.sendControlMessage(&message);
+}
+
 void Tinycar::setMotorDutyCycle(int16_t dutyCycle) {
     last_control_message.motor_duty_cycle = dutyCycle;
     sendControlMessage();
@@ -86,28 +251,47 @@ void Tinycar::setTaillightBrake() {
 }
 
 bool Tinycar::isAlive() {
+    if (reactor) {
+        return alive;
+    }
     // check alive status by checking if last message was sent less than 1 second ago
-    auto now = std::chrono::system_clock::now();
+    auto now = std::chrono::steady_clock::now();
     auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_telemetry_time);
     return diff.count() < ALIVE_TIMEOUT;
 }
 
 void Tinycar::registerTelemetryCallback(std::function<void(TinycarTelemetry)> callback) {
-    tccp_client.registerTelemetryCallback([=](tccp_telemetry_t telemetry) {
-        // setting internal state
-        current_fps = telemetry.current_fps;
-        // prepare telemetry message
-        last_telemetry_time = std::chrono::system_clock::now();
-        TinycarTelemetry tinycarTelemetry;
-        tinycarTelemetry.battery_voltage = telemetry.battery_voltage;
-        tinycarTelemetry.current_fps = telemetry.current_fps;
-        tinycarTelemetry.interarrival_jitter = this->jitter;
-        tinycarTelemetry.packet_loss_percentage = this->packet_loss_percentage;
-        tinycarTelemetry.packets_per_frame = this->packets_per_frame;
-        tinycarTelemetry.wifi_rssi = telemetry.wifi_rssi;
-        tinycarTelemetry.frame_latency = this->frame_latency + telemetry.min_frame_latency;
-        callback(tinycarTelemetry);
-    });
+    std::lock_guard<std::mutex> lk(telemetry_m);
+    telemetryCallback = callback;
+}
+
+TimeSeries& Tinycar::getMetric(TinycarMetric metric) {
+    return metrics[(size_t)metric];
+}
+
+void Tinycar::tccpTelemetryCallback(tccp_telemetry_t telemetry) {
+    // setting internal state
+    current_fps = telemetry.current_fps;
+    // prepare telemetry message
+    last_telemetry_time = std::chrono::steady_clock::now();
+    TinycarTelemetry tinycarTelemetry;
+    tinycarTelemetry.battery_voltage = telemetry.battery_voltage;
+    tinycarTelemetry.current_fps = telemetry.current_fps;
+    tinycarTelemetry.interarrival_jitter = this->jitter;
+    tinycarTelemetry.packet_loss_percentage = this->packet_loss_percentage;
+    tinycarTelemetry.packets_per_frame = this->packets_per_frame;
+    tinycarTelemetry.wifi_rssi = telemetry.wifi_rssi;
+    tinycarTelemetry.frame_latency = this->frame_latency + telemetry.min_frame_latency;
+
+    getMetric(TinycarMetric::FRAME_LATENCY).add(tinycarTelemetry.frame_latency);
+    getMetric(TinycarMetric::BATTERY_VOLTAGE).add(telemetry.battery_voltage / 1000.0f);
+    getMetric(TinycarMetric::WIFI_RSSI).add(telemetry.wifi_rssi);
+    getMetric(TinycarMetric::CAR_FPS).add(telemetry.current_fps);
+
+    std::lock_guard<std::mutex> lk(telemetry_m);
+    if (telemetryCallback) {
+        telemetryCallback(tinycarTelemetry);
+    }
 }
 
 void Tinycar::sendControlMessage() {
@@ -116,67 +300,181 @@ void Tinycar::sendControlMessage() {
         tccp_client.startListener();
         telemetryListenerRunning = true;
     }
+    if (controlLoop.isRunning()) {
+        uint64_t setpoint = 0;
+        memcpy(&setpoint, &last_control_message, sizeof(last_control_message));
+        controlSetpoint.store(setpoint, std::memory_order_release);
+        return;
+    }
+    // the reactor thread sends held back messages, so the timing state is shared with it
+    std::unique_lock<std::mutex> lk(control_m, std::defer_lock);
+    if (reactor) {
+        lk.lock();
+    }
     // Check if we are spamming
-    auto now = std::chrono::system_clock::now();
+    auto now = std::chrono::steady_clock::now();
     auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_message_time);
     if (diff.count() < ANTISPAM_DELAY) {
+        if (reactor) {
+            // sent by the reactor once the delay passed, so the last change is never lost
+            pending_control_message = last_control_message;
+            control_pending = true;
+        }
         return;
     }
     tccp_client.sendControlMessage(&last_control_message);
-    last_message_time = std::chrono::system_clock::now();
+    last_message_time = std::chrono::steady_clock::now();
+    control_pending = false;
+}
+
+void Tinycar::flushControlMessage() {
+    std::lock_guard<std::mutex> lk(control_m);
+    if (!control_pending) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (std::chrono::duration_cast<std::chrono::milliseconds>(now - last_message_time).count() < ANTISPAM_DELAY) {
+        return;
+    }
+    tccp_client.sendControlMessage(&pending_control_message);
+    last_message_time = now;
+    control_pending = false;
+}
+
+void Tinycar::checkAlive() {
+    auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_telemetry_time);
+    bool isAlive = diff.count() < ALIVE_TIMEOUT;
+    if (isAlive != alive) {
+        if (isAlive) {
+            std::cout << "\033[1;32m[Tinycar] Info: Tinycar is online." << "\033[0m" << std::endl;
+        } else {
+            std::cout << "\033[1;33m[Tinycar] Warning: Tinycar is offline. No telemetry for " << ALIVE_TIMEOUT << " ms" << "\033[0m" << std::endl;
+        }
+        alive = isAlive;
+    }
 }
 
 void Tinycar::tccpRTTCallback(uint32_t timestamp) {
-    uint32_t diff_frame_rtt = timestamp - last_rtt_frame_timestamp; // difference between frame sending and receiving our rtt message
-    auto now = std::chrono::system_clock::now();
-    uint32_t diff = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_rtt_start_time).count();
-    uint32_t latency_for_rtt_message = diff/2; // we assume that the rtt message latency is the same in both directions
-    frame_latency = diff_frame_rtt - latency_for_rtt_message;
+    clockSync.replyReceived(timestamp, receiveTime());
 }
 
-void Tinycar::tcfpFramePacketCallback(uint8_t *data, size_t len, tcfp_sender_report_t senderReport) {
+std::chrono::steady_clock::time_point Tinycar::receiveTime() {
+    return replayClock ? replayTime : std::chrono::steady_clock::now();
+}
+
+uint32_t Tinycar::getFrameLatency() {
+    return frame_latency;
+}
+
+clock_sync_stats_t Tinycar::getClockSyncStats() {
+    return clockSync.getStats();
+}
+
+void Tinycar::tcfpFramePacketCallback(TCFP_Frame frame) {
+    const tcfp_sender_report_t& senderReport = frame->senderReport;
+    // too far behind to be late, the car restarted and its frame_num started over
+    if (frame_submitted && tcfpFrameNumBefore(senderReport.frame_num, last_submitted_frame_num)
+        && (uint16_t)(last_submitted_frame_num - senderReport.frame_num) > FRAME_RESTART_DISTANCE) {
+        std::cout << "\033[1;33m[Tinycar] Warning: frame number jumped back from " << last_submitted_frame_num << " to " << senderReport.frame_num << ", the stream started over" << "\033[0m" << std::endl;
+        senderRestarted();
+    }
     // do some analysis on the sender report to send new control messages for frame rate control
-    // calculate jitter
+    // calculate jitter from the kernel receive time of the first fragment, so it reflects the network and not the scheduler
     if (last_sender_timestamp != 0 && last_arrival_time.time_since_epoch().count() != 0) {
-        auto arrival_time = std::chrono::system_clock::now();
-        double D = std::chrono::duration_cast<std::chrono::milliseconds>(arrival_time - last_arrival_time).count()  - (senderReport.timestamp - last_sender_timestamp);
+        double D = std::chrono::duration<double, std::milli>(senderReport.first_arrival - last_arrival_time).count() - (int32_t)(senderReport.timestamp - last_sender_timestamp);
         jitter += (std::abs(D) - jitter) / 16.0;
+        getMetric(TinycarMetric::JITTER).add(std::abs(D));
     }
 
     last_sender_timestamp = senderReport.timestamp;
-    last_arrival_time = std::chrono::system_clock::now();
+    last_arrival_time = senderReport.first_arrival;
 
     // for packet loss calculation
+    auto now = receiveTime();
     if (last_packet_loss_calculation.time_since_epoch().count() == 0) {
-        last_packet_loss_calculation = std::chrono::system_clock::now();
+        last_packet_loss_calculation = now;
     }
     total_expected_packets += senderReport.fragement_count;
-    total_received_packets += senderReport.fragments_included;
-    auto now = std::chrono::system_clock::now();
+    // fragments recovered by FEC were lost on the network
+    total_received_packets += senderReport.fragments_included - senderReport.fragments_recovered;
     auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_packet_loss_calculation);
     // since telemetry is updated every 2 s, we measure packet loss for 2s
     if (diff.count() > 2000) {
         packet_loss_percentage = 100.0 * (1.0 - (double)total_received_packets / (double)total_expected_packets);
-        last_packet_loss_calculation = std::chrono::system_clock::now();
+        last_packet_loss_calculation = now;
         total_expected_packets = 0;
         total_received_packets = 0;
     }
 
 
     packets_per_frame = senderReport.fragement_count;
+    getMetric(TinycarMetric::FRAGMENTS_PER_FRAME).add(senderReport.fragement_count);
+    if (senderReport.fragement_count > 0) {
+        uint8_t lost = senderReport.fragement_count - (senderReport.fragments_included - senderReport.fragments_recovered);
+        getMetric(TinycarMetric::PACKET_LOSS).add(100.0f * lost / senderReport.fragement_count);
+    }
+
+    if (streamControlEnabled) {
+        streamController.onFrame(senderReport.fragement_count, senderReport.fragments_included - senderReport.fragments_recovered, senderReport.timestamp, senderReport.first_arrival);
+        tccp_stream_control_t stream_control_msg;
+        if (streamController.update(now, stream_control_msg)) {
+            tccp_client.sendStreamControlMessage(&stream_control_msg);
+        }
+    }
+    // every frame gets its own latency once the clocks are synchronized, up to the arrival of its last fragment
+    double latency;
+    if (clockSync.latency(senderReport.timestamp, senderReport.last_arrival, latency)) {
+        frame_latency = std::max(0.0, std::round(latency));
+        getMetric(TinycarMetric::NETWORK_LATENCY).add(latency);
+        streamController.onFrameLatency(frame_latency);
+    }
     // send rtt message
     if (senderReport.start_rtt) {
-        last_rtt_frame_timestamp = senderReport.timestamp;
-        last_rtt_start_time = std::chrono::system_clock::now();
+        clockSync.probeSent(now);
         tccp_client.sendRTTMessage();
     }
 
-    // decode image
-    if (senderReport.fragments_included == senderReport.fragement_count && len > 0) {
-        frameMat = cv::imdecode(cv::Mat(len, 1, CV_8UC1, data), cv::IMREAD_COLOR);
-        cv::flip(frameMat, frameMat, -1);
-        frameMatPulled = false;
+    // frames are delivered in order of completion, never show an older frame after a newer one
+    if (frame_submitted && tcfpFrameNumBefore(senderReport.frame_num, last_submitted_frame_num)) {
+        return;
+    }
+    last_submitted_frame_num = senderReport.frame_num;
+    frame_submitted = true;
+    // decoded here or on the decode workers, delivered in this order to deliverFrame
+    decodePool.submit(std::move(frame), errorConcealment);
+}
+
+void Tinycar::senderRestarted() {
+    frame_submitted = false;
+    // the sender clock started over as well, no interarrival difference across the restart
+    last_sender_timestamp = 0;
+    last_arrival_time = std::chrono::steady_clock::time_point();
+    last_packet_loss_calculation = std::chrono::steady_clock::time_point();
+    total_expected_packets = 0;
+    total_received_packets = 0;
+}
+
+void Tinycar::resetReceiveState() {
+    tcfp_client.reset();
+    senderRestarted();
+    jitter = 0.0;
+    frame_latency = 0;
+    playoutBuffer.reset();
+    clockSync.reset();
+    streamController.reset();
+}
+
+void Tinycar::deliverFrame(decoded_frame_t& frame) {
+    if (frame.concealed) {
+        // rows that are missing are taken from the last frame, a frame of another region is skipped by conceal
+        JpegDecoder::conceal(frame.image, lastImage, frame.validRows);
+        concealed_frames++;
+    }
+    if (playoutEnabled) {
+        // the consumer pops on the wall clock, the capture clock of a replay drifts away from it at any other speed than 1
+        playoutBuffer.push(frame.image, frame.timestamp, replayClock ? std::chrono::steady_clock::now() : frame.arrival);
     } else {
-        printf("Did not receive all fragments to decode image\n");
+        frameMailbox.publish(frame.image, frame.frame_num, frame.timestamp);
     }
+    lastImage = frame.image;
 }
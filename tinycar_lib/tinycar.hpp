@@ -5,14 +5,54 @@
 #include <string>
 #include <chrono>
 #include <functional>
+#include <memory>
+#include <mutex>
 
 #include "tccp.hpp"
 #include "tcfp.hpp"
+#include "playout_buffer.hpp"
+#include "frame_mailbox.hpp"
+#include "jpeg_decoder.hpp"
+#include "decode_pool.hpp"
+#include "frame_buffer_pool.hpp"
+#include "net_reactor.hpp"
+#include "stream_controller.hpp"
+#include "clock_sync.hpp"
+#include "control_loop.hpp"
+#include "time_series.hpp"
 
 #define ANTISPAM_DELAY 20 // ms; Hardware is not faster anyway
 #define ALIVE_TIMEOUT 2300 // ms; Usually telemetry is sent every 2 seconds
+#define ALIVE_CHECK_INTERVAL 250 // ms; reactor mode only
 
 #define MAX_NUM_PACKETS_PER_FRAME 124
+#define FRAME_RESTART_DISTANCE (MAX_FRAMES_IN_FLIGHT + DECODE_POOL_PENDING) // frames; a frame further behind the last submitted one means the car started over
+
+/// @brief Options that have to be known before the network is started
+typedef struct {
+    bool useReactor = false; // handle both protocols on a single network thread (see NetReactor) instead of one listener thread each plus the frame thread
+    int reactorCpu = -1; // core the network thread is pinned to, -1 to not pin it
+    TCFP_ReceiveBackend receiveBackend = TCFP_ReceiveBackend::RECVMMSG; // frame stream receive backend, threaded mode only
+    bool sharedNetwork = false; // sockets and threads are owned by a TinycarFleet or TinycarReplay, nothing is started by the car itself
+    uint16_t carControlPort = TCCP_PORT; // port the car receives TCCP messages on, only differs for an emulator on the same host
+    std::string capturePath; // records every received datagram to this file for TinycarReplay, empty = off. Ignored with sharedNetwork
+} tinycar_options_t;
+
+class TinycarFleet;
+class TinycarReplay;
+
+/// @brief Metrics that are kept as TimeSeries. Per frame metrics get a sample for every frame, the others for every telemetry message.
+enum class TinycarMetric {
+    JITTER, // ms, per frame deviation of the interarrival time from the sender timestamps
+    FRAGMENTS_PER_FRAME, // per frame
+    PACKET_LOSS, // percent of the fragments of a frame that were lost on the network, per frame
+    NETWORK_LATENCY, // ms, sending to completion of a frame, per frame once the clocks are synchronized
+    FRAME_LATENCY, // ms, network latency plus the time the car needs for a frame, telemetry
+    BATTERY_VOLTAGE, // V, telemetry
+    WIFI_RSSI, // dBm, telemetry
+    CAR_FPS, // telemetry
+    COUNT
+};
 
 typedef struct {
     uint16_t battery_voltage;
@@ -26,11 +66,74 @@ typedef struct {
 
 class Tinycar {
 public:
-    Tinycar(const std::string& hostname);
+    Tinycar(const std::string& hostname, const tinycar_options_t& options = tinycar_options_t());
+    /// @brief Starts receiving from the car. The network threads call the registered callbacks from now on, so register them before.
+    /// With sharedNetwork nothing is started, the TinycarFleet or TinycarReplay calls this itself.
+    void start();
     // Getter
+    /// @brief Latest frame that was not pulled yet (or the due frame of the playout buffer). Never blocks. Call from one thread only.
     int getImage(cv::Mat& out);
+    /// @brief Like getImage, but sleeps until a frame is available or timeout ms passed
+    /// @return true if out holds a new frame
+    bool waitForImage(cv::Mat& out, uint32_t timeout);
+    /// @brief Decoded frames that were replaced by a newer one before they were pulled
+    uint64_t getSkippedFrameCount();
     double getFPS();
+    tcfp_receive_stats_t getReceiveStats();
+
+    /// @brief Enables the playout buffer. Frames are then released on a smoothed schedule derived from the sender timestamp instead of when they complete.
+    /// @param latencyTarget maximal delay in ms a frame is held back, 0 disables the buffer
+    /// @param adaptive if true the delay follows the measured jitter up to latencyTarget, otherwise latencyTarget is used as fixed delay
+    void setPlayoutLatency(uint32_t latencyTarget, bool adaptive = true);
+    bool isPlayoutEnabled();
+    playout_stats_t getPlayoutStats();
+
+    /// @brief If enabled, frames with missing fragments are decoded as far as possible and the missing rows are filled from the previous frame. Enabled by default.
+    void setErrorConcealment(bool enabled);
+    /// @brief Number of frames that were shown with concealed rows
+    uint64_t getConcealedFrameCount();
+    /// @brief Decodes only a region of the frames, at the lowest resolution that still covers region.minSize (see JpegDecoder).
+    /// getImage then returns the region. The default is the full frame rotated by 180°.
+    void setDecodeRegion(const jpeg_decode_region_t& region);
+    /// @brief Decodes frames on a pool of worker threads instead of the frame thread, so a slow decode does not hold up reception (see DecodePool).
+    /// Frames are still delivered in order.
+    /// @param workers 0 decodes on the frame thread again (default)
+    /// @param latestWins a decoded frame is delivered right away and older frames that are still decoding are dropped
+    void setDecodeWorkers(int workers, bool latestWins = false);
+    int getDecodeWorkerCount();
+    /// @brief Decodes the newest frame while its fragments arrive, on the thread that receives them. When the last fragment
+    /// arrives only the tail of the frame is left to decode, which shortens the time from capture to getImage.
+    void setStreamingDecode(bool enabled);
+    bool isStreamingDecode();
+    decode_pool_stats_t getDecodeStats();
+
+    /// @brief If enabled, missing fragments are requested again from the car with a NACK. Incomplete frames are held back for at most deadline ms.
+    void setRetransmission(bool enabled, uint32_t deadline = DEFAULT_RETRANSMISSION_DEADLINE);
+
+    /// @brief Enables the congestion controller. It asks the car for lower JPEG quality or resolution under loss or growing queues and raises it again on a clean link.
+    /// @param latencyTarget frame latency in ms the controller aims for, 0 disables it
+    void setStreamControl(uint32_t latencyTarget);
+    bool isStreamControlEnabled();
+    stream_control_stats_t getStreamControlStats();
+
+    /// @brief Time from sending to reception of the last frame in ms, measured on the clock of the car mapped to host time (see ClockSync)
+    uint32_t getFrameLatency();
+    clock_sync_stats_t getClockSyncStats();
     
+    /// @brief Sends the control state at a fixed rate from its own thread. The setters below then only update the state, which is
+    /// handed to the thread lock-free, and the anti spam delay no longer applies.
+    /// @param rate in Hz
+    /// @param realtime run the thread with realtime priority if permitted (Linux)
+    void startControlLoop(uint32_t rate = CONTROL_LOOP_DEFAULT_RATE, bool realtime = false);
+    void stopControlLoop();
+    bool isControlLoopRunning();
+    uint32_t getControlLoopRate();
+    control_loop_stats_t getControlLoopStats();
+    /// @brief Sends control messages with a sequence number, so the car drops messages that were overtaken by a newer one.
+    /// Needs a car firmware that knows tccp_sequenced_control_t.
+    /// @param copies transmissions per message, spaced spacing ms apart, so a single lost datagram does not leave a stale setpoint
+    void setSequencedControl(bool enabled, uint8_t copies = 1, uint32_t spacing = TCCP_CONTROL_COPY_SPACING);
+
     void setMotorDutyCycle(int16_t dutyCycle);
     void setServoAngle(uint16_t angle);
 
@@ -47,41 +150,93 @@ public:
     void setTaillightOn();
     void setTaillightBrake();
 
+    /// @brief Called on the network thread for every telemetry message. Can be replaced while the car is running.
     void registerTelemetryCallback(std::function<void(TinycarTelemetry)> callback);
+    /// @brief Last samples of a metric with percentiles, for plots and distributions
+    TimeSeries& getMetric(TinycarMetric metric);
     bool isAlive();
 private:
+    friend class TinycarFleet;
+    friend class TinycarReplay;
+
     /// @brief Sends the last control message to the car. However, it checks the time since the last message to avoid spamming the network.
     void sendControlMessage();
-
-    void tcfpFramePacketCallback(uint8_t *data, size_t len, tcfp_sender_report_t senderReport);
+    /// @brief Sends a control message that was held back by the anti spam delay. Reactor timer.
+    void flushControlMessage();
+    /// @brief Updates the alive state and reports changes. Reactor timer.
+    void checkAlive();
+    /// @brief Sends the latest control state. Control loop thread.
+    void controlTick();
+
+    void tcfpFramePacketCallback(TCFP_Frame frame);
+    /// @brief Hands a decoded frame to the consumer. Frame thread or decode worker, one at a time.
+    void deliverFrame(decoded_frame_t& frame);
     void tccpRTTCallback(uint32_t timestamp);
+    void tccpTelemetryCallback(tccp_telemetry_t telemetry);
+    /// @brief Forgets the frame numbers and sender timestamps of the stream, after the car restarted. Frame thread.
+    void senderRestarted();
+    /// @brief Starts the whole receive path over: reassembly, frame numbers, playout, clock sync and stream control.
+    /// For a replay that loops, its frame numbers and sender timestamps jump back. Receiving thread.
+    void resetReceiveState();
+    /// @brief Current time of the receive path: the wall clock, or the capture time of the datagram that is being replayed
+    std::chrono::steady_clock::time_point receiveTime();
 
     // for tcfp analysis
     uint32_t last_sender_timestamp = 0;
-    std::chrono::system_clock::time_point last_arrival_time;
+    std::chrono::steady_clock::time_point last_arrival_time;
     double jitter = 0.0;
-    std::chrono::system_clock::time_point last_packet_loss_calculation;
+    std::chrono::steady_clock::time_point last_packet_loss_calculation;
     uint32_t total_expected_packets = 0;
     uint32_t total_received_packets = 0;
     uint8_t packet_loss_percentage;
     uint8_t packets_per_frame;
-    uint8_t frame_latency;
-    uint32_t last_rtt_frame_timestamp = 0;
-    std::chrono::system_clock::time_point last_rtt_start_time;
+    std::atomic<uint32_t> frame_latency{0};
+    ClockSync clockSync;
+    TimeSeries metrics[(size_t)TinycarMetric::COUNT];
+    std::mutex telemetry_m; // the callback is called on the network thread and may be replaced by any other
+    std::function<void(TinycarTelemetry)> telemetryCallback;
 
 
     TCFP_Client tcfp_client;
     TCCP_Client tccp_client;
     std::string hostname;
+    tinycar_options_t options;
+    bool started = false;
     bool telemetryListenerRunning;
 
-    bool frameMatPulled;
-    cv::Mat frameMat;
+    FrameMailbox frameMailbox; // decoded frames, if the playout buffer is disabled
+    PlayoutBuffer playoutBuffer;
+    std::atomic<bool> playoutEnabled{false};
+    std::atomic<bool> errorConcealment{true};
+    std::atomic<uint64_t> concealed_frames{0};
+    StreamController streamController;
+    std::atomic<bool> streamControlEnabled{false};
+    cv::Mat lastImage; // last delivered frame, reference for concealment
+    uint16_t last_submitted_frame_num = 0;
+    bool frame_submitted = false;
     double current_fps;
 
     // Keeping the state since tccp is stateless
     tccp_control_t last_control_message; 
     // time of last message
-    std::chrono::time_point<std::chrono::system_clock> last_message_time;
-    std::chrono::time_point<std::chrono::system_clock> last_telemetry_time;
+    std::chrono::time_point<std::chrono::steady_clock> last_message_time;
+    std::chrono::time_point<std::chrono::steady_clock> last_telemetry_time;
+    // reactor mode only
+    std::mutex control_m;
+    tccp_control_t pending_control_message; // latest message held back by the anti spam delay
+    bool control_pending = false;
+    std::atomic<bool> alive{false};
+    std::shared_ptr<PacketCapture> capture;
+    // replay only, set by the replay thread before every datagram, so every run sees the timing of the capture
+    bool replayClock = false;
+    std::chrono::steady_clock::time_point replayTime;
+
+    // control loop, the control message packed into 64 bit so it can be handed over atomically
+    static_assert(sizeof(tccp_control_t) <= sizeof(uint64_t), "control message does not fit the setpoint");
+    std::atomic<uint64_t> controlSetpoint{0};
+    ControlLoop controlLoop; // stopped before the clients are destroyed
+    DecodePool decodePool; // workers deliver into the members above, stopped before they are destroyed
+
+    // declared last, so the network thread is stopped before anything it uses is destroyed
+    std::unique_ptr<NetReactor> reactor;
 };
\ No newline at end of file
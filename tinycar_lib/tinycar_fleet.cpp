@@ -0,0 +1,240 @@
+#include "tinycar_fleet.hpp"
+
+#include <fcntl.h>
+#include <algorithm>
+
+TinycarFleet::TinycarFleet(size_t decodeThreads) {
+    for (size_t i = 0; i < std::max(decodeThreads, (size_t)1); i++) {
+        workers.push_back(std::make_unique<fleet_worker_t>());
+    }
+#ifdef __linux__
+    for (int i = 0; i < RECV_BATCH_SIZE; i++) {
+        recvIovecs[i].iov_base = recvBuffers[i];
+        recvIovecs[i].iov_len = RECV_DGRAM_SIZE;
+        recvMsgs[i] = {};
+        recvMsgs[i].msg_hdr.msg_iov = &recvIovecs[i];
+        recvMsgs[i].msg_hdr.msg_iovlen = 1;
+        recvMsgs[i].msg_hdr.msg_name = &recvAddrs[i];
+        recvMsgs[i].msg_hdr.msg_control = recvControl[i];
+    }
+#endif
+}
+
+TinycarFleet::~TinycarFleet() {
+    stop();
+    if (tcfpSocket >= 0) {
+        close(tcfpSocket);
+    }
+    if (tccpSocket >= 0) {
+        close(tccpSocket);
+    }
+}
+
+std::shared_ptr<Tinycar> TinycarFleet::addCar(const std::string& hostname, const tinycar_options_t& options) {
+    if (running || cars.size() >= FLEET_MAX_CARS) {
+        std::cerr << "\033[1;31m[Tinycar] Fleet Error: cannot add " << hostname << ", fleet is running or full" << "\033[0m" << std::endl;
+        return nullptr;
+    }
+    struct in_addr addr;
+    if (inet_pton(AF_INET, hostname.c_str(), &addr) <= 0) {
+        std::cerr << "\033[1;31m[Tinycar] Fleet Error: " << hostname << " is not an IPv4 address" << "\033[0m" << std::endl;
+        return nullptr;
+    }
+    if (findCar(addr.s_addr) != nullptr) {
+        std::cerr << "\033[1;31m[Tinycar] Fleet Error: " << hostname << " is already part of the fleet" << "\033[0m" << std::endl;
+        return nullptr;
+    }
+
+    if (!options.capturePath.empty()) {
+        std::cerr << "\033[1;33m[Tinycar] Fleet Warning: capturing is not supported for fleets, " << hostname << " is not captured" << "\033[0m" << std::endl;
+    }
+    tinycar_options_t carOptions = options;
+    carOptions.sharedNetwork = true;
+    fleet_car_t entry;
+    entry.addr = addr.s_addr;
+    entry.car = std::make_shared<Tinycar>(hostname, carOptions);
+    entry.worker = cars.size() % workers.size();
+    // frames leave the network thread right after reassembly
+    fleet_worker_t* worker = workers[entry.worker].get();
+    Tinycar* car = entry.car.get();
+    car->tcfp_client.registerFramePacketCallback([this, worker, car](TCFP_Frame frame) {
+        queueFrame(worker, car, std::move(frame));
+    });
+    cars.push_back(entry);
+    return entry.car;
+}
+
+int TinycarFleet::openSocket(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    sockaddr_in servaddr = {0};
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = INADDR_ANY;
+    servaddr.sin_port = htons(port);
+    if (bind(fd, (const struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+        std::cerr << "\033[1;31m[Tinycar] Fleet Error: bind error for port " << port << ": " << errno << "\033[0m" << std::endl;
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+int TinycarFleet::start(int cpu) {
+    if (running) {
+        return 0;
+    }
+    for (auto& entry : cars) {
+        // sharedNetwork, starts no threads
+        entry.car->start();
+    }
+    tcfpSocket = openSocket(RTP_PORT);
+    tccpSocket = openSocket(TCCP_PORT);
+    if (tcfpSocket < 0 || tccpSocket < 0) {
+        return -1;
+    }
+    tcfpEnableTimestamps(tcfpSocket);
+    reactor.addSocket(tcfpSocket, [this]() { receiveFrames(); });
+    reactor.addSocket(tccpSocket, [this]() { receiveControl(); });
+    reactor.addTimer(RETRANSMISSION_TIMER_INTERVAL, [this]() {
+        for (auto& entry : cars) {
+            entry.car->tcfp_client.expireFrames();
+        }
+    });
+
+    running = true;
+    for (auto& worker : workers) {
+        worker->thread = std::thread(&TinycarFleet::decode_task, this, worker.get());
+    }
+    reactor.start(cpu);
+    std::cout << "\033[1;32m[Tinycar] Fleet Info: receiving for " << cars.size() << " cars." << "\033[0m" << std::endl;
+    return 0;
+}
+
+void TinycarFleet::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    reactor.stop();
+    for (auto& worker : workers) {
+        {
+            std::lock_guard<std::mutex> lk(worker->m);
+            worker->jobs.clear();
+        }
+        worker->cv.notify_all();
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+size_t TinycarFleet::getCarCount() {
+    return cars.size();
+}
+
+std::shared_ptr<Tinycar> TinycarFleet::getCar(size_t index) {
+    if (index >= cars.size()) {
+        return nullptr;
+    }
+    return cars[index].car;
+}
+
+uint64_t TinycarFleet::getUnknownDatagramCount() {
+    return unknownDatagrams.load(std::memory_order_relaxed);
+}
+
+TinycarFleet::fleet_car_t* TinycarFleet::findCar(in_addr_t addr) {
+    // a handful of cars, a linear search beats hashing
+    for (auto& entry : cars) {
+        if (entry.addr == addr) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+void TinycarFleet::receiveFrames() {
+    // drain the socket, but give the control socket and timers a chance under load
+    for (int batch = 0; batch < REACTOR_RECV_BATCHES; batch++) {
+#ifdef __linux__
+        for (int i = 0; i < RECV_BATCH_SIZE; i++) {
+            recvMsgs[i].msg_hdr.msg_namelen = sizeof(recvAddrs[i]);
+            recvMsgs[i].msg_hdr.msg_controllen = TCFP_TIMESTAMP_CONTROL_SIZE;
+        }
+        int count = recvmmsg(tcfpSocket, recvMsgs, RECV_BATCH_SIZE, MSG_DONTWAIT, nullptr);
+        if (count <= 0) {
+            return;
+        }
+        TCFP_ArrivalClock clock;
+        for (int i = 0; i < count; i++) {
+            fleet_car_t* entry = findCar(recvAddrs[i].sin_addr.s_addr);
+            if (entry == nullptr) {
+                unknownDatagrams.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            entry->car->tcfp_client.receiveDatagram(recvBuffers[i], recvMsgs[i].msg_len, clock.arrival(&recvMsgs[i].msg_hdr));
+        }
+#else
+        socklen_t socklen = sizeof(recvAddrs[0]);
+        int n = recvfrom(tcfpSocket, recvBuffers[0], RECV_DGRAM_SIZE, MSG_DONTWAIT, (struct sockaddr *)&recvAddrs[0], &socklen);
+        if (n < 0) {
+            return;
+        }
+        fleet_car_t* entry = findCar(recvAddrs[0].sin_addr.s_addr);
+        if (entry == nullptr) {
+            unknownDatagrams.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        entry->car->tcfp_client.receiveDatagram(recvBuffers[0], n);
+#endif
+    }
+}
+
+void TinycarFleet::receiveControl() {
+    uint8_t buffer[128];
+    struct sockaddr_in source_addr;
+    while (true) {
+        socklen_t socklen = sizeof(source_addr);
+        int n = recvfrom(tccpSocket, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *)&source_addr, &socklen);
+        if (n < 0) {
+            return;
+        }
+        fleet_car_t* entry = findCar(source_addr.sin_addr.s_addr);
+        if (entry == nullptr) {
+            unknownDatagrams.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        entry->car->tccp_client.handleMessage(buffer, n);
+    }
+}
+
+void TinycarFleet::queueFrame(fleet_worker_t* worker, Tinycar* car, TCFP_Frame frame) {
+    {
+        std::lock_guard<std::mutex> lk(worker->m);
+        for (auto& job : worker->jobs) {
+            if (job.car == car) {
+                // frames complete out of order, keep the newer one. The other one goes back to the pool.
+                if (tcfpFrameNumBefore(job.frame->frame_num, frame->frame_num)) {
+                    job.frame = std::move(frame);
+                }
+                return;
+            }
+        }
+        worker->jobs.push_back({car, std::move(frame)});
+    }
+    worker->cv.notify_one();
+}
+
+void TinycarFleet::decode_task(fleet_worker_t* worker) {
+    std::unique_lock<std::mutex> lk(worker->m);
+    while (true) {
+        worker->cv.wait(lk, [this, worker]{ return !worker->jobs.empty() || !running; });
+        if (!running) {
+            return;
+        }
+        fleet_job_t job = std::move(worker->jobs.front());
+        worker->jobs.pop_front();
+        lk.unlock();
+        job.car->tcfpFramePacketCallback(std::move(job.frame));
+        lk.lock();
+    }
+}
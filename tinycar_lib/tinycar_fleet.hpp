@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+#include "tinycar.hpp"
+#include "net_reactor.hpp"
+
+#define FLEET_MAX_CARS 16
+#define FLEET_DECODE_THREADS 2 // default number of threads all cars share for decoding
+
+/// @brief Runs several cars from one runtime.
+///
+/// The fleet binds one socket per port (RTP_PORT and TCCP_PORT) and demultiplexes the datagrams by their IPv4 source address
+/// into the reassembly and telemetry state of each car. Reception and reassembly of all cars run on one network thread (see NetReactor),
+/// decoding on a small pool of threads. Each car is assigned to one decode thread, so its frames stay in order. The thread count
+/// does not grow with the number of cars.
+class TinycarFleet {
+public:
+    TinycarFleet(size_t decodeThreads = FLEET_DECODE_THREADS);
+    ~TinycarFleet();
+
+    /// @brief Adds a car. Must be called before start. Each car can be used like a standalone Tinycar (e.g. wrapped in a TinycarProvider).
+    /// Configure the car and register its callbacks before start as well, the network thread delivers to it from then on.
+    /// @param hostname IPv4 address of the car, datagrams are matched by it
+    /// @return nullptr if the address is invalid, already part of the fleet or the fleet is full
+    std::shared_ptr<Tinycar> addCar(const std::string& hostname, const tinycar_options_t& options = tinycar_options_t());
+    /// @brief Binds the shared sockets and starts the network and decode threads
+    /// @param cpu core the network thread is pinned to, -1 to not pin it
+    /// @return 0 on success, -1 if a socket could not be bound
+    int start(int cpu = -1);
+    void stop();
+
+    size_t getCarCount();
+    std::shared_ptr<Tinycar> getCar(size_t index);
+    /// @brief Datagrams from addresses that are not part of the fleet
+    uint64_t getUnknownDatagramCount();
+private:
+    typedef struct {
+        in_addr_t addr; // network byte order
+        std::shared_ptr<Tinycar> car;
+        size_t worker;
+    } fleet_car_t;
+
+    typedef struct {
+        Tinycar* car;
+        TCFP_Frame frame;
+    } fleet_job_t;
+
+    /// @brief Decode thread. Owns the cars with index % decodeThreads == index of the worker
+    typedef struct {
+        std::mutex m;
+        std::condition_variable cv;
+        std::deque<fleet_job_t> jobs;
+        std::thread thread;
+    } fleet_worker_t;
+
+    fleet_car_t* findCar(in_addr_t addr);
+    int openSocket(uint16_t port);
+    void receiveFrames();
+    void receiveControl();
+    /// @brief Queues a frame for decoding. A frame of the same car that is still waiting is dropped, the newest frame wins.
+    void queueFrame(fleet_worker_t* worker, Tinycar* car, TCFP_Frame frame);
+    void decode_task(fleet_worker_t* worker);
+
+    NetReactor reactor;
+    std::vector<fleet_car_t> cars;
+    std::vector<std::unique_ptr<fleet_worker_t>> workers;
+    std::atomic<bool> running{false};
+    std::atomic<uint64_t> unknownDatagrams{0};
+
+    int tcfpSocket = -1;
+    int tccpSocket = -1;
+    uint8_t recvBuffers[RECV_BATCH_SIZE][RECV_DGRAM_SIZE];
+    struct sockaddr_in recvAddrs[RECV_BATCH_SIZE];
+#ifdef __linux__
+    struct mmsghdr recvMsgs[RECV_BATCH_SIZE];
+    struct iovec recvIovecs[RECV_BATCH_SIZE];
+    // CMSG_FIRSTHDR reads a cmsghdr from the start of each buffer, CMSG_SPACE keeps the rows aligned
+    alignas(struct cmsghdr) uint8_t recvControl[RECV_BATCH_SIZE][TCFP_TIMESTAMP_CONTROL_SIZE];
+#endif
+};
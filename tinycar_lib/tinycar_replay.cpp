@@ -0,0 +1,94 @@
+#include "tinycar_replay.hpp"
+
+#include <chrono>
+#include <vector>
+
+TinycarReplay::TinycarReplay(const tinycar_options_t& options) {
+    tinycar_options_t carOptions = options;
+    carOptions.sharedNetwork = true;
+    carOptions.capturePath.clear();
+    car = std::make_shared<Tinycar>(REPLAY_HOSTNAME, carOptions);
+    // NACKs, RTT probes and stream control would go to whatever listens on the local TCCP port, e.g. an emulator
+    car->tccp_client.setSending(false);
+    car->replayClock = true;
+}
+
+TinycarReplay::~TinycarReplay() {
+    stop();
+}
+
+int TinycarReplay::start(const std::string& path, double speed, bool loop) {
+    stop();
+    if (reader.open(path) < 0) {
+        return -1;
+    }
+    this->path = path;
+    this->speed = speed;
+    this->loop = loop;
+    // frames are shown on the wall clock, the sender timestamps have to keep pace with the replay
+    car->playoutBuffer.setClockRate(speed > 0.0 ? speed : 1.0);
+    car->start();
+    finished = false;
+    running = true;
+    replayThread = std::thread(&TinycarReplay::replay_task, this);
+    std::cout << "\033[1;32m[Tinycar] Replay Info: playing " << path << "\033[0m" << std::endl;
+    return 0;
+}
+
+void TinycarReplay::stop() {
+    running = false;
+    if (replayThread.joinable()) {
+        replayThread.join();
+    }
+}
+
+bool TinycarReplay::isFinished() {
+    return finished;
+}
+
+std::shared_ptr<Tinycar> TinycarReplay::getCar() {
+    return car;
+}
+
+uint64_t TinycarReplay::getReplayedCount() {
+    return replayed.load(std::memory_order_relaxed);
+}
+
+void TinycarReplay::replay_task() {
+    std::vector<uint8_t> buffer(UINT16_MAX);
+    capture_record_t record;
+    auto start = std::chrono::steady_clock::now();
+    // the car runs on the clock of the capture at every speed, so deadlines, jitter and latencies are the same in every run
+    auto captureStart = start;
+    auto arrival = start;
+    while (running) {
+        if (!reader.next(record, buffer.data())) {
+            if (!loop || reader.open(path) < 0) {
+                break;
+            }
+            start = std::chrono::steady_clock::now();
+            // the capture clock must not run backwards
+            captureStart = arrival;
+            // frame numbers and sender timestamps start over, the car would take them for late frames
+            car->resetReceiveState();
+            continue;
+        }
+        if (speed > 0.0) {
+            auto due = start + std::chrono::nanoseconds((int64_t)(record.timestamp / speed));
+            std::this_thread::sleep_until(due);
+        }
+        arrival = captureStart + std::chrono::nanoseconds(record.timestamp);
+        car->replayTime = arrival;
+        if (record.stream == CAPTURE_STREAM_TCFP) {
+            car->tcfp_client.receiveDatagram(buffer.data(), record.length, arrival);
+        } else if (record.stream == CAPTURE_STREAM_TCCP) {
+            car->tccp_client.handleMessage(buffer.data(), record.length);
+        }
+        // there is no timer thread, deadlines are checked after every datagram
+        car->tcfp_client.expireFrames(arrival);
+        replayed.fetch_add(1, std::memory_order_relaxed);
+    }
+    reader.close();
+    finished = true;
+    std::cout << "\033[1;32m[Tinycar] Replay Info: replayed " << replayed << " datagrams" << "\033[0m" << std::endl;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+
+#include "tinycar.hpp"
+#include "packet_capture.hpp"
+
+#define REPLAY_HOSTNAME "127.0.0.1" // never sent to, the replayed car does not send anything
+
+/// @brief Plays a capture of PacketCapture back into a car, with the original timing or faster.
+///
+/// The datagrams run through the same reassembly, FEC, retransmission and decoding as live traffic, on a single replay thread.
+/// The car can be used like a connected Tinycar (e.g. wrapped in a TinycarProvider). Runs are repeatable: for a given capture the
+/// same datagrams arrive in the same order and with the arrival times of the capture, only the wall clock spacing depends on the speed.
+/// Messages the car would send (NACKs, RTT probes, stream control, control) are dropped.
+class TinycarReplay {
+public:
+    TinycarReplay(const tinycar_options_t& options = tinycar_options_t());
+    ~TinycarReplay();
+
+    /// @brief Opens the capture and starts playing it
+    /// @param speed 1.0 keeps the original timing, 2.0 plays twice as fast, 0 as fast as possible
+    /// @param loop start over at the end of the capture, the car starts over with it
+    /// @return 0 on success, -1 if the capture could not be opened
+    int start(const std::string& path, double speed = 1.0, bool loop = false);
+    void stop();
+    /// @brief true after the last record was played (never if looping)
+    bool isFinished();
+
+    std::shared_ptr<Tinycar> getCar();
+    uint64_t getReplayedCount();
+private:
+    void replay_task();
+
+    std::shared_ptr<Tinycar> car;
+    PacketCaptureReader reader;
+    std::string path;
+    double speed;
+    bool loop;
+    std::thread replayThread;
+    std::atomic<bool> running{false};
+    std::atomic<bool> finished{false};
+    std::atomic<uint64_t> replayed{0};
+};